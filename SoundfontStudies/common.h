@@ -13,6 +13,38 @@
 #define f32 float
 #define f64 double
 
+#ifndef _MSC_VER
+// The bounds checked C functions used in this library only exist on MSVC, these do the same thing everywhere else
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+inline int fopen_s(FILE** file, const char* path, const char* mode) {
+    *file = fopen(path, mode);
+    return *file ? 0 : errno;
+}
+inline size_t fread_s(void* buffer, const size_t buffer_size, const size_t element_size, const size_t count, FILE* file) {
+    if (element_size == 0) return 0;
+    return fread(buffer, element_size, count < buffer_size / element_size ? count : buffer_size / element_size, file);
+}
+inline int memcpy_s(void* destination, const size_t destination_size, const void* source, const size_t count) {
+    if (count > destination_size) {
+        memset(destination, 0, destination_size);
+        return ERANGE;
+    }
+    memcpy(destination, source, count);
+    return 0;
+}
+template <size_t N>
+inline int strncpy_s(char (&destination)[N], const char* source, const size_t count) {
+    size_t length = 0;
+    while (length < count && length < N - 1 && source[length] != '\0')
+        length++;
+    memcpy(destination, source, length);
+    destination[length] = '\0';
+    return 0;
+}
+#endif
+
 namespace Flan {
     template<typename T>
     T lerp(T a, T b, float t) {
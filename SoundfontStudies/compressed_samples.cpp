@@ -0,0 +1,355 @@
+#include "compressed_samples.h"
+#include <algorithm>
+#include <bit>
+#include <cstdlib>
+#include <cstring>
+#include "parallel.h"
+
+namespace Flan {
+    // Block layout: one byte with the predictor order (or raw_block), then for every partition of partition_frames residuals
+    // a 5-bit Rice parameter, followed by the Rice codes of the residuals. Bits are packed starting at the lowest bit of each byte.
+    // A Rice code is the quotient as that many zero bits and a one bit, then the lowest k bits of the value. Values whose quotient
+    // doesn't fit in max_quotient bits are escaped as max_quotient zero bits, followed by escape_bits bits of the value itself.
+    static constexpr u32 partition_frames = 256;
+    static constexpr u32 max_quotient = 24;
+    static constexpr u32 escape_bits = 20;
+    static constexpr u32 max_order = 2;
+    static constexpr u8 raw_block = 3;
+
+    // Predict a sample from the two before it, samples before the block are treated as silence
+    static i32 predict(const u32 order, const i32 previous1, const i32 previous2) {
+        switch (order) {
+        case 1: return previous1;
+        case 2: return 2 * previous1 - previous2;
+        default: return 0;
+        }
+    }
+
+    // Map signed residuals to unsigned ones: 0, -1, 1, -2, 2, ...
+    static u32 zigzag(const i32 value) { return (static_cast<u32>(value) << 1) ^ static_cast<u32>(value >> 31); }
+    static i32 unzigzag(const u32 value) { return static_cast<i32>(value >> 1) ^ -static_cast<i32>(value & 1); }
+
+    static u32 rice_bits(const u32 value, const u32 k) {
+        const u32 quotient = value >> k;
+        return quotient < max_quotient ? quotient + 1 + k : max_quotient + escape_bits;
+    }
+
+    struct BitWriter {
+        std::vector<u8>& output;
+        u64 buffer = 0;
+        u32 n_bits = 0;
+
+        void write(const u32 value, const u32 bits) {
+            buffer |= static_cast<u64>(value) << n_bits;
+            n_bits += bits;
+            while (n_bits >= 8) {
+                output.push_back(static_cast<u8>(buffer));
+                buffer >>= 8;
+                n_bits -= 8;
+            }
+        }
+        void flush() {
+            if (n_bits > 0)
+                output.push_back(static_cast<u8>(buffer));
+            buffer = 0;
+            n_bits = 0;
+        }
+    };
+
+    struct BitReader {
+        const u8* data;
+        const u8* end;
+        u64 buffer = 0;
+        u32 n_bits = 0;
+
+        // Make sure there are at least 57 bits in the buffer, reading zeros past the end of the data
+        void refill() {
+            while (n_bits <= 56) {
+                const u64 byte = data < end ? *data++ : 0;
+                buffer |= byte << n_bits;
+                n_bits += 8;
+            }
+        }
+        u32 read(const u32 bits) {
+            refill();
+            const u32 value = static_cast<u32>(buffer & ((1ull << bits) - 1));
+            buffer >>= bits;
+            n_bits -= bits;
+            return value;
+        }
+        u32 read_rice(const u32 k) {
+            refill();
+            const u32 quotient = std::min<u32>(std::countr_zero(buffer), max_quotient);
+            if (quotient == max_quotient) {
+                buffer >>= max_quotient;
+                n_bits -= max_quotient;
+                return read(escape_bits);
+            }
+            buffer >>= quotient + 1;
+            n_bits -= quotient + 1;
+            return (quotient << k) | read(k);
+        }
+    };
+
+    static void encode_block(const i16* samples, const u32 n_frames, std::vector<u8>& output) {
+        // Pick the predictor that leaves the smallest residuals
+        u32 order = 0;
+        u64 best_sum = ~0ull;
+        for (u32 candidate = 0; candidate <= max_order; candidate++) {
+            u64 sum = 0;
+            i32 previous1 = 0, previous2 = 0;
+            for (u32 i = 0; i < n_frames; i++) {
+                sum += static_cast<u64>(std::abs(samples[i] - predict(candidate, previous1, previous2)));
+                previous2 = previous1;
+                previous1 = samples[i];
+            }
+            if (sum < best_sum) {
+                best_sum = sum;
+                order = candidate;
+            }
+        }
+
+        // Calculate the residuals
+        std::vector<u32> residuals(n_frames);
+        i32 previous1 = 0, previous2 = 0;
+        for (u32 i = 0; i < n_frames; i++) {
+            residuals[i] = zigzag(samples[i] - predict(order, previous1, previous2));
+            previous2 = previous1;
+            previous1 = samples[i];
+        }
+
+        // Rice code every partition with the parameter that gives the fewest bits
+        const size_t block_start = output.size();
+        output.push_back(static_cast<u8>(order));
+        BitWriter writer{ output };
+        for (u32 first = 0; first < n_frames; first += partition_frames) {
+            const u32 last = std::min(first + partition_frames, n_frames);
+            u32 best_k = 0;
+            u64 best_bits = ~0ull;
+            for (u32 k = 0; k < escape_bits; k++) {
+                u64 bits = 0;
+                for (u32 i = first; i < last; i++)
+                    bits += rice_bits(residuals[i], k);
+                if (bits < best_bits) {
+                    best_bits = bits;
+                    best_k = k;
+                }
+            }
+            writer.write(best_k, 5);
+            for (u32 i = first; i < last; i++) {
+                const u32 quotient = residuals[i] >> best_k;
+                if (quotient < max_quotient) {
+                    writer.write(1u << quotient, quotient + 1);
+                    writer.write(residuals[i] & ((1u << best_k) - 1), best_k);
+                }
+                else {
+                    writer.write(0, max_quotient);
+                    writer.write(residuals[i], escape_bits);
+                }
+            }
+        }
+        writer.flush();
+
+        // Noise doesn't compress, store it as is if that's smaller
+        if (output.size() - block_start > 1 + n_frames * sizeof(i16)) {
+            output.resize(block_start + 1 + n_frames * sizeof(i16));
+            output[block_start] = raw_block;
+            memcpy(&output[block_start + 1], samples, n_frames * sizeof(i16));
+        }
+    }
+
+    static void decode_block_data(const u8* data, const u8* end, i16* samples, const u32 n_frames) {
+        const u8 order = *data++;
+        if (order == raw_block) {
+            memcpy(samples, data, n_frames * sizeof(i16));
+            return;
+        }
+
+        BitReader reader{ data, end };
+        i32 previous1 = 0, previous2 = 0;
+        for (u32 first = 0; first < n_frames; first += partition_frames) {
+            const u32 last = std::min(first + partition_frames, n_frames);
+            const u32 k = reader.read(5);
+            for (u32 i = first; i < last; i++) {
+                const i32 sample = unzigzag(reader.read_rice(k)) + predict(order, previous1, previous2);
+                samples[i] = static_cast<i16>(sample);
+                previous2 = previous1;
+                previous1 = sample;
+            }
+        }
+    }
+
+    void CompressedSamples::compress(const std::vector<Sample>& samples, const u32 cache_blocks, const u32 n_threads) {
+        clear();
+
+        // Split every sample into blocks
+        struct Block {
+            const i16* data;
+            u32 n_frames;
+        };
+        std::vector<Block> blocks;
+        _samples.resize(samples.size());
+        _loop_offsets.resize(samples.size(), no_loop);
+        u64 loop_frames = 0;
+        auto add_blocks = [&](const i16* data, const u32 n_frames) {
+            for (u32 frame = 0; frame < n_frames; frame += block_frames)
+                blocks.push_back({ data + frame, std::min(block_frames, n_frames - frame) });
+        };
+        for (size_t i = 0; i < samples.size(); i++) {
+            const Sample& sample = samples[i];
+            const u32 length = sample.data ? sample.length : 0;
+            SampleInfo& info = _samples[i];
+            info.length = length;
+            info.loop_start = length;
+            info.loop_end = length;
+            if (length > 0 && sample.loop_start < sample.loop_end && sample.loop_end <= length) {
+                info.loop_start = sample.loop_start;
+                info.loop_end = sample.loop_end;
+                _loop_offsets[i] = loop_frames;
+                loop_frames += sample.loop_end - sample.loop_start;
+            }
+
+            // The loop itself only goes into _loop_data
+            info.first_block = static_cast<u32>(blocks.size());
+            add_blocks(sample.data, info.loop_start);
+            info.first_tail_block = static_cast<u32>(blocks.size());
+            add_blocks(sample.data + info.loop_end, length - info.loop_end);
+        }
+
+        // Keep the loops as they are
+        _loop_data.resize(loop_frames);
+        for (size_t i = 0; i < samples.size(); i++) {
+            if (_loop_offsets[i] != no_loop)
+                memcpy(&_loop_data[_loop_offsets[i]], samples[i].data + samples[i].loop_start, (samples[i].loop_end - samples[i].loop_start) * sizeof(i16));
+        }
+
+        // Compress the blocks in parallel, then put them after each other
+        std::vector<std::vector<u8>> compressed(blocks.size());
+        parallel_for(blocks.size(), n_threads, [&](const size_t i) {
+            encode_block(blocks[i].data, blocks[i].n_frames, compressed[i]);
+        });
+        u64 stream_size = 0;
+        for (const auto& block : compressed)
+            stream_size += block.size();
+        _stream.reserve(stream_size);
+        _block_offsets.reserve(blocks.size() + 1);
+        _block_frames.reserve(blocks.size());
+        for (size_t i = 0; i < blocks.size(); i++) {
+            _block_offsets.push_back(_stream.size());
+            _block_frames.push_back(blocks[i].n_frames);
+            _stream.insert(_stream.end(), compressed[i].begin(), compressed[i].end());
+        }
+        _block_offsets.push_back(_stream.size());
+
+        // Set up the decode cache
+        const u32 n_slots = std::max(cache_blocks, 1u);
+        _cache_data.resize(static_cast<size_t>(n_slots) * block_frames);
+        _cache_blocks.assign(n_slots, ~0u);
+        _cache_last_used.assign(n_slots, 0);
+        _cache_users.assign(n_slots, 0);
+        _cache_ready.assign(n_slots, 0);
+    }
+
+    void CompressedSamples::clear() {
+        std::lock_guard lock(_cache_mutex);
+        _samples = {};
+        _stream = {};
+        _block_offsets = {};
+        _block_frames = {};
+        _loop_data = {};
+        _loop_offsets = {};
+        _cache_data = {};
+        _cache_blocks = {};
+        _cache_last_used = {};
+        _cache_users = {};
+        _cache_ready = {};
+        _cache_slots.clear();
+        _cache_clock = 0;
+    }
+
+    void CompressedSamples::decode_block(const u32 block_index, i16* samples) const {
+        decode_block_data(&_stream[_block_offsets[block_index]], _stream.data() + _block_offsets[block_index + 1], samples, _block_frames[block_index]);
+    }
+
+    void CompressedSamples::copy_block(const u32 block_index, const u32 offset, i16* destination, const u32 n_frames) {
+        // Find the block in the cache, or claim the least recently used slot that isn't in use to decode it into.
+        // If another thread is still decoding the block, or every slot is in use, don't wait and decode it here instead
+        u32 slot = no_slot;
+        bool ready = false;
+        {
+            std::lock_guard lock(_cache_mutex);
+            if (const auto cached = _cache_slots.find(block_index); cached != _cache_slots.end()) {
+                if (_cache_ready[cached->second]) {
+                    slot = cached->second;
+                    ready = true;
+                }
+            }
+            else {
+                for (u32 i = 0; i < _cache_users.size(); i++) {
+                    if (_cache_users[i] == 0 && (slot == no_slot || _cache_last_used[i] < _cache_last_used[slot]))
+                        slot = i;
+                }
+                if (slot != no_slot) {
+                    if (_cache_blocks[slot] != ~0u)
+                        _cache_slots.erase(_cache_blocks[slot]);
+                    _cache_blocks[slot] = block_index;
+                    _cache_ready[slot] = false;
+                    _cache_slots[block_index] = slot;
+                }
+            }
+            if (slot != no_slot) {
+                _cache_users[slot]++;
+                _cache_last_used[slot] = ++_cache_clock;
+            }
+        }
+        if (slot == no_slot) {
+            i16 samples[block_frames];
+            decode_block(block_index, samples);
+            memcpy(destination, samples + offset, n_frames * sizeof(i16));
+            return;
+        }
+
+        // The slot isn't reused while this thread uses it, so it can be decoded into and copied from without the lock
+        i16* samples = &_cache_data[static_cast<size_t>(slot) * block_frames];
+        if (!ready)
+            decode_block(block_index, samples);
+        memcpy(destination, samples + offset, n_frames * sizeof(i16));
+        std::lock_guard lock(_cache_mutex);
+        _cache_ready[slot] = true;
+        _cache_users[slot]--;
+    }
+
+    void CompressedSamples::read(const u32 sample_index, u32 first_frame, i16* destination, u32 n_frames) {
+        if (sample_index >= _samples.size()) {
+            memset(destination, 0, n_frames * sizeof(i16));
+            return;
+        }
+        const SampleInfo& sample = _samples[sample_index];
+        const i16* loop = _loop_offsets[sample_index] == no_loop ? nullptr : _loop_data.data() + _loop_offsets[sample_index];
+        while (n_frames > 0) {
+            u32 n_copy;
+            if (first_frame >= sample.length) {
+                // Past the end
+                memset(destination, 0, n_frames * sizeof(i16));
+                return;
+            }
+            if (loop && first_frame >= sample.loop_start && first_frame < sample.loop_end) {
+                // Inside the loop, which doesn't need decoding
+                n_copy = std::min(n_frames, sample.loop_end - first_frame);
+                memcpy(destination, loop + (first_frame - sample.loop_start), n_copy * sizeof(i16));
+            }
+            else {
+                // Decode the block, from the blocks before or after the loop. Blocks before the loop end at the loop start
+                const bool tail = first_frame >= sample.loop_end;
+                const u32 part_frame = tail ? first_frame - sample.loop_end : first_frame;
+                const u32 block = (tail ? sample.first_tail_block : sample.first_block) + part_frame / block_frames;
+                const u32 offset = part_frame % block_frames;
+                n_copy = std::min(n_frames, _block_frames[block] - offset);
+                copy_block(block, offset, destination, n_copy);
+            }
+            destination += n_copy;
+            first_frame += n_copy;
+            n_frames -= n_copy;
+        }
+    }
+}
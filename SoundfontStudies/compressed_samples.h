@@ -0,0 +1,68 @@
+#pragma once
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "structs.h"
+
+namespace Flan {
+    // Lossless compressed storage for sample data. Every sample is split into blocks of block_frames samples, which are compressed
+    // on their own with a fixed linear predictor and Rice coded residuals, so any block can be decoded without the ones before it.
+    // Recently decoded blocks are kept in a small LRU cache. Loops are kept uncompressed, since they're played over and over again,
+    // so they're left out of the blocks: a sample with a loop has blocks for the part before the loop, and for the part after it.
+    class CompressedSamples {
+    public:
+        static constexpr u32 block_frames = 4096;
+
+        CompressedSamples() = default;
+        CompressedSamples(const CompressedSamples&) = delete;
+        CompressedSamples& operator=(const CompressedSamples&) = delete;
+
+        // Compress the data of every sample, using up to n_threads threads (0 = one per hardware thread). The samples' data pointers
+        // aren't used anymore afterwards. cache_blocks is the number of decoded blocks to keep around
+        void compress(const std::vector<Sample>& samples, u32 cache_blocks, u32 n_threads);
+        void clear();
+
+        // Copy n_frames samples of a sample starting at first_frame into destination, decoding blocks as needed.
+        // Samples past the end of the sample are silence. Safe to call from multiple threads.
+        void read(u32 sample_index, u32 first_frame, i16* destination, u32 n_frames);
+
+        // Number of samples in a sample, 0 if it had no data when it was compressed
+        [[nodiscard]] u32 length(const u32 sample_index) const { return sample_index < _samples.size() ? _samples[sample_index].length : 0; }
+
+        // The uncompressed copy of a sample's loop, or nullptr if the sample has no loop
+        [[nodiscard]] i16* loop_data(u32 sample_index) { return _loop_offsets[sample_index] == no_loop ? nullptr : &_loop_data[_loop_offsets[sample_index]]; }
+
+        // Size of the compressed data and the loops, in bytes
+        [[nodiscard]] u64 memory_usage() const { return _stream.size() + _loop_data.size() * sizeof(i16); }
+
+    private:
+        static constexpr u64 no_loop = ~0ull;
+        static constexpr u32 no_slot = ~0u;
+        void decode_block(u32 block_index, i16* samples) const;
+        void copy_block(u32 block_index, u32 offset, i16* destination, u32 n_frames);
+
+        struct SampleInfo {
+            u32 first_block = 0;       // Blocks from the start of the sample up to the loop start, or the whole sample if it has no loop
+            u32 first_tail_block = 0;  // Blocks from the loop end up to the end of the sample
+            u32 length = 0;
+            u32 loop_start = 0;        // Both equal to length if the sample has no loop
+            u32 loop_end = 0;
+        };
+        std::vector<SampleInfo> _samples;
+        std::vector<u8> _stream;           // All compressed blocks after each other
+        std::vector<u64> _block_offsets;   // Start of every block in the stream, plus the end of the stream
+        std::vector<u32> _block_frames;    // Number of samples in every block, only the last block of a sample can be shorter
+        std::vector<i16> _loop_data;
+        std::vector<u64> _loop_offsets;    // Where each sample's loop starts in _loop_data, or no_loop
+
+        // Decode cache. _cache_mutex is only held to find or claim a slot, blocks are decoded and copied without it
+        std::mutex _cache_mutex;
+        std::vector<i16> _cache_data;              // Decoded samples of every cache slot
+        std::vector<u32> _cache_blocks;            // Block index in every slot
+        std::vector<u64> _cache_last_used;         // When every slot was last used, the slot with the lowest value is reused first
+        std::vector<u32> _cache_users;             // Number of threads decoding into or copying from every slot, slots in use aren't reused
+        std::vector<u8> _cache_ready;              // False while a slot's block is still being decoded
+        std::unordered_map<u32, u32> _cache_slots; // Block index -> cache slot
+        u64 _cache_clock = 0;
+    };
+}
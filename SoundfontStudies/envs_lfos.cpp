@@ -1,7 +1,13 @@
 #include "envs_lfos.h"
 
 #include <algorithm>
-#include <corecrt_math.h>
+#include <cmath>
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FLAN_SSE2
+#include <emmintrin.h>
+#endif
 
 namespace Flan {
     void EnvState::update(const EnvParams& env_params, const double dt, const bool correct_attack_phase)
@@ -49,26 +55,186 @@ namespace Flan {
         }
     }
 
-    void LfoState::update(const LfoParams& lfo_params, const double dt)
+    // Number of frames it takes to cover a distance with a step per frame, up to max_frames. Stages end on the frame that reaches the distance,
+    // which is the first frame if the distance is already covered (like a release that starts below -100 dB)
+    static u32 frames_until(const double distance, const double step, const u32 max_frames)
+    {
+        if (step <= 0.0)
+            return max_frames;
+        const double frames = std::ceil(distance / step);
+        if (frames <= 1.0)
+            return 1;
+        return frames < static_cast<double>(max_frames) ? static_cast<u32>(frames) : max_frames;
+    }
+
+    // Write gains that start at gain * ratio and get multiplied by ratio every frame
+    static void fill_geometric(float* gains, const u32 n_frames, double gain, const double ratio)
+    {
+        for (u32 i = 0; i < n_frames; i++) {
+            gain *= ratio;
+            gains[i] = static_cast<float>(gain);
+        }
+    }
+
+    void EnvState::render_block(const EnvParams& env_params, const double dt, const bool correct_attack_phase, float* gains, const u32 n_frames)
     {
-        // Step time
-        time += dt;
+        u32 frame = 0;
+        while (frame < n_frames) {
+            const u32 frames_left = n_frames - frame;
+            float* segment = gains + frame;
+            switch (static_cast<EnvStage>(stage)) {
+            case delay: {
+                const double step = env_params.delay * dt;
+                const u32 n = frames_until(static_cast<double>(attack) - stage, step, frames_left);
+                stage = std::min(static_cast<double>(attack), stage + step * n);
+                value = -100.0;
+                std::fill_n(segment, n, static_cast<float>(exp2(value / 6.0)));
+                frame += n;
+                break;
+            }
+            case attack: {
+                const double step = env_params.attack * dt;
+                const double progress = stage - static_cast<double>(attack);
+                const u32 n = frames_until(static_cast<double>(hold) - stage, step, frames_left);
+                stage = std::min(static_cast<double>(hold), stage + step * n);
+                if (correct_attack_phase) {
+                    // 6 * log2(progress) dB is a linear ramp in gain
+                    for (u32 i = 0; i < n; i++)
+                        segment[i] = static_cast<float>(std::min(1.0, progress + step * (i + 1)));
+                    value = 6 * log2(stage - static_cast<double>(attack));
+                }
+                else {
+                    // A linear ramp in dB is a geometric ramp in gain
+                    fill_geometric(segment, n, exp2((-100.0 + 100 * progress) / 6.0), exp2(100 * step / 6.0));
+                    value = -100.0 + 100 * (stage - static_cast<double>(attack));
+                }
+                segment[n - 1] = static_cast<float>(exp2(value / 6.0));
+                frame += n;
+                break;
+            }
+            case hold: {
+                const double step = env_params.hold * dt;
+                const u32 n = frames_until(static_cast<double>(decay) - stage, step, frames_left);
+                stage = std::min(static_cast<double>(decay), stage + step * n);
+                value = 0.0;
+                std::fill_n(segment, n, 1.0f);
+                frame += n;
+                break;
+            }
+            case decay: {
+                // Decay stops on the first frame that goes below the sustain level
+                const double step = env_params.decay * dt;
+                const double frames_to_sustain = step > 0.0 ? std::floor((value - env_params.sustain) / step) + 1.0 : static_cast<double>(frames_left);
+                const u32 n = static_cast<u32>(std::clamp(frames_to_sustain, 1.0, static_cast<double>(frames_left)));
+                fill_geometric(segment, n, exp2(value / 6.0), exp2(-step / 6.0));
+                value -= step * n;
+                if (value < env_params.sustain) {
+                    value = env_params.sustain;
+                    stage = static_cast<double>(sustain);
+                    segment[n - 1] = static_cast<float>(exp2(value / 6.0));
+                }
+                frame += n;
+                break;
+            }
+            case sustain:
+                stage = static_cast<double>(sustain);
+                value = env_params.sustain;
+                std::fill_n(segment, frames_left, static_cast<float>(exp2(value / 6.0)));
+                frame = n_frames;
+                break;
+            case release: {
+                // Release stops on the first frame that reaches -100 dB
+                stage = static_cast<double>(release);
+                const double step = env_params.release * dt;
+                const u32 n = frames_until(value + 100.0, step, frames_left);
+                fill_geometric(segment, n, exp2(value / 6.0), exp2(-step / 6.0));
+                value -= step * n;
+                if (value <= -100.0) {
+                    value = -100.0;
+                    stage = static_cast<double>(off);
+                    segment[n - 1] = static_cast<float>(exp2(value / 6.0));
+                }
+                frame += n;
+                break;
+            }
+            default:
+                std::fill_n(segment, frames_left, static_cast<float>(exp2(value / 6.0)));
+                frame = n_frames;
+                break;
+            }
+        }
+    }
 
+    void LfoState::update(const LfoParams& lfo_params, const double dt)
+    {
         // Handle delay
         if (time < lfo_params.delay) {
-            state = 0.0;
+            time += dt;
+            if (time < lfo_params.delay) {
+                state = 0.0;
+                return;
+            }
+            phase = (time - lfo_params.delay) * lfo_params.freq;
         }
         else {
-            state = sin((time - lfo_params.delay) * lfo_params.freq * 2.0 * 3.141592653589793);
+            phase += lfo_params.freq * dt;
+        }
+
+        // Keep the phase wrapped, so it doesn't lose precision on long notes
+        phase -= std::floor(phase);
+        state = sin(phase * 2.0 * 3.141592653589793);
+    }
+
+    void LfoState::render_block(const LfoParams& lfo_params, const double dt, float* values, const u32 n_frames)
+    {
+        if (n_frames == 0)
+            return;
+        u32 frame = 0;
+
+        // Handle delay, the LFO starts on the first frame where the time reaches the delay
+        if (time < lfo_params.delay) {
+            const double frames_to_start = dt > 0.0 ? std::ceil((lfo_params.delay - time) / dt) : static_cast<double>(n_frames) + 1.0;
+            if (frames_to_start > static_cast<double>(n_frames)) {
+                std::fill_n(values, n_frames, 0.0f);
+                time += dt * n_frames;
+                state = 0.0;
+                return;
+            }
+            frame = std::max(1u, static_cast<u32>(frames_to_start)) - 1;
+            std::fill_n(values, frame, 0.0f);
+            time += dt * (frame + 1);
+            phase = (time - lfo_params.delay) * lfo_params.freq;
+            phase -= std::floor(phase);
+            state = sin(phase * 2.0 * 3.141592653589793);
+            values[frame++] = static_cast<float>(state);
+            if (frame == n_frames)
+                return;
         }
+
+        // Rotate a (sin, cos) pair by the phase step every frame. It starts from the exact phase every block, so errors can't build up
+        const double step = lfo_params.freq * dt;
+        const double angle = step * 2.0 * 3.141592653589793;
+        const double rotate_sin = sin(angle);
+        const double rotate_cos = cos(angle);
+        double current_sin = sin(phase * 2.0 * 3.141592653589793);
+        double current_cos = cos(phase * 2.0 * 3.141592653589793);
+        const u32 n_left = n_frames - frame;
+        for (; frame < n_frames; frame++) {
+            const double next_sin = current_sin * rotate_cos + current_cos * rotate_sin;
+            current_cos = current_cos * rotate_cos - current_sin * rotate_sin;
+            current_sin = next_sin;
+            values[frame] = static_cast<float>(current_sin);
+        }
+        phase += step * n_left;
+        phase -= std::floor(phase);
+        state = current_sin;
     }
 
     void LowPassFilter::update(double dt, float& input_l, float& input_r)
     {
         resonance = std::clamp(resonance, 0.0f, 2.0f);
-        const float feedback = (resonance + resonance / (1.0f - cutoff));
-        const float two_pi_fc = 2.0f * 3.141592653589f * cutoff * static_cast<float>(dt);
-        const float a = two_pi_fc / (two_pi_fc + 1);
+        float a, feedback;
+        get_coefficients(dt, a, feedback);
 
         // Left channel
         state1[0] += a * (input_l - state1[0] + feedback * (state1[0] - state2[0]));
@@ -86,4 +252,79 @@ namespace Flan {
         state2[0] = std::clamp(state2[0], -50.0f, +50.0f);
         state2[1] = std::clamp(state2[1], -50.0f, +50.0f);
     }
-}
\ No newline at end of file
+
+    void LowPassFilter::get_coefficients(const double dt, float& a, float& feedback) const
+    {
+        const float clamped_resonance = std::clamp(resonance, 0.0f, 2.0f);
+        feedback = (clamped_resonance + clamped_resonance / (1.0f - cutoff));
+        const float two_pi_fc = 2.0f * 3.141592653589f * cutoff * static_cast<float>(dt);
+        a = two_pi_fc / (two_pi_fc + 1);
+    }
+
+    void lowpass_filter_lanes(float* samples, const u32 n_frames, const u32 n_lanes, const float* a, const float* feedback, float* state1, float* state2)
+    {
+        u32 lane = 0;
+
+        // Same operations in the same order as LowPassFilter::update, so every lane gives exactly the same result as the scalar filter
+#if defined(__AVX__)
+        for (; lane + 8 <= n_lanes; lane += 8) {
+            const __m256 a_v = _mm256_loadu_ps(&a[lane]);
+            const __m256 feedback_v = _mm256_loadu_ps(&feedback[lane]);
+            const __m256 min_v = _mm256_set1_ps(-50.0f);
+            const __m256 max_v = _mm256_set1_ps(+50.0f);
+            __m256 state1_v = _mm256_loadu_ps(&state1[lane]);
+            __m256 state2_v = _mm256_loadu_ps(&state2[lane]);
+            for (u32 frame = 0; frame < n_frames; frame++) {
+                float* frame_samples = &samples[frame * n_lanes + lane];
+                const __m256 input = _mm256_loadu_ps(frame_samples);
+                const __m256 resonance_v = _mm256_mul_ps(feedback_v, _mm256_sub_ps(state1_v, state2_v));
+                state1_v = _mm256_add_ps(state1_v, _mm256_mul_ps(a_v, _mm256_add_ps(_mm256_sub_ps(input, state1_v), resonance_v)));
+                state2_v = _mm256_add_ps(state2_v, _mm256_mul_ps(a_v, _mm256_sub_ps(state1_v, state2_v)));
+                _mm256_storeu_ps(frame_samples, state2_v);
+                state1_v = _mm256_min_ps(_mm256_max_ps(state1_v, min_v), max_v);
+                state2_v = _mm256_min_ps(_mm256_max_ps(state2_v, min_v), max_v);
+            }
+            _mm256_storeu_ps(&state1[lane], state1_v);
+            _mm256_storeu_ps(&state2[lane], state2_v);
+        }
+#endif
+#if defined(__AVX__) || defined(FLAN_SSE2)
+        for (; lane + 4 <= n_lanes; lane += 4) {
+            const __m128 a_v = _mm_loadu_ps(&a[lane]);
+            const __m128 feedback_v = _mm_loadu_ps(&feedback[lane]);
+            const __m128 min_v = _mm_set1_ps(-50.0f);
+            const __m128 max_v = _mm_set1_ps(+50.0f);
+            __m128 state1_v = _mm_loadu_ps(&state1[lane]);
+            __m128 state2_v = _mm_loadu_ps(&state2[lane]);
+            for (u32 frame = 0; frame < n_frames; frame++) {
+                float* frame_samples = &samples[frame * n_lanes + lane];
+                const __m128 input = _mm_loadu_ps(frame_samples);
+                const __m128 resonance_v = _mm_mul_ps(feedback_v, _mm_sub_ps(state1_v, state2_v));
+                state1_v = _mm_add_ps(state1_v, _mm_mul_ps(a_v, _mm_add_ps(_mm_sub_ps(input, state1_v), resonance_v)));
+                state2_v = _mm_add_ps(state2_v, _mm_mul_ps(a_v, _mm_sub_ps(state1_v, state2_v)));
+                _mm_storeu_ps(frame_samples, state2_v);
+                state1_v = _mm_min_ps(_mm_max_ps(state1_v, min_v), max_v);
+                state2_v = _mm_min_ps(_mm_max_ps(state2_v, min_v), max_v);
+            }
+            _mm_storeu_ps(&state1[lane], state1_v);
+            _mm_storeu_ps(&state2[lane], state2_v);
+        }
+#endif
+
+        // Scalar fallback, for the lanes that are left over
+        for (; lane < n_lanes; lane++) {
+            float s1 = state1[lane];
+            float s2 = state2[lane];
+            for (u32 frame = 0; frame < n_frames; frame++) {
+                float& sample = samples[frame * n_lanes + lane];
+                s1 += a[lane] * (sample - s1 + feedback[lane] * (s1 - s2));
+                s2 += a[lane] * (s1 - s2);
+                sample = s2;
+                s1 = std::clamp(s1, -50.0f, +50.0f);
+                s2 = std::clamp(s2, -50.0f, +50.0f);
+            }
+            state1[lane] = s1;
+            state2[lane] = s2;
+        }
+    }
+}
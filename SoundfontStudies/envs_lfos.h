@@ -26,6 +26,9 @@ namespace Flan {
         double stage = delay;    // Current stage in ADSR. If floored to an integer and casted to ADSRstage, you get the actual ADSRstage as an enum
         double value = 0.0;    // Current envelope volume value in dB
         void update(const EnvParams& env_params, double dt, bool correct_attack_phase);
+        // Same as calling update() n_frames times, but writes the envelope as a linear gain for every frame (where -6 dB is 0.5x).
+        // Works out how many frames are left in each stage up front, and fills each stage in one loop, without per frame log2/exp2 calls
+        void render_block(const EnvParams& env_params, double dt, bool correct_attack_phase, float* gains, u32 n_frames);
     };
 
     struct LfoParams {
@@ -34,9 +37,13 @@ namespace Flan {
     };
 
     struct LfoState {
-        double time = 0.0;
+        double time = 0.0;  // Time since the LFO started in seconds, only counted up until the delay is over
+        double phase = 0.0; // Position in the current cycle, from 0.0 to 1.0
         double state = 0.0;
         void update(const LfoParams& lfo_params, double dt);
+        // Same as calling update() n_frames times, but writes the state of every frame to values.
+        // Uses a recursive oscillator, so there are only a few sin/cos calls per block instead of one per frame
+        void render_block(const LfoParams& lfo_params, double dt, float* values, u32 n_frames);
     };
 
     struct LowPassFilter {
@@ -45,5 +52,12 @@ namespace Flan {
         float state1[2] = { 0.0, 0.0 };
         float state2[2] = { 0.0, 0.0 };
         void update(double dt, float& input_l, float& input_r);
+        // Get the filter coefficients LowPassFilter::update uses, for a filter with this cutoff and resonance
+        void get_coefficients(double dt, float& a, float& feedback) const;
     };
+
+    // Runs the same filter as LowPassFilter::update on several mono signals at once, one signal per lane, using SSE or AVX when available.
+    // samples holds n_frames frames of n_lanes lanes, interleaved by lane (frame 0 of every lane, then frame 1 of every lane, etc), and
+    // is filtered in place. a, feedback, state1 and state2 hold one value per lane, see LowPassFilter::get_coefficients for a and feedback.
+    void lowpass_filter_lanes(float* samples, u32 n_frames, u32 n_lanes, const float* a, const float* feedback, float* state1, float* state2);
 }
\ No newline at end of file
@@ -0,0 +1,332 @@
+#include "interpolation.h"
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FLAN_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace Flan {
+    // Apply the zone's sample offsets, keeping everything inside the first playable_length samples
+    static void set_cursor_range(SampleCursor& cursor, const Sample& sample, const u32 playable_length, const Zone& zone) {
+        const i64 start = std::clamp<i64>(zone.sample_start_offset, 0, playable_length - 1);
+        const i64 end = std::clamp<i64>(static_cast<i64>(sample.length) + zone.sample_end_offset, start + 1, playable_length);
+        const i64 loop_start = std::clamp<i64>(static_cast<i64>(sample.loop_start) + zone.sample_loop_start_offset, start, end);
+        const i64 loop_end = std::clamp<i64>(static_cast<i64>(sample.loop_end) + zone.sample_loop_end_offset, loop_start, end);
+        cursor.position = static_cast<u64>(start) << 32;
+        cursor.end = static_cast<u32>(end);
+        cursor.loop_start = static_cast<u32>(loop_start);
+        cursor.loop_end = static_cast<u32>(loop_end);
+        cursor.loop_enable = zone.loop_enable && loop_end > loop_start;
+    }
+
+    SampleCursor SampleCursor::from_windowed_zone(const Sample& sample, const u32 length, const Zone& zone) {
+        SampleCursor cursor;
+        if (length > 0)
+            set_cursor_range(cursor, sample, length, zone);
+        return cursor;
+    }
+
+    SampleCursor SampleCursor::from_zone(const Sample& sample, const Zone& zone) {
+        SampleCursor cursor;
+        if (!sample.data || sample.resident_length == 0)
+            return cursor;
+        set_cursor_range(cursor, sample, sample.resident_length, zone);
+        cursor.data = sample.data;
+
+        // Padded samples can be read past their edges, as long as the zone doesn't move the end or the loop
+        if (sample.guard_frames > 0 && cursor.end == sample.length) {
+            cursor.guard_frames = sample.guard_frames;
+            if (cursor.loop_enable && cursor.loop_start == sample.loop_start && cursor.loop_end == sample.loop_end)
+                cursor.loop_data = sample.loop_data;
+        }
+
+        // Float samples are laid out like the 16-bit ones, so everything above holds for them too
+        if (sample.format == SampleFormat::float32) {
+            cursor.float_data = sample.float_data;
+            if (cursor.loop_data)
+                cursor.float_loop_data = sample.float_loop_data;
+        }
+        return cursor;
+    }
+
+    // Fractions are converted from their top 24 bits, which fit in a float exactly. That way the batched kernels below can convert
+    // them as signed 32-bit ints, and get exactly the same result as the kernels that do one frame at a time
+    static constexpr float fraction_scale = 1.0f / 16777216.0f;
+    static float fraction_to_float(const u32 fraction) {
+        return static_cast<float>(fraction >> 8) * fraction_scale;
+    }
+
+#ifdef FLAN_SSE2
+    // Tap number tap of 4 frames, as floats
+    template <typename T>
+    static __m128 gather_taps(const T* const (&taps)[4], const u32 tap) {
+        if constexpr (std::is_same_v<T, i16>)
+            return _mm_cvtepi32_ps(_mm_set_epi32(taps[3][tap], taps[2][tap], taps[1][tap], taps[0][tap]));
+        else
+            return _mm_set_ps(taps[3][tap], taps[2][tap], taps[1][tap], taps[0][tap]);
+    }
+
+    // The first tap of 4 frames from position on, and their fractions as floats
+    template <typename T>
+    static __m128 gather_frames(const T* data, const u32 left, u64 position, const u64 step, const T* (&taps)[4]) {
+        u32 fractions[4];
+        for (u32 i = 0; i < 4; i++, position += step) {
+            taps[i] = data + static_cast<i64>(position >> 32) - left;
+            fractions[i] = static_cast<u32>(position) >> 8;
+        }
+        const __m128i fractions_i32 = _mm_set_epi32(static_cast<i32>(fractions[3]), static_cast<i32>(fractions[2]), static_cast<i32>(fractions[1]), static_cast<i32>(fractions[0]));
+        return _mm_mul_ps(_mm_cvtepi32_ps(fractions_i32), _mm_set1_ps(fraction_scale));
+    }
+#endif
+
+    // Every kernel reads taps from index - left to index + right, and has an apply() function that takes a pointer to the first tap.
+    // While all taps are inside the sample, that points straight into the sample data, otherwise to a copy of the taps.
+    // The result has the same scale as the taps, 16-bit samples are scaled down afterwards.
+    // With SSE2, the linear and cubic kernels also have an apply4() function, which does 4 frames from position on at once. The taps
+    // are gathered one frame at a time, but the interpolation runs on all 4 frames together. Every tap has to be inside data then
+    struct LinearKernel {
+        static constexpr u32 left = 0;
+        static constexpr u32 right = 1;
+        template <typename T>
+        static float apply(const T* taps, const u32 fraction) {
+            const float current = static_cast<float>(taps[0]);
+            const float next = static_cast<float>(taps[1]);
+            return current + (next - current) * fraction_to_float(fraction);
+        }
+#ifdef FLAN_SSE2
+        template <typename T>
+        static __m128 apply4(const T* data, const u64 position, const u64 step) {
+            const T* taps[4];
+            const __m128 t = gather_frames(data, left, position, step, taps);
+            const __m128 x0 = gather_taps(taps, 0);
+            return _mm_add_ps(x0, _mm_mul_ps(_mm_sub_ps(gather_taps(taps, 1), x0), t));
+        }
+#endif
+    };
+
+    struct CubicKernel {
+        static constexpr u32 left = 1;
+        static constexpr u32 right = 2;
+        template <typename T>
+        static float apply(const T* taps, const u32 fraction) {
+            const float t = fraction_to_float(fraction);
+            const float xm1 = static_cast<float>(taps[0]);
+            const float x0 = static_cast<float>(taps[1]);
+            const float x1 = static_cast<float>(taps[2]);
+            const float x2 = static_cast<float>(taps[3]);
+            const float c1 = 0.5f * (x1 - xm1);
+            const float c2 = xm1 - 2.5f * x0 + 2.0f * x1 - 0.5f * x2;
+            const float c3 = 0.5f * (x2 - xm1) + 1.5f * (x0 - x1);
+            return ((c3 * t + c2) * t + c1) * t + x0;
+        }
+#ifdef FLAN_SSE2
+        template <typename T>
+        static __m128 apply4(const T* data, const u64 position, const u64 step) {
+            const T* taps[4];
+            const __m128 t = gather_frames(data, left, position, step, taps);
+            const __m128 xm1 = gather_taps(taps, 0);
+            const __m128 x0 = gather_taps(taps, 1);
+            const __m128 x1 = gather_taps(taps, 2);
+            const __m128 x2 = gather_taps(taps, 3);
+            const __m128 c1 = _mm_mul_ps(_mm_set1_ps(0.5f), _mm_sub_ps(x1, xm1));
+            const __m128 c2 = _mm_sub_ps(_mm_add_ps(_mm_sub_ps(xm1, _mm_mul_ps(_mm_set1_ps(2.5f), x0)), _mm_mul_ps(_mm_set1_ps(2.0f), x1)), _mm_mul_ps(_mm_set1_ps(0.5f), x2));
+            const __m128 c3 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(0.5f), _mm_sub_ps(x2, xm1)), _mm_mul_ps(_mm_set1_ps(1.5f), _mm_sub_ps(x0, x1)));
+            return _mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(c3, t), c2), t), c1), t), x0);
+        }
+#endif
+    };
+
+    struct SincKernel {
+        static constexpr u32 left = 3;
+        static constexpr u32 right = 4;
+        static constexpr u32 n_taps = left + right + 1;
+        static constexpr u32 phase_bits = 8;
+        static constexpr u32 n_phases = 1 << phase_bits;
+
+        // Windowed sinc coefficients for every phase, with one extra phase at the end so neighbouring phases can be interpolated
+        struct Table {
+            alignas(16) float coefficients[n_phases + 1][n_taps];
+            Table() {
+                constexpr double pi = 3.141592653589793;
+                for (u32 phase = 0; phase <= n_phases; phase++) {
+                    const double fraction = static_cast<double>(phase) / n_phases;
+                    double sum = 0.0;
+                    for (u32 tap = 0; tap < n_taps; tap++) {
+                        const double x = static_cast<double>(tap) - left - fraction;
+                        const double sinc = x == 0.0 ? 1.0 : sin(pi * x) / (pi * x);
+                        const double w = (x + left + 1.0) / n_taps; // 0.0 - 1.0 over the width of the kernel
+                        const double window = 0.42 - 0.5 * cos(2.0 * pi * w) + 0.08 * cos(4.0 * pi * w);
+                        coefficients[phase][tap] = static_cast<float>(sinc * window);
+                        sum += sinc * window;
+                    }
+
+                    // Normalize, so a constant signal stays at the same level
+                    for (u32 tap = 0; tap < n_taps; tap++)
+                        coefficients[phase][tap] = static_cast<float>(coefficients[phase][tap] / sum);
+                }
+            }
+        };
+        static const Table& table() {
+            static const Table instance;
+            return instance;
+        }
+
+        template <typename T>
+        static float apply(const T* taps, const u32 fraction) {
+            const Table& sinc_table = table();
+            const u32 phase = fraction >> (32 - phase_bits);
+            const float phase_fraction = static_cast<float>(fraction & ((1u << (32 - phase_bits)) - 1)) * (1.0f / (1u << (32 - phase_bits)));
+            const float* row0 = sinc_table.coefficients[phase];
+            const float* row1 = sinc_table.coefficients[phase + 1];
+#ifdef FLAN_SSE2
+            // Interpolate between the coefficients of the two nearest phases, and take the dot product with the taps
+            const __m128 t = _mm_set1_ps(phase_fraction);
+            const __m128 c_low = _mm_add_ps(_mm_load_ps(row0), _mm_mul_ps(t, _mm_sub_ps(_mm_load_ps(row1), _mm_load_ps(row0))));
+            const __m128 c_high = _mm_add_ps(_mm_load_ps(row0 + 4), _mm_mul_ps(t, _mm_sub_ps(_mm_load_ps(row1 + 4), _mm_load_ps(row0 + 4))));
+            __m128 taps_low, taps_high;
+            if constexpr (std::is_same_v<T, i16>) {
+                // Sign extend the 8 taps to 32-bit, then convert to float
+                const __m128i taps_i16 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(taps));
+                taps_low = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(taps_i16, taps_i16), 16));
+                taps_high = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(taps_i16, taps_i16), 16));
+            }
+            else {
+                taps_low = _mm_loadu_ps(taps);
+                taps_high = _mm_loadu_ps(taps + 4);
+            }
+            __m128 sum = _mm_add_ps(_mm_mul_ps(c_low, taps_low), _mm_mul_ps(c_high, taps_high));
+            sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+            sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+            return _mm_cvtss_f32(sum);
+#else
+            float sum = 0.0f;
+            for (u32 tap = 0; tap < n_taps; tap++)
+                sum += (row0[tap] + phase_fraction * (row1[tap] - row0[tap])) * static_cast<float>(taps[tap]);
+            return sum;
+#endif
+        }
+    };
+
+    // Read one tap the slow way, following the loop and treating everything outside the sample as silence
+    template <typename T>
+    static float fetch_tap(const SampleCursor& cursor, const T* data, i64 index) {
+        if (cursor.loop_enable && index >= cursor.loop_end)
+            index = cursor.loop_start + (index - cursor.loop_end) % (cursor.loop_end - cursor.loop_start);
+        if (index < 0 || index >= cursor.end)
+            return 0.0f;
+        return static_cast<float>(data[index]);
+    }
+
+    // Resample the frames from frame up to end_frame, where every tap is inside data. Returns the position after the last frame
+    template <typename Kernel, typename T>
+    static u64 resample_run(const T* data, u64 position, const u64 step, const float scale, float* output, const u32 output_stride, u32 frame, const u32 end_frame) {
+#ifdef FLAN_SSE2
+        if constexpr (requires { Kernel::apply4(data, position, step); }) {
+            const __m128 scale4 = _mm_set1_ps(scale);
+            for (; frame + 4 <= end_frame; frame += 4) {
+                alignas(16) float result[4];
+                _mm_store_ps(result, _mm_mul_ps(Kernel::apply4(data, position, step), scale4));
+                for (u32 i = 0; i < 4; i++)
+                    output[(frame + i) * output_stride] = result[i];
+                position += 4 * step;
+            }
+        }
+#endif
+        for (; frame < end_frame; frame++) {
+            output[frame * output_stride] = Kernel::apply(data + static_cast<i64>(position >> 32) - Kernel::left, static_cast<u32>(position)) * scale;
+            position += step;
+        }
+        return position;
+    }
+
+    // T is the sample type, i16 or f32. The data and loop data are passed in separately, since the cursor has both
+    template <typename Kernel, typename T>
+    static bool resample_kernel(SampleCursor& cursor, const T* data, const T* loop_data, float* output, const u32 output_stride, const u32 n_frames) {
+        constexpr float scale = std::is_same_v<T, i16> ? 1.0f / 32768.0f : 1.0f;
+        u64 position = cursor.position;
+        const u64 step = cursor.step;
+        static_assert(Kernel::left <= sample_guard_frames && Kernel::right <= sample_guard_frames, "Kernel is wider than the guard frames");
+        static_assert(Kernel::left <= max_kernel_left && Kernel::right <= max_kernel_right, "Kernel is wider than max_kernel_left and max_kernel_right");
+        const u32 limit = cursor.loop_enable ? cursor.loop_end : cursor.end + (cursor.guard_frames >= Kernel::right ? Kernel::right : 0);
+        const u64 first_safe_position = cursor.guard_frames >= Kernel::left ? 0 : static_cast<u64>(Kernel::left) << 32;
+        const u64 loop_start = static_cast<u64>(cursor.loop_start) << 32;
+        const u64 end = static_cast<u64>(cursor.end) << 32;
+        const u64 loop_end = static_cast<u64>(cursor.loop_end) << 32;
+        const u64 loop_length = static_cast<u64>(cursor.loop_end - cursor.loop_start) << 32;
+
+        // Wrap around at the loop end, or stop at the sample end
+        auto wrap_or_stop = [&]() {
+            if (cursor.loop_enable) {
+                if (position >= loop_end)
+                    position = loop_end - loop_length + (position - loop_end) % loop_length;
+                return true;
+            }
+            return position < end;
+        };
+
+        u32 frame = 0;
+        while (frame < n_frames) {
+            if (!wrap_or_stop()) {
+                for (; frame < n_frames; frame++)
+                    output[frame * output_stride] = 0.0f;
+                cursor.position = position;
+                return false;
+            }
+
+            // Inside a padded loop, every tap can be read from the loop copy until the loop end
+            if (loop_data && position >= loop_start) {
+                const u32 n_loop = step == 0 ? n_frames - frame : static_cast<u32>(std::min<u64>(n_frames - frame, (loop_end - position - 1) / step + 1));
+                position = loop_start + resample_run<Kernel>(loop_data, position - loop_start, step, scale, output, output_stride, frame, frame + n_loop);
+                frame += n_loop;
+                continue;
+            }
+
+            // Count the frames where every tap is inside the sample (or its guard frames), and before the loop end or the sample end
+            u32 n_safe = 0;
+            if (position >= first_safe_position && limit > Kernel::right) {
+                const u64 safe_end = static_cast<u64>(limit - Kernel::right) << 32;
+                if (position < safe_end)
+                    n_safe = step == 0 ? n_frames - frame : static_cast<u32>(std::min<u64>(n_frames - frame, (safe_end - position - 1) / step + 1));
+            }
+
+            // Those can read straight from the sample data, without any checks
+            position = resample_run<Kernel>(data, position, step, scale, output, output_stride, frame, frame + n_safe);
+            frame += n_safe;
+            if (frame == n_frames || n_safe > 0)
+                continue;
+
+            // Near the loop end or the sample end, gather the taps one by one
+            float taps[Kernel::left + Kernel::right + 1];
+            const i64 index = static_cast<i64>(position >> 32);
+            for (u32 tap = 0; tap < Kernel::left + Kernel::right + 1; tap++)
+                taps[tap] = fetch_tap(cursor, data, index - Kernel::left + tap);
+            output[frame++ * output_stride] = Kernel::apply(taps, static_cast<u32>(position)) * scale;
+            position += step;
+        }
+
+        const bool playing = wrap_or_stop();
+        cursor.position = position;
+        return playing;
+    }
+
+    template <typename Kernel>
+    static bool resample_kernel(SampleCursor& cursor, float* output, const u32 output_stride, const u32 n_frames) {
+        if (cursor.float_data)
+            return resample_kernel<Kernel, f32>(cursor, cursor.float_data, cursor.float_loop_data, output, output_stride, n_frames);
+        return resample_kernel<Kernel, i16>(cursor, cursor.data, cursor.loop_data, output, output_stride, n_frames);
+    }
+
+    bool resample(const Interpolation interpolation, SampleCursor& cursor, float* output, const u32 output_stride, const u32 n_frames) {
+        switch (interpolation) {
+        case Interpolation::cubic:
+            return resample_kernel<CubicKernel>(cursor, output, output_stride, n_frames);
+        case Interpolation::sinc:
+            return resample_kernel<SincKernel>(cursor, output, output_stride, n_frames);
+        case Interpolation::linear:
+        default:
+            return resample_kernel<LinearKernel>(cursor, output, output_stride, n_frames);
+        }
+    }
+}
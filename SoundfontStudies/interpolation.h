@@ -0,0 +1,45 @@
+#pragma once
+#include "structs.h"
+
+namespace Flan {
+    enum class Interpolation : u8 {
+        linear, // 2 taps, cheapest
+        cubic,  // 4 point Catmull-Rom spline
+        sinc,   // 8 tap Blackman windowed sinc, best quality
+    };
+
+    // Where a voice is in a sample, and how fast it moves through it
+    struct SampleCursor {
+        const i16* data = nullptr;
+        u64 position = 0;       // 32.32 fixed point position in samples
+        u64 step = 0;           // 32.32 fixed point position increment per output frame, this is the pitch ratio
+        u32 end = 0;            // Samples from here on are read as silence, and the cursor stops here when not looping
+        u32 loop_start = 0;
+        u32 loop_end = 0;
+        bool loop_enable = false;
+        const i16* loop_data = nullptr; // Padded copy of the loop (see Sample::guard_frames), or nullptr to read the loop from data
+        u32 guard_frames = 0;           // Number of silent samples before data and after end that can be read
+        const f32* float_data = nullptr;      // If set, the samples are read from these floats instead of data, see Sample::format
+        const f32* float_loop_data = nullptr; // Same as loop_data, for float_data
+
+        // Set up a cursor at the start of a zone's sample, with the zone's sample offsets applied.
+        // Only the part of the sample that's in memory (resident_length) is played
+        static SampleCursor from_zone(const Sample& sample, const Zone& zone);
+
+        // Same as above, for a sample that's compressed or streamed, so not all of it is in data. data stays nullptr, so the caller
+        // has to fill a window with the frames the cursor reads (see VoicePool), and every frame up to length is playable
+        static SampleCursor from_windowed_zone(const Sample& sample, u32 length, const Zone& zone);
+
+        // Convert a pitch ratio (1.0 is the sample's own speed) to a step
+        static u64 ratio_to_step(double ratio) { return static_cast<u64>(ratio * 4294967296.0); }
+    };
+
+    // Number of samples before and after the current one that the widest kernel reads
+    constexpr u32 max_kernel_left = 3;
+    constexpr u32 max_kernel_right = 4;
+
+    // Read n_frames frames from the cursor, converted to floats from -1.0 to +1.0, and move it forward. The loop is followed if enabled.
+    // Frames are written to output[0], output[output_stride], output[2 * output_stride], and so on.
+    // Returns false if the end of the sample was reached, in which case the rest of the output is filled with silence.
+    bool resample(Interpolation interpolation, SampleCursor& cursor, float* output, u32 output_stride, u32 n_frames);
+}
@@ -0,0 +1,88 @@
+#include "load_report.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+
+namespace Flan {
+    // Shared by every thread, like an operator new counter would be
+    static std::atomic<u64> n_library_allocations = 0;
+    static std::atomic<u64> library_allocated_bytes = 0;
+
+    void* counted_malloc(const size_t n_bytes) {
+        n_library_allocations.fetch_add(1, std::memory_order_relaxed);
+        library_allocated_bytes.fetch_add(n_bytes, std::memory_order_relaxed);
+        return malloc(n_bytes);
+    }
+
+    void library_allocations(u64& n_allocations, u64& n_bytes) {
+        n_allocations = n_library_allocations.load(std::memory_order_relaxed);
+        n_bytes = library_allocated_bytes.load(std::memory_order_relaxed);
+    }
+
+    LoadReport::Phase LoadReport::total() const {
+        Phase total;
+        for (const Phase& phase : phases) {
+            total.seconds += phase.seconds;
+            total.bytes_read += phase.bytes_read;
+            total.n_allocations += phase.n_allocations;
+            total.allocated_bytes += phase.allocated_bytes;
+            total.peak_memory = std::max(total.peak_memory, phase.peak_memory);
+        }
+        return total;
+    }
+
+    const char* LoadReport::phase_name(const LoadPhase phase) {
+        switch (phase) {
+        case LoadPhase::riff_scan: return "riff scan";
+        case LoadPhase::sample_read: return "sample read";
+        case LoadPhase::table_parse: return "table parse";
+        case LoadPhase::preset_build: return "preset build";
+        case LoadPhase::sample_processing: return "sample processing";
+        case LoadPhase::cache: return "cache";
+        default: return "unknown";
+        }
+    }
+
+    LoadPhaseTimer::LoadPhaseTimer(LoadReport* report, const LoadPhase phase, const AllocationCounter allocation_counter, const PeakMemoryCounter peak_memory_counter) {
+        _report = report;
+        _allocation_counter = allocation_counter;
+        _peak_memory_counter = peak_memory_counter;
+        start(phase);
+    }
+
+    void LoadPhaseTimer::start(const LoadPhase phase) {
+        if (!_report)
+            return;
+        _phase = &(*_report)[phase];
+        library_allocations(_n_library_allocations, _library_allocated_bytes);
+        if (_allocation_counter)
+            _allocation_counter(_n_allocations, _allocated_bytes);
+        if (_peak_memory_counter)
+            _peak_memory_counter();
+        _start = std::chrono::steady_clock::now();
+    }
+
+    void LoadPhaseTimer::next(const LoadPhase phase) {
+        stop();
+        start(phase);
+    }
+
+    void LoadPhaseTimer::stop() {
+        if (!_phase)
+            return;
+        _phase->seconds += std::chrono::duration<f64>(std::chrono::steady_clock::now() - _start).count();
+        if (_peak_memory_counter)
+            _phase->peak_memory = std::max(_phase->peak_memory, _peak_memory_counter());
+        u64 n_allocations = 0;
+        u64 allocated_bytes = 0;
+        library_allocations(n_allocations, allocated_bytes);
+        _phase->n_allocations += n_allocations - _n_library_allocations;
+        _phase->allocated_bytes += allocated_bytes - _library_allocated_bytes;
+        if (_allocation_counter) {
+            _allocation_counter(n_allocations, allocated_bytes);
+            _phase->n_allocations += n_allocations - _n_allocations;
+            _phase->allocated_bytes += allocated_bytes - _allocated_bytes;
+        }
+        _phase = nullptr;
+    }
+}
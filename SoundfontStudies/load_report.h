@@ -0,0 +1,83 @@
+#pragma once
+#include <chrono>
+#include "common.h"
+
+namespace Flan {
+    enum class LoadPhase : u8 {
+        riff_scan,          // Finding the chunks in the file. For .dls files, this only reads the chunk headers
+        sample_read,        // Reading the sdta list (SF2), or finding the waves in the wave pool (DLS)
+        table_parse,        // Reading the pdta list and the sample headers (SF2), or the instrument headers (DLS)
+        preset_build,       // Building presets, including the ones that are built later by get_preset() when loaded with lazy_presets
+        sample_processing,  // Converting, padding, compressing or sharing the sample data
+        cache,              // Reading or writing the cache file
+        count
+    };
+
+    // Reads the total number of allocations made so far, and their total size in bytes. The library counts its own malloc calls, but can't
+    // see operator new, so applications that want those in the report count them in their own operator new, and pass this in LoadSettings.
+    using AllocationCounter = void (*)(u64& n_allocations, u64& n_bytes);
+
+    // Returns the peak memory usage in bytes since the last call, and starts measuring again from the current usage. Called at every phase
+    // boundary, so applications that can read their peak resident memory can have it in the report per phase.
+    using PeakMemoryCounter = u64 (*)();
+
+    // malloc, but counted in the load report. The library allocates its big buffers (sample data, pdta tables, chunk data) with this
+    void* counted_malloc(size_t n_bytes);
+
+    // Reads the number of counted_malloc calls so far, and their total size in bytes
+    void library_allocations(u64& n_allocations, u64& n_bytes);
+
+    // Where the time went while loading a soundfont, see LoadSettings::collect_report and Soundfont::load_report()
+    struct LoadReport {
+        struct Phase {
+            f64 seconds = 0.0;
+            u64 bytes_read = 0;       // From the file or the mapping
+            u64 n_allocations = 0;    // The library's own mallocs, plus operator new with LoadSettings::allocation_counter
+            u64 allocated_bytes = 0;
+            u64 peak_memory = 0;      // Highest of all the times the phase ran, only with LoadSettings::peak_memory_counter
+        };
+        Phase phases[static_cast<size_t>(LoadPhase::count)];
+        u64 n_presets = 0;              // Presets in the soundfont
+        u64 n_presets_built = 0;        // Presets built so far, which is less than n_presets when loaded with lazy_presets
+        u64 n_zones = 0;                // Zones in the presets built so far
+        u64 n_samples = 0;
+        u64 n_unknown_generators = 0;   // SF2 generators of an unknown type, skipped while building presets
+        u64 n_unknown_articulators = 0; // DLS connection blocks that aren't supported, skipped while building presets
+        bool from_cache = false;        // Loaded from LoadSettings::cache_path instead of the soundfont itself
+
+        Phase& operator[](const LoadPhase phase) { return phases[static_cast<size_t>(phase)]; }
+        const Phase& operator[](const LoadPhase phase) const { return phases[static_cast<size_t>(phase)]; }
+
+        // All phases added together
+        [[nodiscard]] Phase total() const;
+        static const char* phase_name(LoadPhase phase);
+    };
+
+    // Adds the wall time, allocations and peak memory of each phase to a report, from when it's started until the next phase starts or the timer stops.
+    // Does nothing if the report is nullptr, so loading without a report doesn't pay for it.
+    class LoadPhaseTimer {
+    public:
+        LoadPhaseTimer(LoadReport* report, LoadPhase phase, AllocationCounter allocation_counter, PeakMemoryCounter peak_memory_counter);
+        LoadPhaseTimer(const LoadPhaseTimer&) = delete;
+        LoadPhaseTimer& operator=(const LoadPhaseTimer&) = delete;
+        ~LoadPhaseTimer() { stop(); }
+
+        // Stop the current phase and start another one
+        void next(LoadPhase phase);
+        void stop();
+
+        // Add bytes read from the file or the mapping to the current phase
+        void count_read(const u64 n_bytes) { if (_phase) _phase->bytes_read += n_bytes; }
+    private:
+        void start(LoadPhase phase);
+        LoadReport* _report = nullptr;
+        LoadReport::Phase* _phase = nullptr;
+        AllocationCounter _allocation_counter = nullptr;
+        PeakMemoryCounter _peak_memory_counter = nullptr;
+        std::chrono::steady_clock::time_point _start;
+        u64 _n_allocations = 0;
+        u64 _allocated_bytes = 0;
+        u64 _n_library_allocations = 0;
+        u64 _library_allocated_bytes = 0;
+    };
+}
@@ -0,0 +1,79 @@
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Flan {
+    bool MappedFile::open(const std::string& path) {
+        // Make sure we don't leak a previous mapping
+        close();
+
+#ifdef _WIN32
+        // Open the file and get its size
+        _file_handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (_file_handle == INVALID_HANDLE_VALUE) { _file_handle = nullptr; return false; }
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(_file_handle, &file_size) || file_size.QuadPart == 0) { close(); return false; }
+
+        // Map the entire file, copy-on-write so the sample data can still be modified in place
+        _mapping_handle = CreateFileMappingA(_file_handle, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+        if (!_mapping_handle) { close(); return false; }
+        data = static_cast<u8*>(MapViewOfFile(_mapping_handle, FILE_MAP_COPY, 0, 0, 0));
+        if (!data) { close(); return false; }
+        size = static_cast<size_t>(file_size.QuadPart);
+#else
+        // Open the file and get its size
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat file_stat{};
+        if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) { ::close(fd); return false; }
+
+        // Map the entire file, copy-on-write so the sample data can still be modified in place.
+        // The mapping stays valid after closing the file descriptor.
+        void* mapping = mmap(nullptr, static_cast<size_t>(file_stat.st_size), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED) return false;
+        data = static_cast<u8*>(mapping);
+        size = static_cast<size_t>(file_stat.st_size);
+#endif
+        return true;
+    }
+
+    MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+        if (this == &other) return *this;
+        close();
+        data = other.data;
+        size = other.size;
+        other.data = nullptr;
+        other.size = 0;
+#ifdef _WIN32
+        _file_handle = other._file_handle;
+        _mapping_handle = other._mapping_handle;
+        other._file_handle = nullptr;
+        other._mapping_handle = nullptr;
+#endif
+        return *this;
+    }
+
+    void MappedFile::close() {
+#ifdef _WIN32
+        if (data) UnmapViewOfFile(data);
+        if (_mapping_handle) CloseHandle(_mapping_handle);
+        if (_file_handle) CloseHandle(_file_handle);
+        _mapping_handle = nullptr;
+        _file_handle = nullptr;
+#else
+        if (data) munmap(data, size);
+#endif
+        data = nullptr;
+        size = 0;
+    }
+}
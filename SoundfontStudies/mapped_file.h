@@ -0,0 +1,27 @@
+#pragma once
+#include <string>
+#include <utility>
+#include "common.h"
+
+namespace Flan {
+    // Copy-on-write memory mapping of an entire file. Pages are only read from disk when they are touched,
+    // and writing to the mapping never modifies the file on disk.
+    struct MappedFile {
+        u8* data = nullptr;
+        size_t size = 0;
+        MappedFile() = default;
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+        MappedFile(MappedFile&& other) noexcept { *this = std::move(other); }
+        MappedFile& operator=(MappedFile&& other) noexcept;
+        ~MappedFile() { close(); }
+        bool open(const std::string& path);
+        void close();
+        [[nodiscard]] bool is_open() const { return data != nullptr; }
+    private:
+#ifdef _WIN32
+        void* _file_handle = nullptr;
+        void* _mapping_handle = nullptr;
+#endif
+    };
+}
@@ -0,0 +1,158 @@
+#include "midi_file.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include "print.h"
+
+namespace Flan {
+    bool MidiFile::from_file(const std::string& path) {
+        // Read the whole file
+        FILE* file = nullptr;
+        if (fopen_s(&file, path.c_str(), "rb") != 0 || !file) {
+            print("[ERROR] Could not open MIDI file '%s'!\n", path.c_str());
+            return false;
+        }
+        std::vector<u8> data;
+        u8 buffer[65536];
+        size_t n_read;
+        while ((n_read = fread_s(buffer, sizeof(buffer), 1, sizeof(buffer), file)) > 0)
+            data.insert(data.end(), buffer, buffer + n_read);
+        const int _ = fclose(file);
+        (void)_;
+        return from_buffer(data.data(), data.size());
+    }
+
+    bool MidiFile::from_buffer(const u8* data, const size_t size) {
+        events.clear();
+        length = 0.0;
+
+        // MIDI files are big endian
+        size_t position = 0;
+        auto read_u32 = [&]() { const u32 value = static_cast<u32>(data[position]) << 24 | data[position + 1] << 16 | data[position + 2] << 8 | data[position + 3]; position += 4; return value; };
+        auto read_u16 = [&]() { const u16 value = static_cast<u16>(data[position] << 8 | data[position + 1]); position += 2; return value; };
+
+        // Header chunk
+        if (size < 14 || memcmp(data, "MThd", 4) != 0) {
+            print("[ERROR] Not a MIDI file!\n");
+            return false;
+        }
+        position = 4;
+        const u32 header_size = read_u32();
+        const u16 format = read_u16();
+        const u16 n_tracks = read_u16();
+        const u16 division = read_u16();
+        position = 8 + static_cast<size_t>(header_size);
+        if (format > 1) {
+            print("[ERROR] MIDI format %i is not supported!\n", format);
+            return false;
+        }
+
+        // Every event with the tick it happens on. Tempo changes are kept here as well, with a status of 0xFF
+        struct TickEvent {
+            u64 tick;
+            MidiEvent event;
+            u32 tempo;
+        };
+        std::vector<TickEvent> tick_events;
+        u64 last_tick = 0;
+
+        u16 n_tracks_read = 0;
+        while (n_tracks_read < n_tracks && position + 8 <= size) {
+            // Skip chunks that aren't tracks
+            const bool is_track = memcmp(data + position, "MTrk", 4) == 0;
+            position += 4;
+            const u32 chunk_size = read_u32();
+            const size_t track_end = std::min(size, position + chunk_size);
+            if (!is_track) {
+                position = track_end;
+                continue;
+            }
+            n_tracks_read++;
+
+            auto read_variable_length = [&]() {
+                u32 value = 0;
+                while (position < track_end) {
+                    const u8 byte = data[position++];
+                    value = value << 7 | (byte & 0x7F);
+                    if ((byte & 0x80) == 0) break;
+                }
+                return value;
+            };
+
+            u64 tick = 0;
+            u8 running_status = 0;
+            while (position < track_end) {
+                tick += read_variable_length();
+                if (position >= track_end) break;
+
+                // A data byte instead of a status byte means the previous status is used again
+                u8 status = data[position];
+                if (status & 0x80)
+                    position++;
+                else
+                    status = running_status;
+
+                if (status == 0xFF) {
+                    // Meta event, only the tempo is interesting. Like system exclusive messages, these cancel the running status
+                    running_status = 0;
+                    if (position >= track_end) break;
+                    const u8 meta_type = data[position++];
+                    const u32 meta_size = read_variable_length();
+                    if (meta_type == 0x51 && meta_size == 3 && position + 3 <= track_end)
+                        tick_events.push_back({ tick, { 0.0, 0xFF, 0, 0 }, static_cast<u32>(data[position] << 16 | data[position + 1] << 8 | data[position + 2]) });
+                    position += meta_size;
+                    if (meta_type == 0x2F) break;
+                }
+                else if (status == 0xF0 || status == 0xF7) {
+                    // System exclusive, skip it
+                    running_status = 0;
+                    position += read_variable_length();
+                }
+                else if (status >= 0x80) {
+                    // Channel message, program change and channel pressure only have one data byte
+                    running_status = status;
+                    const u8 type = status & 0xF0;
+                    const u32 n_data = (type == 0xC0 || type == 0xD0) ? 1 : 2;
+                    if (position + n_data > track_end) break;
+                    MidiEvent event;
+                    event.status = status;
+                    event.data1 = data[position] & 0x7F;
+                    event.data2 = n_data == 2 ? data[position + 1] & 0x7F : 0;
+                    position += n_data;
+                    tick_events.push_back({ tick, event, 0 });
+                }
+                else {
+                    // Data byte without any status before it, the file is broken
+                    break;
+                }
+            }
+            last_tick = std::max(last_tick, tick);
+            position = track_end;
+        }
+
+        // Merge the tracks. Events on the same tick stay in track order
+        std::stable_sort(tick_events.begin(), tick_events.end(), [](const TickEvent& lhs, const TickEvent& rhs) { return lhs.tick < rhs.tick; });
+
+        // Convert ticks to seconds. With SMPTE timing, ticks have a fixed length, otherwise it depends on the tempo
+        const bool smpte = (division & 0x8000) != 0;
+        const f64 smpte_tick_seconds = smpte ? 1.0 / (static_cast<f64>(-static_cast<i8>(division >> 8)) * (division & 0xFF)) : 0.0;
+        const f64 ticks_per_quarter = smpte ? 1.0 : std::max<f64>(division, 1);
+        f64 seconds_per_tick = smpte ? smpte_tick_seconds : 0.5 / ticks_per_quarter; // 120 BPM until the first tempo change
+        f64 time = 0.0;
+        u64 tick = 0;
+        events.reserve(tick_events.size());
+        for (const TickEvent& tick_event : tick_events) {
+            time += static_cast<f64>(tick_event.tick - tick) * seconds_per_tick;
+            tick = tick_event.tick;
+            if (tick_event.event.status == 0xFF) {
+                if (!smpte)
+                    seconds_per_tick = tick_event.tempo / 1000000.0 / ticks_per_quarter;
+                continue;
+            }
+            events.push_back(tick_event.event);
+            events.back().time = time;
+        }
+        length = time + static_cast<f64>(last_tick - tick) * seconds_per_tick;
+        return true;
+    }
+}
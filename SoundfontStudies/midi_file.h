@@ -0,0 +1,26 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "common.h"
+
+namespace Flan {
+    // A channel message from a MIDI file
+    struct MidiEvent {
+        f64 time = 0.0;  // In seconds from the start of the file, with all tempo changes applied
+        u8 status = 0;   // Message type in the upper 4 bits, channel in the lower 4 bits
+        u8 data1 = 0;
+        u8 data2 = 0;
+        [[nodiscard]] u8 type() const { return status & 0xF0; }
+        [[nodiscard]] u8 channel() const { return status & 0x0F; }
+    };
+
+    // A Standard MIDI File (format 0 or 1), with the channel messages of all tracks merged into one list sorted by time.
+    // Meta events and system exclusive messages are skipped, except for tempo changes which are already applied to the event times.
+    struct MidiFile {
+        std::vector<MidiEvent> events;
+        f64 length = 0.0; // Time of the last event in any track, including meta events like the end of track
+
+        bool from_file(const std::string& path);
+        bool from_buffer(const u8* data, size_t size);
+    };
+}
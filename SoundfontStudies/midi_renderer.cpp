@@ -0,0 +1,263 @@
+#include "midi_renderer.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include "parallel.h"
+#include "print.h"
+#include "voice_pool.h"
+
+namespace Flan {
+    static constexpr u8 n_midi_channels = 16;
+    static constexpr u8 drum_channel = 9;
+
+    // Everything a MIDI channel remembers between events
+    struct MidiChannel {
+        std::unique_ptr<VoicePool> voices;
+        std::vector<MidiEvent> events;
+        size_t next_event = 0;
+        u8 index = 0;
+        u8 bank = 0;
+        u8 program = 0;
+        u8 volume = 100;
+        u8 expression = 127;
+        u8 pan = 64;
+        const Preset* preset = nullptr;       // Looked up when the bank or program changes, so note ons don't have to go through the soundfont's lock
+        bool sustain = false;
+        std::array<bool, 128> sustained{};    // Keys that were released while the sustain pedal was down
+        u8 rpn_msb = 127;                     // Selected registered parameter, 127 is none
+        u8 rpn_lsb = 127;
+        f64 pitch_bend_range = 2.0;           // In semitones
+        i32 pitch_bend = 0;                   // -8192 to +8191
+        std::vector<f32> left;
+        std::vector<f32> right;
+
+        [[nodiscard]] bool busy() const { return next_event < events.size() || voices->active_voices() > 0; }
+    };
+
+    static const Preset* find_preset(Soundfont& soundfont, const MidiChannel& channel) {
+        // Drums always use bank 128. Presets that don't exist fall back to bank 0, or the standard drum kit
+        const bool drums = channel.index == drum_channel;
+        const u16 preset_id = static_cast<u16>((drums ? 128 : channel.bank) << 8 | channel.program);
+        if (const Preset* preset = soundfont.get_preset(preset_id))
+            return preset;
+        return soundfont.get_preset(drums ? static_cast<u16>(128 << 8) : channel.program);
+    }
+
+    static void release_sustained(MidiChannel& channel) {
+        for (u8 key = 0; key < 128; key++) {
+            if (channel.sustained[key])
+                channel.voices->release(key);
+        }
+        channel.sustained = {};
+    }
+
+    static void handle_event(Soundfont& soundfont, MidiChannel& channel, const MidiEvent& event, const MidiRenderSettings& settings) {
+        switch (event.type()) {
+        case 0x90: // Note on
+            if (event.data2 > 0) {
+                channel.voices->release(event.data1);
+                channel.sustained[event.data1] = false;
+                if (channel.preset)
+                    channel.voices->note_on(soundfont, *channel.preset, event.data1, event.data2, event.data1, settings.interpolation);
+                break;
+            }
+            [[fallthrough]]; // Note on with velocity 0 is a note off
+        case 0x80: // Note off
+            if (channel.sustain)
+                channel.sustained[event.data1] = true;
+            else
+                channel.voices->release(event.data1);
+            break;
+        case 0xB0: // Control change
+            switch (event.data1) {
+            case 0:
+                channel.bank = event.data2;
+                channel.preset = find_preset(soundfont, channel);
+                break;
+            case 6: // Data entry, only pitch bend range is supported
+                if (channel.rpn_msb == 0 && channel.rpn_lsb == 0)
+                    channel.pitch_bend_range = event.data2;
+                break;
+            case 7: channel.volume = event.data2; break;
+            case 10: channel.pan = event.data2; break;
+            case 11: channel.expression = event.data2; break;
+            case 64: // Sustain pedal, release the keys it held when it goes up
+                channel.sustain = event.data2 >= 64;
+                if (!channel.sustain)
+                    release_sustained(channel);
+                break;
+            case 100: channel.rpn_lsb = event.data2; break;
+            case 101: channel.rpn_msb = event.data2; break;
+            case 120: // All sound off
+                channel.voices->stop_all();
+                channel.sustained = {};
+                break;
+            case 121: // Reset all controllers, which lifts the sustain pedal too
+                channel.expression = 127;
+                channel.sustain = false;
+                release_sustained(channel);
+                channel.pitch_bend = 0;
+                channel.rpn_msb = 127;
+                channel.rpn_lsb = 127;
+                break;
+            case 123: // All notes off
+                channel.voices->release_all();
+                channel.sustained = {};
+                break;
+            default: break;
+            }
+            break;
+        case 0xC0: // Program change
+            channel.program = event.data1;
+            channel.preset = find_preset(soundfont, channel);
+            break;
+        case 0xE0: // Pitch bend
+            channel.pitch_bend = (event.data2 << 7 | event.data1) - 8192;
+            break;
+        default: break;
+        }
+        channel.voices->set_pitch_offset(channel.pitch_bend / 8192.0 * channel.pitch_bend_range);
+    }
+
+    static void render_channel(Soundfont& soundfont, MidiChannel& channel, const u64 chunk_start, const u32 n_frames, const MidiRenderSettings& settings) {
+        std::fill_n(channel.left.begin(), n_frames, 0.0f);
+        std::fill_n(channel.right.begin(), n_frames, 0.0f);
+
+        auto event_frame = [&](const MidiEvent& event) { return static_cast<u64>(llround(event.time * settings.sample_rate)); };
+        u32 frame = 0;
+        while (frame < n_frames) {
+            // Handle the events that are due, then render up to the next one
+            while (channel.next_event < channel.events.size() && event_frame(channel.events[channel.next_event]) <= chunk_start + frame)
+                handle_event(soundfont, channel, channel.events[channel.next_event++], settings);
+            u32 end = n_frames;
+            if (channel.next_event < channel.events.size())
+                end = static_cast<u32>(std::min<u64>(end, event_frame(channel.events[channel.next_event]) - chunk_start));
+            if (channel.voices->active_voices() > 0) {
+                channel.voices->render(&channel.left[frame], &channel.right[frame], end - frame);
+
+                // Channel volume and expression use the General MIDI curve (40 * log10(value / 127) dB), pan is constant power
+                const f32 level = (channel.volume / 127.0f) * (channel.volume / 127.0f) * (channel.expression / 127.0f) * (channel.expression / 127.0f);
+                const f32 pan_angle = (std::clamp((channel.pan - 64) / 63.0f, -1.0f, 1.0f) + 1.0f) * 0.7853982f;
+                const f32 gain_left = level * cosf(pan_angle) * 1.4142136f;
+                const f32 gain_right = level * sinf(pan_angle) * 1.4142136f;
+                for (u32 i = frame; i < end; i++) {
+                    channel.left[i] *= gain_left;
+                    channel.right[i] *= gain_right;
+                }
+            }
+            frame = end;
+        }
+    }
+
+    bool render_midi(Soundfont& soundfont, const MidiFile& midi, const MidiRenderSettings& settings, const std::function<void(const f32* frames, u32 n_frames)>& output) {
+        if (settings.sample_rate <= 0.0f)
+            return false;
+
+        // Give every channel its own voices and events
+        std::array<MidiChannel, n_midi_channels> channels;
+        for (u8 i = 0; i < n_midi_channels; i++) {
+            channels[i].index = i;
+            channels[i].voices = std::make_unique<VoicePool>(settings.voices_per_channel, settings.sample_rate);
+            channels[i].preset = find_preset(soundfont, channels[i]);
+            channels[i].left.resize(midi_render_chunk_frames);
+            channels[i].right.resize(midi_render_chunk_frames);
+        }
+        for (const MidiEvent& event : midi.events)
+            channels[event.channel()].events.push_back(event);
+
+        const u64 song_frames = static_cast<u64>(llround(midi.length * settings.sample_rate));
+        const u64 max_frames = song_frames + static_cast<u64>(llround(settings.tail_seconds * settings.sample_rate));
+        std::vector<f32> mix(static_cast<size_t>(midi_render_chunk_frames) * 2);
+        std::vector<MidiChannel*> busy_channels;
+        for (u64 chunk_start = 0; chunk_start < max_frames; chunk_start += midi_render_chunk_frames) {
+            const u32 n_frames = static_cast<u32>(std::min<u64>(midi_render_chunk_frames, max_frames - chunk_start));
+
+            // Stop early once the song is over and every voice has finished
+            busy_channels.clear();
+            for (MidiChannel& channel : channels) {
+                if (channel.busy())
+                    busy_channels.push_back(&channel);
+            }
+            if (busy_channels.empty() && chunk_start >= song_frames)
+                break;
+
+            // Render the channels that have something to do
+            parallel_for(busy_channels.size(), settings.n_threads, [&](const size_t i) {
+                render_channel(soundfont, *busy_channels[i], chunk_start, n_frames, settings);
+            });
+
+            // Mix them in channel order, so the rounding is the same no matter which thread finished first
+            std::fill_n(mix.begin(), static_cast<size_t>(n_frames) * 2, 0.0f);
+            for (const MidiChannel* channel : busy_channels) {
+                for (u32 i = 0; i < n_frames; i++) {
+                    mix[i * 2 + 0] += channel->left[i];
+                    mix[i * 2 + 1] += channel->right[i];
+                }
+            }
+            for (u32 i = 0; i < n_frames * 2; i++)
+                mix[i] *= settings.gain;
+            output(mix.data(), n_frames);
+        }
+        return true;
+    }
+
+    static void write_wav_header(FILE* file, const u32 sample_rate, const bool float_output, const u64 n_frames) {
+        const u16 format = float_output ? 3 : 1; // IEEE float or PCM
+        const u16 n_channels = 2;
+        const u16 bits_per_sample = float_output ? 32 : 16;
+        const u16 block_align = n_channels * bits_per_sample / 8;
+        const u32 byte_rate = sample_rate * block_align;
+        const u32 data_size = static_cast<u32>(std::min<u64>(n_frames * block_align, 0xFFFFFFFFull - 36));
+        const u32 riff_size = 36 + data_size;
+        const u32 fmt_size = 16;
+
+        u8 header[44];
+        memcpy(header + 0, "RIFF", 4);
+        memcpy(header + 4, &riff_size, 4);
+        memcpy(header + 8, "WAVEfmt ", 8);
+        memcpy(header + 16, &fmt_size, 4);
+        memcpy(header + 20, &format, 2);
+        memcpy(header + 22, &n_channels, 2);
+        memcpy(header + 24, &sample_rate, 4);
+        memcpy(header + 28, &byte_rate, 4);
+        memcpy(header + 32, &block_align, 2);
+        memcpy(header + 34, &bits_per_sample, 2);
+        memcpy(header + 36, "data", 4);
+        memcpy(header + 40, &data_size, 4);
+        fwrite(header, 1, sizeof(header), file);
+    }
+
+    bool render_midi_to_wav(Soundfont& soundfont, const MidiFile& midi, const std::string& wav_path, const MidiRenderSettings& settings) {
+        FILE* file = nullptr;
+        if (fopen_s(&file, wav_path.c_str(), "wb") != 0 || !file) {
+            print("[ERROR] Could not open '%s' for writing!\n", wav_path.c_str());
+            return false;
+        }
+
+        // Write the header once the length is known, leave room for it for now
+        const u32 sample_rate = static_cast<u32>(lroundf(settings.sample_rate));
+        write_wav_header(file, sample_rate, settings.float_output, 0);
+        u64 n_frames_written = 0;
+        bool ok = true;
+        std::vector<i16> pcm;
+        ok &= render_midi(soundfont, midi, settings, [&](const f32* frames, const u32 n_frames) {
+            if (settings.float_output) {
+                ok &= fwrite(frames, sizeof(f32) * 2, n_frames, file) == n_frames;
+            }
+            else {
+                pcm.resize(static_cast<size_t>(n_frames) * 2);
+                for (u32 i = 0; i < n_frames * 2; i++)
+                    pcm[i] = static_cast<i16>(lrintf(std::clamp(frames[i], -1.0f, 1.0f) * 32767.0f));
+                ok &= fwrite(pcm.data(), sizeof(i16) * 2, n_frames, file) == n_frames;
+            }
+            n_frames_written += n_frames;
+        });
+        fseek(file, 0, SEEK_SET);
+        write_wav_header(file, sample_rate, settings.float_output, n_frames_written);
+        ok &= fclose(file) == 0;
+        return ok;
+    }
+}
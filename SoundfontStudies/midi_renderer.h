@@ -0,0 +1,28 @@
+#pragma once
+#include <functional>
+#include <string>
+#include "interpolation.h"
+#include "midi_file.h"
+#include "soundfont.h"
+
+namespace Flan {
+    struct MidiRenderSettings {
+        f32 sample_rate = 44100.0f;
+        u32 n_threads = 0;                 // Number of worker threads, 0 to use one per hardware thread. Each MIDI channel is rendered by one thread at a time
+        u32 voices_per_channel = 128;      // Size of each channel's VoicePool
+        Interpolation interpolation = Interpolation::linear;
+        f64 tail_seconds = 2.0;            // Max time to keep rendering after the end of the file, stops earlier once every voice has finished
+        f32 gain = 1.0f;                   // Applied to the final mix
+        bool float_output = false;         // Write 32-bit float WAV files instead of 16-bit
+    };
+
+    constexpr u32 midi_render_chunk_frames = 16384;
+
+    // Render a MIDI file with a soundfont. Every MIDI channel has its own VoicePool, and the channels are rendered in parallel in chunks of
+    // midi_render_chunk_frames frames. The channels are mixed in channel order, so the result is the same for any number of threads.
+    // output is called for every chunk in order, with interleaved stereo frames
+    bool render_midi(Soundfont& soundfont, const MidiFile& midi, const MidiRenderSettings& settings, const std::function<void(const f32* frames, u32 n_frames)>& output);
+
+    // Render a MIDI file with a soundfont, and write the result to a WAV file
+    bool render_midi_to_wav(Soundfont& soundfont, const MidiFile& midi, const std::string& wav_path, const MidiRenderSettings& settings = {});
+}
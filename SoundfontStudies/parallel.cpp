@@ -0,0 +1,39 @@
+#include "parallel.h"
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace Flan {
+    u32 resolve_thread_count(const u32 n_threads) {
+        if (n_threads > 0)
+            return n_threads;
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    void parallel_for(const size_t count, const u32 n_threads, const std::function<void(size_t)>& function) {
+        // Don't spawn more threads than there are items
+        const size_t n_workers = std::min(static_cast<size_t>(resolve_thread_count(n_threads)), count);
+
+        // Run on the calling thread if there's nothing to parallelize
+        if (n_workers <= 1) {
+            for (size_t i = 0; i < count; i++)
+                function(i);
+            return;
+        }
+
+        // Every worker takes the next unclaimed item until there are none left. The calling thread works along as well
+        std::atomic<size_t> next_item = 0;
+        auto worker = [&]() {
+            for (size_t i = next_item++; i < count; i = next_item++)
+                function(i);
+        };
+        std::vector<std::thread> threads;
+        threads.reserve(n_workers - 1);
+        for (size_t i = 0; i < n_workers - 1; i++)
+            threads.emplace_back(worker);
+        worker();
+        for (std::thread& thread : threads)
+            thread.join();
+    }
+}
@@ -0,0 +1,12 @@
+#pragma once
+#include <functional>
+#include "common.h"
+
+namespace Flan {
+    // Returns the number of worker threads to use for a requested thread count, where 0 means one per hardware thread
+    u32 resolve_thread_count(u32 n_threads);
+
+    // Calls function(i) for every i in [0, count), spread over up to n_threads worker threads (0 = one per hardware thread).
+    // Items are handed out one at a time, so uneven work per item still balances out. Returns once all items are done.
+    void parallel_for(size_t count, u32 n_threads, const std::function<void(size_t)>& function);
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <cstdio>
+
+// Set PRINT_AT_ALL to 1 to print errors and warnings while loading, and VERBOSE to 1 to print everything that's found in a file too
+#ifndef VERBOSE
+#define VERBOSE 0
+#endif
+#ifndef PRINT_AT_ALL
+#define PRINT_AT_ALL 0
+#endif
+
+namespace Flan {
+    template<class... Args>
+    void print([[maybe_unused]] const char* fmt, [[maybe_unused]] Args... args) {
+#if PRINT_AT_ALL
+        printf(fmt, args...);
+#endif
+    }
+    template<class... Args>
+    void print_verbose([[maybe_unused]] const char* fmt, [[maybe_unused]] Args... args) {
+#if VERBOSE
+        print(fmt, args...);
+#endif
+    }
+}
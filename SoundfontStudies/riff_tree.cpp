@@ -1,44 +1,39 @@
 #include "riff_tree.h"
-#include <fstream>
+#include <algorithm>
+#include <new>
 
 namespace Flan {
-    RiffNode& RiffNode::operator[](const std::string& name) {
-        // Search through the subchunks to find any with a matching name, and if it doesn't exist, throw an exception
-        for (RiffNode& node : subchunks) {
-            if (node.id == name.c_str()) {
-                return node;
-            }
-        }
-        throw std::invalid_argument("Attempted to access a subnode that does not exist!");
+    std::span<RiffNode> RiffTree::children(const RiffNode* parent) {
+        if (!parent || parent->n_children == 0)
+            return {};
+        return { nodes.data() + parent->first_child, parent->n_children };
     }
 
-    RiffNode& RiffNode::operator[](const size_t index) {
-        // Search through the subchunks to find any with a matching name, and if it doesn't exist, throw an exception
-        if (index >= subchunks.size())
-            throw std::invalid_argument("Attempted to access a subnode that does not exist!");
-        return subchunks[index];
+    RiffNode* RiffTree::child(const RiffNode* parent, const size_t index) {
+        if (!parent || index >= parent->n_children)
+            return nullptr;
+        return &nodes[parent->first_child + index];
     }
 
-    bool RiffNode::exists(const std::string& name) {
-        // Search through the subchunks to find any with a matching name
-        for (RiffNode& node : subchunks) {
-            if (node.id == name.c_str()) {
-                return true;
+    RiffNode* RiffTree::find(const RiffNode* parent, const u32 id) {
+        if (!parent)
+            return nullptr;
+        for (RiffNode& node : children(parent)) {
+            if (node.id.id == id) {
+                return &node;
             }
         }
-        return false;
+        return nullptr;
     }
 
-    void RiffNode::visualize_tree(std::vector<bool>& draw_line, const int depth) {
-        // Set console code page to UTF-8 so console known how to interpret string data
-        //SetConsoleOutputCP(CP_UTF8);
-
+    void RiffTree::visualize_node(const RiffNode& node, std::vector<bool>& draw_line, const int depth) {
         // Enable buffering to prevent VS from chopping up UTF-8 byte sequences
         const int result = setvbuf(stdout, nullptr, _IOFBF, 1000);
         (void)result;
 
         // For each subchunk
-        for (size_t i = 0; i < subchunks.size(); i++) {
+        for (u32 i = 0; i < node.n_children; i++) {
+            const RiffNode& subchunk = nodes[node.first_child + i];
 
             bool is_last = false;
             // Print indentation
@@ -49,7 +44,7 @@ namespace Flan {
                     printf("       ");
             }
             // Print fancy tree characters
-            if (depth > 0 && i < subchunks.size() - 1) {
+            if (depth > 0 && i < node.n_children - 1) {
                 printf("|----- ");
             }
             else if (depth > 0) {
@@ -58,99 +53,251 @@ namespace Flan {
             }
             draw_line.push_back(!is_last);
             // Print info about subchunk
-            if (subchunks[i].subchunks.empty()) {
-                printf("CHUNK:%s (%u bytes)\n", subchunks[i].id.c_str().get(), subchunks[i].size);
+            if (!subchunk.is_list) {
+                printf("CHUNK:%s (%u bytes)\n", subchunk.id.c_str().get(), subchunk.size);
             }
             else {
-                printf("LIST:%s (%u bytes)\n", subchunks[i].id.c_str().get(), subchunks[i].size);
-                subchunks[i].visualize_tree(draw_line, depth + 1);
+                printf("LIST:%s (%u bytes)\n", subchunk.id.c_str().get(), subchunk.size);
+                visualize_node(subchunk, draw_line, depth + 1);
             }
             draw_line.pop_back();
         }
-
-            
     }
 
-    void RiffNode::get_subchunks(ChunkDataHandler& data_handler) {
-        // Loop over all the subchunks and sublists
-        Chunk chunk;
-        while (chunk.from_chunk_data_handler(data_handler)) {
-            // For lists
-            if (chunk.id == "LIST") {
-                // Get the list name
-                ChunkId list_name;
-                data_handler.get_data(&list_name, sizeof(ChunkId));
+    bool RiffTree::read_at(const u64 offset, void* destination, const u64 size) {
+        if (_buffer) {
+            if (offset > _buffer_size || size > _buffer_size - offset)
+                return false;
+            memcpy(destination, _buffer + offset, size);
+        }
+        else if (offset >= _window_offset && offset + size <= _window_offset + _window_size) {
+            memcpy(destination, _window.get() + (offset - _window_offset), size);
+            return true;
+        }
+        else {
+            if (!_file || !file_seek(_file.get(), offset))
+                return false;
 
-                // Create a chunk data handler for this list
-                ChunkDataHandler subchunk_data;
-                subchunk_data.from_data_handler(data_handler, chunk.size - 4);
+            // Big reads go straight to the destination, small ones fill the window first
+            if (size >= window_capacity) {
+                const u64 n_bytes = fread(destination, 1, size, _file.get());
+                _bytes_read += n_bytes;
+                return n_bytes == size;
+            }
+            _window_offset = offset;
+            _window_size = fread(_window.get(), 1, window_capacity, _file.get());
+            _bytes_read += _window_size;
+            if (size > _window_size)
+                return false;
+            memcpy(destination, _window.get(), size);
+            return true;
+        }
+        _bytes_read += size;
+        return true;
+    }
 
-                // Create a new list node, and recursively get its subchunks
-                RiffNode new_node;
-                new_node.id = list_name;
-                new_node.size = chunk.size - 4;
-                new_node.data = data_handler.data_pointer;
-                new_node.get_subchunks(subchunk_data);
+    void RiffTree::parse_list(const u32 list_index) {
+        // Loop over all the subchunks and sublists, in the order they're in the file so the headers are read front to back
+        u64 read_offset = nodes[list_index].offset;
+        const u64 end = read_offset + nodes[list_index].size;
+        u32 previous = RiffNode::none;
+        while (end - read_offset >= sizeof(Chunk)) {
+            Chunk chunk;
+            if (!read_at(read_offset, &chunk, sizeof(chunk)))
+                break;
+            read_offset += sizeof(chunk);
 
-                // Advance the current nodes' data pointer
-                data_handler.get_data(nullptr, chunk.size - 4);
+            RiffNode new_node;
+            new_node.parent = list_index;
+            new_node.id = chunk.id;
+            new_node.offset = read_offset;
+            new_node.size = chunk.size;
 
-                // Add that list node to the current node
-                subchunks.push_back(new_node);
-            }
-            // For chunks
-            else {
-                // Add the chunk, including its data, to the subchunk node
-                RiffNode new_node;
-                new_node.id = chunk.id;
-                new_node.size = chunk.size;
-                new_node.data = data_handler.data_pointer;
-                data_handler.get_data(nullptr, chunk.size);
-                subchunks.push_back(new_node);
+            // For lists, the list name is the node id, and the data starts after it
+            if (chunk.id == "LIST" && chunk.size >= 4 && end - read_offset >= 4 && read_at(read_offset, &new_node.id, sizeof(ChunkId))) {
+                new_node.offset += 4;
+                new_node.size -= 4;
+                new_node.is_list = true;
             }
 
+            // Don't let truncated chunks point past the end of their parent
+            if (new_node.size > end - new_node.offset)
+                new_node.size = static_cast<u32>(end - new_node.offset);
+            if (_buffer)
+                new_node.data = _buffer + new_node.offset;
+
+            const u32 index = static_cast<u32>(nodes.size());
+            if (previous != RiffNode::none)
+                nodes[previous].next_sibling = index;
+            else
+                nodes[list_index].first_child = index;
+            nodes[list_index].n_children++;
+            previous = index;
+            nodes.push_back(new_node);
+
+            // Recursively get the subchunks of sublists
+            if (new_node.is_list)
+                parse_list(index);
+
             // Enforce 16-bit alignment requirement
-            if (chunk.size % 2 == 1) {
-                data_handler.get_data(nullptr, 1);
-            }
+            const u64 padded_size = static_cast<u64>(chunk.size) + (chunk.size % 2);
+            if (padded_size >= end - read_offset)
+                break;
+            read_offset += padded_size;
         }
     }
 
-    bool RiffTree::from_file(const std::string& path) {
-        // Open file
-        std::ifstream input(path.c_str(), std::ios::in | std::ios::binary);
-        if (!input.good()) return false;
+    void RiffTree::group_children() {
+        // The nodes were added in file order, so a list's children have the children of its sublists in between them.
+        // Copy them over list by list instead, so the children of every list end up next to each other
+        std::vector<RiffNode> grouped;
+        grouped.reserve(nodes.size());
+        grouped.push_back(nodes.front());
+        for (u32 i = 0; i < grouped.size(); i++) {
+            u32 child_index = grouped[i].first_child;
+            if (grouped[i].n_children == 0)
+                continue;
+            grouped[i].first_child = static_cast<u32>(grouped.size());
+            while (child_index != RiffNode::none) {
+                RiffNode child = nodes[child_index];
+                child_index = child.next_sibling;
+                child.parent = i;
+                child.next_sibling = (child_index != RiffNode::none) ? static_cast<u32>(grouped.size()) + 1 : RiffNode::none;
+                grouped.push_back(child);
+            }
+        }
+        nodes = std::move(grouped);
+    }
 
+    bool RiffTree::parse_root(const u64 size) {
         // Load RIFF header
+        nodes.clear();
         RiffChunk riff_header;
-        input.read(reinterpret_cast<char*>(&riff_header), sizeof(riff_header));
+        if (!read_at(0, &riff_header, sizeof(riff_header)))
+            return false;
 
         // Verify if this is in fact a RIFF header
-        if (riff_header.type != "RIFF") return false;
-
-        // If all is good, read the entire file into a chunk handler
-        ChunkDataHandler riff_data;
-        const bool result = riff_data.from_ifstream(input, riff_header.size, false);
-        if (!result) return false;
-        data = riff_data.data_pointer;
+        if (riff_header.type != "RIFF" || riff_header.size <= 4)
+            return false;
 
-        // Create a RIFF node
+        // Create a RIFF node, only counting what's actually in the file. The size includes the form type, which was already read
+        RiffNode riff_chunk;
         riff_chunk.id = riff_header.name;
-        riff_chunk.size = riff_header.size;
+        riff_chunk.offset = sizeof(riff_header);
+        riff_chunk.size = static_cast<u32>(std::min<u64>(riff_header.size - 4, size - sizeof(riff_header)));
+        riff_chunk.is_list = true;
+        if (_buffer)
+            riff_chunk.data = _buffer + riff_chunk.offset;
+        nodes.push_back(riff_chunk);
 
         // Get subchunks
-        riff_chunk.get_subchunks(riff_data);
+        parse_list(0);
+        group_children();
         return true;
     }
 
+    bool RiffTree::from_buffer(u8* buffer, const u64 size) {
+        if (!buffer || size < sizeof(RiffChunk))
+            return false;
+        _buffer = buffer;
+        _buffer_size = size;
+        return parse_root(size);
+    }
+
+    bool RiffTree::from_file(const std::string& path) {
+        // Open file
+        FILE* file = nullptr;
+        if (fopen_s(&file, path.c_str(), "rb") != 0 || !file)
+            return false;
+        const std::unique_ptr<FILE, FileCloser> file_closer(file);
+
+        // Read the whole RIFF chunk into a buffer, as far as it's in the file
+        RiffChunk riff_header;
+        if (fread(&riff_header, sizeof(riff_header), 1, file) != 1 || riff_header.type != "RIFF" || riff_header.size <= 4)
+            return false;
+        const u64 size = static_cast<u64>(riff_header.size) + 8;
+        std::unique_ptr<u8[]> buffer(new (std::nothrow) u8[size]);
+        if (!buffer)
+            return false;
+        memcpy(buffer.get(), &riff_header, sizeof(riff_header));
+        const u64 file_size = sizeof(riff_header) + fread(buffer.get() + sizeof(riff_header), 1, size - sizeof(riff_header), file);
+
+        // Then find the chunks in it
+        _owned_buffers.push_back(std::move(buffer));
+        if (!from_buffer(_owned_buffers.back().get(), file_size))
+            return false;
+        _bytes_read = file_size;
+        return true;
+    }
+
+    bool RiffTree::open(const std::string& path) {
+        FILE* file = nullptr;
+        if (fopen_s(&file, path.c_str(), "rb") != 0 || !file)
+            return false;
+        _file.reset(file);
+
+        // Reads are either small ones through the window or big ones straight into a buffer, so the file's own buffering would only add a copy
+        setvbuf(file, nullptr, _IONBF, 0);
+        _window = std::make_unique<u8[]>(window_capacity);
+        _window_size = 0;
+        _buffer = nullptr;
+        _buffer_size = 0;
+
+        // The file size isn't needed, reading a truncated header just ends the list it's in
+        return parse_root(UINT64_MAX);
+    }
+
+    void RiffTree::close_file() {
+        _file.reset();
+        _window.reset();
+        _window_size = 0;
+    }
+
+    void RiffTree::set_data(const u32 list_index) {
+        const RiffNode& list = nodes[list_index];
+        for (u32 i = list.first_child; i < list.first_child + list.n_children; i++) {
+            nodes[i].data = list.data + (nodes[i].offset - list.offset);
+            if (nodes[i].is_list)
+                set_data(i);
+        }
+    }
+
+    u8* RiffTree::load(RiffNode* node) {
+        if (!node)
+            return nullptr;
+        if (node->data)
+            return node->data;
+
+        // Read the node's data into a buffer that lives as long as the tree
+        std::unique_ptr<u8[]> buffer(new (std::nothrow) u8[std::max<u32>(node->size, 1)]);
+        if (!buffer || !read_at(node->offset, buffer.get(), node->size))
+            return nullptr;
+        node->data = buffer.get();
+        _owned_buffers.push_back(std::move(buffer));
+
+        // The children of a list are in the same buffer
+        if (node->is_list)
+            set_data(static_cast<u32>(node - nodes.data()));
+        return node->data;
+    }
+
+    u64 RiffTree::copy(const RiffNode* node, void* destination, const u64 size) {
+        if (!node)
+            return 0;
+        const u64 n_bytes = std::min<u64>(size, node->size);
+        if (node->data)
+            memcpy(destination, node->data, n_bytes);
+        else if (!read_at(node->offset, destination, n_bytes))
+            return 0;
+        return n_bytes;
+    }
+
     void RiffTree::visualize_tree() {
+        if (nodes.empty())
+            return;
         printf("RIFF\n");
         std::vector<bool> draw_line{false};
         draw_line.push_back(true);
-        riff_chunk.visualize_tree(draw_line, 1);
-    }
-
-    RiffNode& RiffTree::operator[](const std::string& c) {
-        return riff_chunk[c];
+        visualize_node(root(), draw_line, 1);
     }
 }
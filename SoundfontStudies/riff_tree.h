@@ -1,26 +1,90 @@
 #pragma once
+#include <cstdio>
+#include <memory>
+#include <span>
 #include <string>
 #include "structs.h"
 
 namespace Flan {
+    // A chunk or list in a RiffTree. Lists have the list type as their id, like "lins" or "rgn ", and their data starts after it.
+    // Nodes point to each other with indices into RiffTree::nodes, and the children of a node are always next to each other.
     struct RiffNode {
+        static constexpr u32 none = 0xFFFFFFFF;
         ChunkId id;
         u32 size = 0;
-        u8* data = nullptr;
-        std::vector<RiffNode> subchunks;
-        RiffNode& operator[](const std::string& name);
-        RiffNode& operator[](size_t index);
-        bool exists(const std::string& name);
-        void visualize_tree(std::vector<bool>& draw_line, int depth = 0);
-        void get_subchunks(ChunkDataHandler& data_handler);
+        u8* data = nullptr;     // nullptr if the tree was opened with RiffTree::open() and the node hasn't been loaded yet
+        u64 offset = 0;         // Where the data starts in the file
+        bool is_list = false;
+        u32 parent = none;
+        u32 first_child = none;
+        u32 next_sibling = none;
+        u32 n_children = 0;
     };
 
     class RiffTree {
     public:
-        RiffNode riff_chunk;
-        u8* data = nullptr;
+        // Every chunk and list in the file, the first one is the RIFF chunk itself
+        std::vector<RiffNode> nodes;
+
+        // Read the whole file into a buffer owned by the tree, so every node has its data right away
         bool from_file(const std::string& path);
+
+        // Find the chunks in a RIFF file that's already in memory, like a MappedFile. The nodes point into it, so it has to outlive the tree
+        bool from_buffer(u8* buffer, u64 size);
+
+        // Only read the chunk headers, by seeking past the data. The data is read when it's needed with load() or copy(),
+        // so the file is kept open until close_file() is called or the tree is destroyed
+        bool open(const std::string& path);
+        void close_file();
+
         void visualize_tree();
-        RiffNode& operator[](const std::string& c);
+
+        // The RIFF chunk, its id is the form type like "sfbk" or "DLS "
+        RiffNode& root() { return nodes.front(); }
+
+        // Get the children of a node, or none if parent is nullptr. They're stored next to each other, so getting one by index doesn't have to go through the others
+        std::span<RiffNode> children(const RiffNode* parent);
+        RiffNode* child(const RiffNode* parent, size_t index);
+
+        // Get the first child of a node with a chunk id, or nullptr if there is none, or if parent is nullptr itself so lookups can be chained.
+        // Ids are compared as numbers, use the string literal version to have the id converted at compile time
+        RiffNode* find(const RiffNode* parent, u32 id);
+        RiffNode* find(const RiffNode* parent, const char (&id)[5]) { return find(parent, ChunkId::fourcc(id)); }
+
+        // Get the data of a node, reading it into a buffer owned by the tree if it isn't in memory yet. Loading a list also loads all of
+        // its children in the same read. Returns nullptr if node is nullptr or the data couldn't be read
+        u8* load(RiffNode* node);
+
+        // Copy the start of a node's data, without loading the node if it isn't in memory. Returns the number of bytes copied
+        u64 copy(const RiffNode* node, void* destination, u64 size);
+
+        // Copy the start of a chunk into a struct. If the chunk is smaller, the rest of the struct keeps its value. Returns false if node is nullptr
+        template <typename T>
+        bool read(const RiffNode* node, T& value) {
+            if (!node)
+                return false;
+            copy(node, &value, sizeof(T));
+            return true;
+        }
+
+        // Total number of bytes read from the file or the buffer so far, including the chunk headers
+        [[nodiscard]] u64 bytes_read() const { return _bytes_read; }
+    private:
+        static constexpr u64 window_capacity = 4096;
+        struct FileCloser { void operator()(FILE* file) const { fclose(file); } };
+        bool parse_root(u64 size);
+        void parse_list(u32 list_index);
+        void group_children();
+        bool read_at(u64 offset, void* destination, u64 size);
+        void set_data(u32 list_index);
+        void visualize_node(const RiffNode& node, std::vector<bool>& draw_line, int depth);
+        std::unique_ptr<FILE, FileCloser> _file;
+        std::unique_ptr<u8[]> _window;  // Small reads from the file, like chunk headers, go through this so nearby ones don't each need a read
+        u64 _window_offset = 0;
+        u64 _window_size = 0;
+        u8* _buffer = nullptr;
+        u64 _buffer_size = 0;
+        std::vector<std::unique_ptr<u8[]>> _owned_buffers;
+        u64 _bytes_read = 0;
     };
-}
\ No newline at end of file
+}
@@ -0,0 +1,186 @@
+#include "soundfont.h"
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include "parallel.h"
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FLAN_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace Flan {
+    // Convert 16-bit samples to floats from -1.0 to +1.0. If low_bytes isn't nullptr, it has the lower 8 bits of 24-bit samples,
+    // with source as the upper 16 bits
+    static void convert_frames(const i16* source, const u8* low_bytes, f32* destination, const u64 n_frames) {
+        u64 frame = 0;
+        if (!low_bytes) {
+            constexpr f32 scale = 1.0f / 32768.0f;
+#ifdef FLAN_SSE2
+            const __m128 scale_ps = _mm_set1_ps(scale);
+            for (; frame + 8 <= n_frames; frame += 8) {
+                // Sign extend 8 samples to 32-bit, then convert to float
+                const __m128i samples = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + frame));
+                const __m128i low = _mm_srai_epi32(_mm_unpacklo_epi16(samples, samples), 16);
+                const __m128i high = _mm_srai_epi32(_mm_unpackhi_epi16(samples, samples), 16);
+                _mm_storeu_ps(destination + frame, _mm_mul_ps(_mm_cvtepi32_ps(low), scale_ps));
+                _mm_storeu_ps(destination + frame + 4, _mm_mul_ps(_mm_cvtepi32_ps(high), scale_ps));
+            }
+#endif
+            for (; frame < n_frames; frame++)
+                destination[frame] = static_cast<f32>(source[frame]) * scale;
+        }
+        else {
+            constexpr f32 scale = 1.0f / 8388608.0f;
+#ifdef FLAN_SSE2
+            const __m128 scale_ps = _mm_set1_ps(scale);
+            const __m128i zero = _mm_setzero_si128();
+            for (; frame + 8 <= n_frames; frame += 8) {
+                // Sign extend the upper 16 bits and move them up by 8, then zero extend the lower 8 bits and put them underneath
+                const __m128i samples = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + frame));
+                const __m128i bytes = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(low_bytes + frame)), zero);
+                const __m128i low = _mm_or_si128(_mm_slli_epi32(_mm_srai_epi32(_mm_unpacklo_epi16(samples, samples), 16), 8), _mm_unpacklo_epi16(bytes, zero));
+                const __m128i high = _mm_or_si128(_mm_slli_epi32(_mm_srai_epi32(_mm_unpackhi_epi16(samples, samples), 16), 8), _mm_unpackhi_epi16(bytes, zero));
+                _mm_storeu_ps(destination + frame, _mm_mul_ps(_mm_cvtepi32_ps(low), scale_ps));
+                _mm_storeu_ps(destination + frame + 4, _mm_mul_ps(_mm_cvtepi32_ps(high), scale_ps));
+            }
+#endif
+            for (; frame < n_frames; frame++)
+                destination[frame] = static_cast<f32>(static_cast<i32>(source[frame]) * 256 + low_bytes[frame]) * scale;
+        }
+    }
+
+    void Soundfont::decode_pcm(const u8* source, i16* destination, u8* low_bytes, const u64 n_frames, const u16 bits_per_sample, const u16 n_channels) {
+        u64 frame = 0;
+#ifdef FLAN_SSE2
+        const __m128i sign = _mm_set1_epi8(static_cast<char>(0x80));
+        const __m128i ones = _mm_set1_epi16(1);
+        const __m128i zero = _mm_setzero_si128();
+#endif
+        if (bits_per_sample == 8 && n_channels == 1) {
+#ifdef FLAN_SSE2
+            for (; frame + 16 <= n_frames; frame += 16) {
+                // Flip the sign bit to make the samples signed, then put them in the upper half of 16-bit samples
+                const __m128i bytes = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + frame)), sign);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + frame), _mm_unpacklo_epi8(zero, bytes));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + frame + 8), _mm_unpackhi_epi8(zero, bytes));
+            }
+#endif
+            for (; frame < n_frames; frame++)
+                destination[frame] = static_cast<i16>((source[frame] - 128) * 256);
+        }
+        else if (bits_per_sample == 8 && n_channels == 2) {
+#ifdef FLAN_SSE2
+            for (; frame + 8 <= n_frames; frame += 8) {
+                // Sign extend to 16-bit, add the left and right channel together, and scale the sum up to 16-bit
+                const __m128i bytes = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + frame * 2)), sign);
+                const __m128i low = _mm_madd_epi16(_mm_srai_epi16(_mm_unpacklo_epi8(bytes, bytes), 8), ones);
+                const __m128i high = _mm_madd_epi16(_mm_srai_epi16(_mm_unpackhi_epi8(bytes, bytes), 8), ones);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + frame), _mm_slli_epi16(_mm_packs_epi32(low, high), 7));
+            }
+#endif
+            for (; frame < n_frames; frame++)
+                destination[frame] = static_cast<i16>((source[frame * 2] - 128 + source[frame * 2 + 1] - 128) * 128);
+        }
+        else if (bits_per_sample == 16 && n_channels == 1) {
+            memcpy(destination, source, n_frames * sizeof(i16));
+        }
+        else if (bits_per_sample == 16 && n_channels == 2) {
+#ifdef FLAN_SSE2
+            for (; frame + 8 <= n_frames; frame += 8) {
+                // Add the left and right channel together as 32-bit, then halve them and pack them back into 16-bit
+                const __m128i* frames = reinterpret_cast<const __m128i*>(source + frame * 4);
+                const __m128i low = _mm_srai_epi32(_mm_madd_epi16(_mm_loadu_si128(frames), ones), 1);
+                const __m128i high = _mm_srai_epi32(_mm_madd_epi16(_mm_loadu_si128(frames + 1), ones), 1);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + frame), _mm_packs_epi32(low, high));
+            }
+#endif
+            for (; frame < n_frames; frame++) {
+                i16 left, right;
+                memcpy(&left, source + frame * 4, sizeof(i16));
+                memcpy(&right, source + frame * 4 + 2, sizeof(i16));
+                destination[frame] = static_cast<i16>((left + right) >> 1);
+            }
+        }
+        else if (bits_per_sample == 24) {
+            // Three bytes per sample don't line up with SSE2 registers, so this one is scalar. The lowest 8 bits go to low_bytes if there is one
+            auto read_24 = [](const u8* bytes) { return static_cast<i32>(static_cast<u32>(bytes[0]) << 8 | static_cast<u32>(bytes[1]) << 16 | static_cast<u32>(bytes[2]) << 24) >> 8; };
+            for (; frame < n_frames; frame++) {
+                const u8* bytes = source + frame * 3 * n_channels;
+                const i32 value = n_channels == 2 ? (read_24(bytes) + read_24(bytes + 3)) >> 1 : read_24(bytes);
+                destination[frame] = static_cast<i16>(value >> 8);
+                if (low_bytes)
+                    low_bytes[frame] = static_cast<u8>(value & 0xFF);
+            }
+        }
+    }
+
+    void Soundfont::convert_samples_to_float(const u8* sm24, const i16* sm24_base, const u64 sm24_frames, const bool pad, const u32 n_threads) {
+        // Every part of the pool starts on a 64 byte boundary
+        constexpr u64 alignment_frames = 64 / sizeof(f32);
+        auto align = [](const u64 frames) { return (frames + alignment_frames - 1) / alignment_frames * alignment_frames; };
+        const u64 guard = pad ? sample_guard_frames : 0;
+        auto has_loop = [](const Sample& sample) { return sample.loop_start < sample.loop_end && sample.loop_end <= sample.length; };
+
+        // Lay out the pool the same way pad_sample_data() does: guard, sample, guard, and then guard, loop, guard for samples with a loop.
+        // Without padding, the loop is read from the sample itself
+        std::vector<u64> data_offsets(samples.size());
+        std::vector<u64> loop_offsets(samples.size());
+        u64 pool_frames = 0;
+        for (size_t i = 0; i < samples.size(); i++) {
+            const Sample& sample = samples[i];
+            data_offsets[i] = pool_frames + guard;
+            pool_frames = align(data_offsets[i] + sample.length + guard);
+            if (pad && has_loop(sample)) {
+                loop_offsets[i] = pool_frames + guard;
+                pool_frames = align(loop_offsets[i] + (sample.loop_end - sample.loop_start) + guard);
+            }
+        }
+
+        // Allocate it, zeroed so all the guards are already silent
+        std::vector<f32> pool(pool_frames + alignment_frames, 0.0f);
+        const u64 pool_start = (alignment_frames - reinterpret_cast<uintptr_t>(pool.data()) / sizeof(f32) % alignment_frames) % alignment_frames;
+        f32* base = pool.data() + pool_start;
+
+        // Split the samples into ranges of the same size, so one long sample doesn't end up on a single thread
+        constexpr u64 range_frames = 65536;
+        struct Range {
+            u32 sample;
+            u32 first_frame;
+        };
+        std::vector<Range> ranges;
+        for (size_t i = 0; i < samples.size(); i++) {
+            if (!samples[i].data) continue;
+            for (u64 frame = 0; frame < samples[i].length; frame += range_frames)
+                ranges.push_back({ static_cast<u32>(i), static_cast<u32>(frame) });
+        }
+        parallel_for(ranges.size(), n_threads, [&](const size_t range_index) {
+            const Range& range = ranges[range_index];
+            const Sample& sample = samples[range.sample];
+            const u64 n_frames = std::min<u64>(range_frames, sample.length - range.first_frame);
+            const bool in_sm24 = sm24 && !std::less<>()(sample.data, sm24_base) && std::less<>()(sample.data, sm24_base + sm24_frames);
+            const u8* low_bytes = in_sm24 ? sm24 + (sample.data - sm24_base) + range.first_frame : nullptr;
+            convert_frames(sample.data + range.first_frame, low_bytes, base + data_offsets[range.sample] + range.first_frame, n_frames);
+        });
+
+        // Point the samples to their floats, and copy the loops once the samples are converted
+        for (size_t i = 0; i < samples.size(); i++) {
+            Sample& sample = samples[i];
+            if (!sample.data) continue;
+            sample.format = SampleFormat::float32;
+            sample.float_data = base + data_offsets[i];
+            if (pad && has_loop(sample)) {
+                const u32 loop_length = sample.loop_end - sample.loop_start;
+                f32* loop = base + loop_offsets[i];
+                for (i64 frame = -static_cast<i64>(guard); frame < static_cast<i64>(loop_length + guard); frame++) {
+                    const i64 wrapped = (frame % loop_length + loop_length) % loop_length;
+                    loop[frame] = sample.float_data[sample.loop_start + wrapped];
+                }
+                sample.float_loop_data = loop;
+            }
+            else {
+                sample.float_loop_data = sample.float_data + std::min(sample.loop_start, sample.length);
+            }
+        }
+        _float_sample_data = std::move(pool);
+    }
+}
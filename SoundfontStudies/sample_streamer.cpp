@@ -0,0 +1,182 @@
+#include "sample_streamer.h"
+#include <algorithm>
+#include <cstring>
+#include "structs.h"
+
+namespace Flan {
+    bool SampleStreamer::open(const std::string& path, const u64 sample_data_offset, std::vector<u32> sample_starts, const u32 n_streams, const u32 buffer_frames, const u32 n_threads) {
+        close();
+        if (n_streams == 0 || buffer_frames == 0 || n_threads == 0)
+            return false;
+
+        // Every reader thread has its own file handle, so they can seek independently
+        for (u32 i = 0; i < n_threads; i++) {
+            FILE* file = nullptr;
+            if (fopen_s(&file, path.c_str(), "rb") != 0 || !file) {
+                close();
+                return false;
+            }
+            _files.push_back(file);
+        }
+
+        _sample_data_offset = sample_data_offset;
+        _sample_starts = std::move(sample_starts);
+        _buffer_frames = buffer_frames;
+        _n_streams = n_streams;
+        _streams = std::make_unique<Stream[]>(n_streams);
+        for (u32 i = 0; i < n_streams; i++)
+            _streams[i].buffer = std::make_unique<i16[]>(buffer_frames);
+
+        // Start the reader threads, each one handles every n_threads-th stream
+        _n_threads = n_threads;
+        _running = true;
+        for (u32 i = 0; i < n_threads; i++)
+            _threads.emplace_back(&SampleStreamer::reader_thread, this, _files[i], i);
+        return true;
+    }
+
+    void SampleStreamer::close() {
+        // Stop the reader threads
+        _running = false;
+        wake_readers();
+        for (std::thread& thread : _threads)
+            thread.join();
+        _threads.clear();
+        for (FILE* file : _files) {
+            const int _ = fclose(file);
+            (void)_;
+        }
+        _files.clear();
+        _streams.reset();
+        _n_streams = 0;
+        _sample_starts.clear();
+    }
+
+    i32 SampleStreamer::open_stream(const u32 sample_index, const u32 start_frame, const u32 end_frame) {
+        if (sample_index >= _sample_starts.size() || end_frame <= start_frame)
+            return -1;
+
+        // Find a free stream
+        for (u32 i = 0; i < _n_streams; i++) {
+            Stream& stream = _streams[i];
+            if (stream.active.load(std::memory_order_relaxed))
+                continue;
+
+            // Set it up to read the requested range. Another thread might have claimed it since the check above, so check again under the lock
+            {
+                std::lock_guard lock(stream.fill_mutex);
+                if (stream.active.load(std::memory_order_relaxed))
+                    continue;
+                stream.file_offset = _sample_data_offset + (static_cast<u64>(_sample_starts[sample_index]) + start_frame) * sizeof(i16);
+                stream.frames_to_read = end_frame - start_frame;
+                stream.frames_total.store(end_frame - start_frame, std::memory_order_relaxed);
+                stream.write_pos.store(0, std::memory_order_relaxed);
+                stream.read_pos.store(0, std::memory_order_relaxed);
+                stream.active.store(true, std::memory_order_release);
+            }
+            wake_readers();
+            return static_cast<i32>(i);
+        }
+        return -1;
+    }
+
+    u32 SampleStreamer::read(const i32 stream_index, i16* destination, const u32 n_frames) {
+        Stream& stream = _streams[stream_index];
+        const u64 read_pos = stream.read_pos.load(std::memory_order_relaxed);
+        const u64 write_pos = stream.write_pos.load(std::memory_order_acquire);
+        const u32 n_to_copy = static_cast<u32>(std::min<u64>(n_frames, write_pos - read_pos));
+
+        // Copy out of the ring buffer, which might wrap around
+        const u32 ring_start = static_cast<u32>(read_pos % _buffer_frames);
+        const u32 first_part = std::min(n_to_copy, _buffer_frames - ring_start);
+        memcpy(destination, &stream.buffer[ring_start], first_part * sizeof(i16));
+        memcpy(destination + first_part, &stream.buffer[0], (n_to_copy - first_part) * sizeof(i16));
+        stream.read_pos.store(read_pos + n_to_copy, std::memory_order_release);
+
+        // Let the reader threads know there's space to fill again
+        if (n_to_copy > 0)
+            wake_readers();
+        return n_to_copy;
+    }
+
+    u32 SampleStreamer::available(const i32 stream_index) const {
+        const Stream& stream = _streams[stream_index];
+        return static_cast<u32>(stream.write_pos.load(std::memory_order_acquire) - stream.read_pos.load(std::memory_order_relaxed));
+    }
+
+    bool SampleStreamer::finished(const i32 stream_index) const {
+        const Stream& stream = _streams[stream_index];
+        return stream.read_pos.load(std::memory_order_relaxed) >= stream.frames_total.load(std::memory_order_acquire);
+    }
+
+    void SampleStreamer::close_stream(const i32 stream_index) {
+        Stream& stream = _streams[stream_index];
+        std::lock_guard lock(stream.fill_mutex);
+        stream.active.store(false, std::memory_order_release);
+    }
+
+    void SampleStreamer::wake_readers() {
+        {
+            std::lock_guard lock(_wake_mutex);
+            _wake_count++;
+        }
+        _wake.notify_all();
+    }
+
+    void SampleStreamer::reader_thread(FILE* file, const u32 thread_index) {
+        // Reading in bigger pieces is a lot cheaper, so wait until at least a quarter of the buffer is free
+        const u32 min_read_frames = std::max(1u, _buffer_frames / 4);
+
+        while (_running) {
+            // Anything that happens from here on wakes the thread up again, even if it happens before the thread goes to sleep
+            u64 wake_count;
+            {
+                std::lock_guard lock(_wake_mutex);
+                wake_count = _wake_count;
+            }
+
+            bool did_work = false;
+            for (u32 i = thread_index; i < _n_streams; i += _n_threads) {
+                Stream& stream = _streams[i];
+                if (!stream.active.load(std::memory_order_acquire))
+                    continue;
+
+                // Don't wait for a stream that's being opened or closed, just come back to it later
+                std::unique_lock lock(stream.fill_mutex, std::try_to_lock);
+                if (!lock.owns_lock() || !stream.active.load(std::memory_order_relaxed) || stream.frames_to_read == 0)
+                    continue;
+
+                // See how much space there is in the ring buffer
+                const u64 write_pos = stream.write_pos.load(std::memory_order_relaxed);
+                const u64 free_frames = _buffer_frames - (write_pos - stream.read_pos.load(std::memory_order_acquire));
+                const u32 n_to_read = static_cast<u32>(std::min<u64>(free_frames, stream.frames_to_read));
+                if (n_to_read < std::min(min_read_frames, stream.frames_to_read))
+                    continue;
+
+                // Read into the ring buffer, which might wrap around
+                const u32 ring_start = static_cast<u32>(write_pos % _buffer_frames);
+                const u32 first_part = std::min(n_to_read, _buffer_frames - ring_start);
+                file_seek(file, stream.file_offset);
+                size_t n_read = fread(&stream.buffer[ring_start], sizeof(i16), first_part, file);
+                if (n_read == first_part && n_to_read > first_part)
+                    n_read += fread(&stream.buffer[0], sizeof(i16), n_to_read - first_part, file);
+
+                // Treat reading past the end of the file as the end of the stream
+                if (n_read < n_to_read) {
+                    stream.frames_to_read = static_cast<u32>(n_read);
+                    stream.frames_total.store(static_cast<u32>(write_pos + n_read), std::memory_order_release);
+                }
+                stream.file_offset += n_read * sizeof(i16);
+                stream.frames_to_read -= static_cast<u32>(n_read);
+                stream.write_pos.store(write_pos + n_read, std::memory_order_release);
+                did_work = true;
+            }
+
+            // Sleep until a stream is opened or read from, or the streamer is closed
+            if (!did_work) {
+                std::unique_lock lock(_wake_mutex);
+                _wake.wait(lock, [&] { return _wake_count != wake_count || !_running; });
+            }
+        }
+    }
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "common.h"
+
+namespace Flan {
+    // Streams the parts of samples that aren't kept in memory from disk, using background reader threads.
+    // Each playing voice that needs streamed data opens a stream, which is a ring buffer that the reader threads keep filled.
+    class SampleStreamer {
+    public:
+        SampleStreamer() = default;
+        SampleStreamer(const SampleStreamer&) = delete;
+        SampleStreamer& operator=(const SampleStreamer&) = delete;
+        ~SampleStreamer() { close(); }
+
+        // Open the file once for every reader thread, and start the threads. Returns false if the file can't be opened.
+        // sample_data_offset is the byte offset of the 16-bit sample data in the file, and sample_starts holds the offset of each
+        // sample in that data, in samples.
+        bool open(const std::string& path, u64 sample_data_offset, std::vector<u32> sample_starts, u32 n_streams, u32 buffer_frames, u32 n_threads);
+        void close();
+
+        // Start streaming the samples from start_frame up to end_frame of a sample into a free stream.
+        // Returns the stream index, or -1 if all streams are in use.
+        i32 open_stream(u32 sample_index, u32 start_frame, u32 end_frame);
+
+        // Copy up to n_frames samples that have been streamed in so far, returns the number of samples copied
+        u32 read(i32 stream, i16* destination, u32 n_frames);
+
+        // Number of samples that can be read from a stream right now
+        [[nodiscard]] u32 available(i32 stream) const;
+
+        // True once every sample of the stream's range has been read
+        [[nodiscard]] bool finished(i32 stream) const;
+
+        // Stop a stream so it can be reused for another voice
+        void close_stream(i32 stream);
+
+    private:
+        struct Stream {
+            std::atomic<bool> active = false;        // Only set while holding fill_mutex
+            std::mutex fill_mutex;                   // Held by the reader thread while filling, and when (re)opening or closing the stream
+            u64 file_offset = 0;                     // Byte offset in the file of the next sample to read
+            u32 frames_to_read = 0;                  // Number of samples that still need to be read from the file
+            std::atomic<u32> frames_total = 0;       // Number of samples in the stream's range
+            std::atomic<u64> write_pos = 0;          // Total number of samples written into the ring buffer
+            std::atomic<u64> read_pos = 0;           // Total number of samples read from the ring buffer
+            std::unique_ptr<i16[]> buffer;
+        };
+        void reader_thread(FILE* file, u32 thread_index);
+        void wake_readers();
+
+        u64 _sample_data_offset = 0;
+        std::vector<u32> _sample_starts;
+        u32 _buffer_frames = 0;
+        std::unique_ptr<Stream[]> _streams;
+        u32 _n_streams = 0;
+        std::vector<std::thread> _threads;
+        std::vector<FILE*> _files;       // One per reader thread
+        u32 _n_threads = 0;
+        std::atomic<bool> _running = false;
+        std::mutex _wake_mutex;
+        std::condition_variable _wake;
+        u64 _wake_count = 0;             // Bumped under _wake_mutex whenever there might be new work, so a reader never sleeps through it
+    };
+}
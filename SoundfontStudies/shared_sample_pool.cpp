@@ -0,0 +1,88 @@
+#include "shared_sample_pool.h"
+#include <algorithm>
+#include <cstring>
+
+namespace Flan {
+    u64 SharedSamplePool::hash(const i16* data, const u32 length) {
+        // Mix 4 samples at a time, then whatever is left, and the length so silence of different lengths doesn't collide
+        constexpr u64 multiplier = 0x9E3779B97F4A7C15ull;
+        u64 result = 0xCBF29CE484222325ull ^ (static_cast<u64>(length) * multiplier);
+        u32 i = 0;
+        for (; i + 4 <= length; i += 4) {
+            u64 word;
+            memcpy(&word, data + i, sizeof(word));
+            result = (result ^ word) * multiplier;
+            result ^= result >> 29;
+        }
+        for (; i < length; i++) {
+            result = (result ^ static_cast<u16>(data[i])) * multiplier;
+            result ^= result >> 29;
+        }
+        return result;
+    }
+
+    i16* SharedSamplePool::acquire(const i16* data, const u32 length, const u64 hash) {
+        std::lock_guard lock(_mutex);
+        _referenced_bytes += static_cast<u64>(length) * sizeof(i16);
+
+        // Use the existing copy if there is one
+        const auto [first, last] = _entries_by_hash.equal_range(hash);
+        for (auto it = first; it != last; ++it) {
+            Entry& entry = *it->second;
+            if (entry.length == length && memcmp(entry.data.get(), data, length * sizeof(i16)) == 0) {
+                entry.n_references++;
+                return entry.data.get();
+            }
+        }
+
+        // Otherwise, copy it into the pool
+        auto entry = std::make_unique<Entry>();
+        entry->data = std::make_unique<i16[]>(std::max(length, 1u));
+        memcpy(entry->data.get(), data, length * sizeof(i16));
+        entry->length = length;
+        entry->hash = hash;
+        entry->n_references = 1;
+        i16* pooled_data = entry->data.get();
+        _entries_by_hash.emplace(hash, entry.get());
+        _entries.emplace(pooled_data, std::move(entry));
+        _memory_usage += static_cast<u64>(length) * sizeof(i16);
+        return pooled_data;
+    }
+
+    void SharedSamplePool::release(const i16* pooled_data) {
+        std::lock_guard lock(_mutex);
+        const auto found = _entries.find(pooled_data);
+        if (found == _entries.end())
+            return;
+        Entry& entry = *found->second;
+        _referenced_bytes -= static_cast<u64>(entry.length) * sizeof(i16);
+        if (--entry.n_references > 0)
+            return;
+
+        // Nobody uses it anymore, remove it from the pool
+        const auto [first, last] = _entries_by_hash.equal_range(entry.hash);
+        for (auto it = first; it != last; ++it) {
+            if (it->second == &entry) {
+                _entries_by_hash.erase(it);
+                break;
+            }
+        }
+        _memory_usage -= static_cast<u64>(entry.length) * sizeof(i16);
+        _entries.erase(found);
+    }
+
+    size_t SharedSamplePool::n_samples() const {
+        std::lock_guard lock(_mutex);
+        return _entries.size();
+    }
+
+    u64 SharedSamplePool::memory_usage() const {
+        std::lock_guard lock(_mutex);
+        return _memory_usage;
+    }
+
+    u64 SharedSamplePool::referenced_bytes() const {
+        std::lock_guard lock(_mutex);
+        return _referenced_bytes;
+    }
+}
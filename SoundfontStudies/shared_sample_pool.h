@@ -0,0 +1,44 @@
+#pragma once
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include "common.h"
+
+namespace Flan {
+    // Sample data that can be shared between soundfonts. Samples with the same contents are only stored once, and every soundfont
+    // that uses one holds a reference to it. Pass the same pool to every soundfont through LoadSettings::sample_pool. Thread safe.
+    class SharedSamplePool {
+    public:
+        SharedSamplePool() = default;
+        SharedSamplePool(const SharedSamplePool&) = delete;
+        SharedSamplePool& operator=(const SharedSamplePool&) = delete;
+
+        // Hash the contents of a sample, to pass to acquire(). Separate so it can be done on multiple threads
+        static u64 hash(const i16* data, u32 length);
+
+        // Get pooled sample data with the same contents as data, and add a reference to it. The data is copied into the pool
+        // if there's no identical sample in it yet. Every acquire() needs a release() with the returned pointer
+        i16* acquire(const i16* data, u32 length, u64 hash);
+        void release(const i16* pooled_data);
+
+        // Number of unique samples in the pool, and their size in bytes
+        [[nodiscard]] size_t n_samples() const;
+        [[nodiscard]] u64 memory_usage() const;
+
+        // Number of bytes that would be used if every reference had its own copy
+        [[nodiscard]] u64 referenced_bytes() const;
+
+    private:
+        struct Entry {
+            std::unique_ptr<i16[]> data;
+            u32 length = 0;
+            u64 hash = 0;
+            u32 n_references = 0;
+        };
+        mutable std::mutex _mutex;
+        std::unordered_multimap<u64, Entry*> _entries_by_hash;
+        std::unordered_map<const i16*, std::unique_ptr<Entry>> _entries; // Pooled data pointer -> entry
+        u64 _memory_usage = 0;
+        u64 _referenced_bytes = 0;
+    };
+}
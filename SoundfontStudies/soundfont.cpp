@@ -1,28 +1,15 @@
 #include "soundfont.h"
 #include <iostream>
 #include <vector>
-#include <cassert>
 #include <algorithm>
+#include <bit>
+#include <cmath>
 
 #include "envs_lfos.h"
-
-#define VERBOSE 0
-#define PRINT_AT_ALL 0
+#include "parallel.h"
+#include "print.h"
 
 namespace Flan {
-    template<class... Args>
-    void print([[maybe_unused]] const char* fmt, [[maybe_unused]] Args... args) {
-#if PRINT_AT_ALL
-        printf(fmt, args...);
-#endif
-    }
-    template<class... Args>
-    void print_verbose([[maybe_unused]] const char* fmt, [[maybe_unused]] Args... args) {
-#if VERBOSE
-        print(fmt, args...);
-#endif
-    }
-
     double freq32_to_hz(const i32 scale)
     {
         return pow(2.0, (((static_cast<double>(scale) / 65536.0) - 6900.0) / 1200.0) * 440.0);
@@ -41,65 +28,179 @@ namespace Flan {
         return static_cast<double>(scale) / static_cast<double>(0x10000);
     }
 
-    static void init_default_zone(std::map<std::string, GenAmountType>& preset_zone_generator_values) {
+    static GeneratorValues init_default_zone() {
         // Zero initialize everything
-        for (std::string& str : SFGenerator_names)
-            preset_zone_generator_values[str].u_amount = 0x0000;
+        GeneratorValues zone{};
 
         // Handle non zero values
-        preset_zone_generator_values["initialFilterFc"].s_amount = 13500;
-        preset_zone_generator_values["delayModLFO"].s_amount = -12000;
-        preset_zone_generator_values["delayVibLFO"].s_amount = -12000;
-        preset_zone_generator_values["delayModEnv"].s_amount = -12000;
-        preset_zone_generator_values["attackModEnv"].s_amount = -12000;
-        preset_zone_generator_values["holdModEnv"].s_amount = -12000;
-        preset_zone_generator_values["decayModEnv"].s_amount = -12000;
-        preset_zone_generator_values["releaseModEnv"].s_amount = -12000;
-        preset_zone_generator_values["delayVolEnv"].s_amount = -12000;
-        preset_zone_generator_values["attackVolEnv"].s_amount = -12000;
-        preset_zone_generator_values["holdVolEnv"].s_amount = -12000;
-        preset_zone_generator_values["decayVolEnv"].s_amount = -12000;
-        preset_zone_generator_values["releaseVolEnv"].s_amount = -12000;
-        preset_zone_generator_values["keyRange"].ranges = { 0, 127 };
-        preset_zone_generator_values["velRange"].ranges = { 0, 127 };
-        preset_zone_generator_values["keynum"].s_amount = -1;
-        preset_zone_generator_values["velocity"].s_amount = -1;
-        preset_zone_generator_values["scaleTuning"].u_amount = 100;
-        preset_zone_generator_values["overridingRootKey"].s_amount = -1;
-        preset_zone_generator_values["initialAttenuation"].u_amount = 0;
+        zone[initialFilterFc].s_amount = 13500;
+        zone[delayModLFO].s_amount = -12000;
+        zone[delayVibLFO].s_amount = -12000;
+        zone[delayModEnv].s_amount = -12000;
+        zone[attackModEnv].s_amount = -12000;
+        zone[holdModEnv].s_amount = -12000;
+        zone[decayModEnv].s_amount = -12000;
+        zone[releaseModEnv].s_amount = -12000;
+        zone[delayVolEnv].s_amount = -12000;
+        zone[attackVolEnv].s_amount = -12000;
+        zone[holdVolEnv].s_amount = -12000;
+        zone[decayVolEnv].s_amount = -12000;
+        zone[releaseVolEnv].s_amount = -12000;
+        zone[keyRange].ranges = { 0, 127 };
+        zone[velRange].ranges = { 0, 127 };
+        zone[keynum].s_amount = -1;
+        zone[velocity].s_amount = -1;
+        zone[scaleTuning].u_amount = 100;
+        zone[overridingRootKey].s_amount = -1;
+        zone[initialAttenuation].u_amount = 0;
+        return zone;
+    }
+    static const GeneratorValues default_zone = init_default_zone();
+
+    // Bit masks of the generators a preset zone can apply to an instrument zone, per apply mode
+    static u64 init_preset_gen_mask(const GenApplyMode apply_mode) {
+        u64 mask = 0;
+        for (u64 i = 0; i < std::size(gen_flags); i++) {
+            if (!gen_flags[i].instr_only && gen_flags[i].apply_mode == apply_mode)
+                mask |= 1ull << i;
+        }
+        return mask;
+    }
+    static const u64 preset_gen_add_mask = init_preset_gen_mask(add);
+    static const u64 preset_gen_clamp_mask = init_preset_gen_mask(clamp_range);
+
+    // Returns the number of generators that were skipped because their type is unknown
+    static u32 read_zone_generators(const sfGenList* gens, const u16 start, const u16 end, GeneratorValues& zone) {
+        u32 n_unknown = 0;
+        for (u16 i = start; i < end; i++) {
+            const sfGenList gen = gens[i];
+            if (gen.oper < endOper)
+                zone.set(gen.oper, gen.amount);
+            else
+                n_unknown++;
+        }
+        return n_unknown;
+    }
+
+    template<typename T>
+    static T* read_pdta_table(ChunkDataHandler& chunk_data, const Chunk& chunk, unsigned int& count, const bool in_place, [[maybe_unused]] const char* name) {
+        T* table;
+        if (in_place) {
+            // Point straight into the mapped file
+            table = reinterpret_cast<T*>(chunk_data.data_pointer);
+            chunk_data.get_data(nullptr, chunk.size);
+        }
+        else {
+            // Allocate enough space and copy the data into it
+            table = static_cast<T*>(counted_malloc(chunk.size));
+            chunk_data.get_data(table, chunk.size);
+        }
+        count = chunk.size / sizeof(T);
+        print_verbose("[INFO] Found %zu %s", chunk.size / sizeof(T), name);
+        if (chunk.size / sizeof(T) > 1) { print_verbose("s"); }
+        return table;
+    }
+
+    LoadReport* Soundfont::start_report(const LoadSettings& settings) {
+        _load_report = {};
+        _report = settings.collect_report ? &_load_report : nullptr;
+        _allocation_counter = settings.allocation_counter;
+        _peak_memory_counter = settings.peak_memory_counter;
+        return _report;
     }
 
-    bool Soundfont::from_file(const std::string& path) {
+    bool Soundfont::from_file(const std::string& path, const LoadSettings& settings) {
+        // Try the cache first, if there is one
+        const bool use_cache = !settings.cache_path.empty() && !settings.stream_samples && !settings.float_samples && !settings.compress_samples && !settings.sample_pool;
+        LoadReport cache_report;
+        if (use_cache) {
+            LoadPhaseTimer timer(settings.collect_report ? &cache_report : nullptr, LoadPhase::cache, settings.allocation_counter, settings.peak_memory_counter);
+            if (from_cache(settings.cache_path, path, settings)) {
+                timer.count_read(_mapped_file.size);
+                timer.stop();
+                start_report(settings);
+                _load_report = cache_report;
+                _load_report.from_cache = true;
+                _load_report.n_presets = presets.size();
+                _load_report.n_presets_built = presets.size();
+                for (const auto& [preset_id, preset] : presets)
+                    _load_report.n_zones += preset.zones.size();
+                _load_report.n_samples = samples.size();
+                return true;
+            }
+        }
+
         const std::string extension = path.substr(path.find_last_of('.'));
+        bool loaded = false;
         if (extension == ".sf2")
-            return from_sf2(path);
-        if (extension == ".dls")
-            return from_dls(path);
-        return false;
+            loaded = from_sf2(path, settings);
+        else if (extension == ".dls")
+            loaded = from_dls(path, settings);
+        else
+            start_report(settings);
+
+        // Write the cache for next time. Checking the cache counts towards the cache phase as well
+        if (!use_cache)
+            return loaded;
+        if (_report)
+            (*_report)[LoadPhase::cache] = cache_report[LoadPhase::cache];
+        LoadPhaseTimer timer(_report, LoadPhase::cache, _allocation_counter, _peak_memory_counter);
+        if (loaded && !save_cache(settings.cache_path, path, settings))
+            print("[WARNING] Could not write cache file!\n");
+        return loaded;
     }
 
-    bool Soundfont::from_sf2(const std::string& path)
+    bool Soundfont::from_sf2(const std::string& path, const LoadSettings& settings)
     {
         // We use this for easy data sharing between functions, without exposing this to the end user
         RawSoundfontData raw_sf{};
+        LoadReport* report = start_report(settings);
+        LoadPhaseTimer timer(report, LoadPhase::riff_scan, settings.allocation_counter, settings.peak_memory_counter);
+
+        // Open file - when memory mapping, all chunk data is read in place from the mapping instead
+        const bool in_place = settings.memory_map;
+        const bool streaming = settings.stream_samples && !in_place;
+        FILE* in_file = nullptr;
+        ChunkDataHandler mapped_data;
+        if (in_place) {
+            if (!_mapped_file.open(path)) { print("[ERROR] Could not map file!\n"); return false; }
+            mapped_data.from_buffer(_mapped_file.data, static_cast<u32>(_mapped_file.size));
+        }
+        else {
+            auto err = fopen_s(&in_file, path.c_str(), "rb");
+            if (err) { print("[ERROR] Could not open file! Error code 0x%X\n", err); return false; }
+            if (!in_file) { print("[ERROR] Could not open file!\n"); return false; }
+        }
 
-        // Open file
-        FILE* in_file;
-        auto err = fopen_s(&in_file, path.c_str(), "rb");
-        if (err) { print("[ERROR] Could not open file! Error code 0x%X\n", err); return false; }
-        if (!in_file) { print("[ERROR] Could not open file!\n"); return false; }
+        // Helpers to read from either the file or the mapping
+        auto read_chunk_header = [&](Chunk& chunk) {
+            timer.count_read(sizeof(ChunkId) + sizeof(u32));
+            return in_place ? chunk.from_chunk_data_handler(mapped_data) : chunk.from_file(in_file);
+        };
+        auto read_chunk_id = [&](ChunkId& id) {
+            timer.count_read(sizeof(ChunkId));
+            return in_place ? mapped_data.get_data(&id, sizeof(ChunkId)) : fread_s(&id, sizeof(ChunkId), sizeof(ChunkId), 1, in_file) > 0;
+        };
+        auto read_chunk_data = [&](ChunkDataHandler& chunk_data, const u32 size) {
+            if (!in_place) {
+                timer.count_read(size);
+                return chunk_data.from_file(in_file, size);
+            }
+            chunk_data.from_data_handler(mapped_data, size);
+            return mapped_data.get_data(nullptr, size);
+        };
 
         // Read RIFF chunk header
         {
             Chunk riff_chunk;
-            riff_chunk.from_file(in_file);
+            read_chunk_header(riff_chunk);
             if (!riff_chunk.verify("RIFF")) return false;
         }
 
         // There should be a 'sfbk' chunk now
         {
             ChunkId sfbk;
-            fread_s(&sfbk, sizeof(ChunkId), sizeof(ChunkId), 1, in_file);
+            read_chunk_id(sfbk);
             if (sfbk != "sfbk") { print("[ERROR] Expected an 'sfbk' chunk, but did not find one!\n"); return false; }
         }
 
@@ -108,12 +209,12 @@ namespace Flan {
         {
             // Read the chunk header
             Chunk curr_chunk;
-            curr_chunk.from_file(in_file);
+            read_chunk_header(curr_chunk);
             if (!curr_chunk.verify("LIST")) return false;
 
             // Create a chunk data handler
             ChunkDataHandler curr_chunk_data;
-            curr_chunk_data.from_file(in_file, curr_chunk.size);
+            read_chunk_data(curr_chunk_data, curr_chunk.size);
 
             // INFO chunk header
             ChunkId info;
@@ -152,16 +253,45 @@ namespace Flan {
         }
 
         print_verbose("\n---sdta LIST---\n\n");
+        timer.next(LoadPhase::sample_read);
         // There are 3 LIST chunks. The second one is the sdta list - contains raw sample data
-        {
+        u64 sample_data_offset = 0;
+        u64 sample_data_size = 0;
+        std::vector<u8> sm24_copy;
+        const u8* sm24 = nullptr; // Lower 8 bits of 24-bit samples, only read when converting to floats
+        u64 sm24_size = 0;
+        if (streaming) {
+            // Read the chunk header
+            Chunk curr_chunk;
+            read_chunk_header(curr_chunk);
+            if (!curr_chunk.verify("LIST")) return false;
+            const u64 list_end = file_tell(in_file) + curr_chunk.size;
+
+            // INFO chunk header
+            ChunkId info;
+            read_chunk_id(info);
+            if (info != "sdta") { print("[ERROR] Expected an 'sdta' chunk, but did not find one!\n"); return false; }
+
+            // Only remember where the sample data is, and skip over everything
+            Chunk chunk;
+            while (file_tell(in_file) < list_end && chunk.from_file(in_file)) {
+                if (chunk.id == "smpl") {
+                    sample_data_offset = file_tell(in_file);
+                    print_verbose("[INFO] Found sample data, %i bytes total\n", chunk.size);
+                }
+                file_seek(in_file, file_tell(in_file) + chunk.size + chunk.size % 2);
+            }
+            file_seek(in_file, list_end);
+        }
+        else {
             // Read the chunk header
             Chunk curr_chunk;
-            curr_chunk.from_file(in_file);
+            read_chunk_header(curr_chunk);
             if (!curr_chunk.verify("LIST")) return false;
 
             // Create a chunk data handler
             ChunkDataHandler curr_chunk_data;
-            curr_chunk_data.from_file(in_file, curr_chunk.size);
+            read_chunk_data(curr_chunk_data, curr_chunk.size);
 
             // INFO chunk header
             ChunkId info;
@@ -174,11 +304,31 @@ namespace Flan {
                 bool should_continue = chunk.from_chunk_data_handler(curr_chunk_data);
                 if (!should_continue) { break; }
 
-                if (chunk.id == "smpl") { // Raw sample data
-                    _sample_data = static_cast<int16_t*>(malloc(chunk.size));
+                if (chunk.id == "smpl" && in_place) { // Raw sample data, used straight from the mapping
+                    _sample_data = reinterpret_cast<int16_t*>(curr_chunk_data.data_pointer);
+                    sample_data_size = chunk.size;
+                    curr_chunk_data.get_data(nullptr, chunk.size);
+                    print_verbose("[INFO] Found sample data, %i bytes total\n", chunk.size);
+                }
+                else if (chunk.id == "smpl") { // Raw sample data
+                    _sample_data = static_cast<int16_t*>(counted_malloc(chunk.size));
+                    sample_data_size = chunk.size;
                     curr_chunk_data.get_data(_sample_data, chunk.size);
                     print_verbose("[INFO] Found sample data, %i bytes total\n", chunk.size);
                 }
+                else if (chunk.id == "sm24" && settings.float_samples) { // Lower 8 bits of 24-bit sample data, one byte per sample
+                    if (in_place) {
+                        sm24 = curr_chunk_data.data_pointer;
+                        curr_chunk_data.get_data(nullptr, chunk.size);
+                    }
+                    else {
+                        sm24_copy.resize(chunk.size);
+                        curr_chunk_data.get_data(sm24_copy.data(), chunk.size);
+                        sm24 = sm24_copy.data();
+                    }
+                    sm24_size = chunk.size;
+                    print_verbose("[INFO] Found 24-bit sample data\n");
+                }
                 else { // Not a chunk we're interested in, skip it (unlikely in this list though)
                     curr_chunk_data.get_data(nullptr, chunk.size);
                 }
@@ -186,6 +336,7 @@ namespace Flan {
         }
 
         print_verbose("\n---pdta LIST---\n\n");
+        timer.next(LoadPhase::table_parse);
         // There are 3 LIST chunks. The second one is the pdta list - this has presets, instruments, and sample header data
         raw_sf.preset_headers = nullptr;  raw_sf.n_preset_headers = 0;
         raw_sf.preset_bags = nullptr;     raw_sf.n_preset_bags = 0;
@@ -199,17 +350,19 @@ namespace Flan {
         {
             // Read the chunk header
             Chunk curr_chunk;
-            curr_chunk.from_file(in_file);
+            read_chunk_header(curr_chunk);
             if (!curr_chunk.verify("LIST")) return false;
 
             // INFO chunk header
             ChunkId info;
-            fread_s(&info, sizeof(ChunkId), sizeof(ChunkId), 1, in_file);
+            read_chunk_id(info);
             if (info != "pdta") { print("[ERROR] Expected an 'ptda' chunk, but did not find one!\n"); return false; }
 
-            // Create a chunk data handler
+            // Create a chunk data handler. When memory mapping, the tables are read straight from the mapping
             ChunkDataHandler curr_chunk_data;
-            curr_chunk_data.from_file(in_file, curr_chunk.size);
+            read_chunk_data(curr_chunk_data, curr_chunk.size - sizeof(ChunkId));
+            if (in_place)
+                timer.count_read(curr_chunk.size - sizeof(ChunkId));
 
             // Handle all chunks in LIST chunk
             while (true) {
@@ -218,76 +371,31 @@ namespace Flan {
                 if (!should_continue) { break; }
 
                 if (chunk.id == "phdr") { // Preset header
-                    // Allocate enough space and copy the data into it
-                    raw_sf.preset_headers = static_cast<SfPresetHeader*>(malloc(chunk.size));
-                    curr_chunk_data.get_data(raw_sf.preset_headers, chunk.size);
-                    raw_sf.n_preset_headers = chunk.size / sizeof(SfPresetHeader);
-                    print_verbose("[INFO] Found %zu preset header", chunk.size / sizeof(SfPresetHeader));
-                    if (chunk.size / sizeof(SfPresetHeader) > 1) { print_verbose("s"); }
+                    raw_sf.preset_headers = read_pdta_table<SfPresetHeader>(curr_chunk_data, chunk, raw_sf.n_preset_headers, in_place, "preset header");
                 }
                 else if (chunk.id == "pbag") { // Preset bags
-                    // Allocate enough space and copy the data into it
-                    raw_sf.preset_bags = static_cast<SfBag*>(malloc(chunk.size));
-                    curr_chunk_data.get_data(raw_sf.preset_bags, chunk.size);
-                    raw_sf.n_preset_bags = chunk.size / sizeof(SfBag);
-                    print_verbose("[INFO] Found %zu preset bag", chunk.size / sizeof(SfBag));
-                    if (chunk.size / sizeof(SfBag) > 1) { print_verbose("s"); }
+                    raw_sf.preset_bags = read_pdta_table<SfBag>(curr_chunk_data, chunk, raw_sf.n_preset_bags, in_place, "preset bag");
                 }
                 else if (chunk.id == "pmod") { // Preset modulators
-                    // Allocate enough space and copy the data into it
-                    raw_sf.preset_mods = static_cast<sfModList*>(malloc(chunk.size));
-                    curr_chunk_data.get_data(raw_sf.preset_mods, chunk.size);
-                    raw_sf.n_preset_mods = chunk.size / sizeof(sfModList);
-                    print_verbose("[INFO] Found %zu preset modulator", chunk.size / sizeof(sfModList));
-                    if (chunk.size / sizeof(sfModList) > 1) { print_verbose("s"); }
+                    raw_sf.preset_mods = read_pdta_table<sfModList>(curr_chunk_data, chunk, raw_sf.n_preset_mods, in_place, "preset modulator");
                 }
                 else if (chunk.id == "pgen") { // Preset generator
-                    // Allocate enough space and copy the data into it
-                    raw_sf.preset_gens = static_cast<sfGenList*>(malloc(chunk.size));
-                    curr_chunk_data.get_data(raw_sf.preset_gens, chunk.size);
-                    raw_sf.n_preset_gens = chunk.size / sizeof(sfGenList);
-                    print_verbose("[INFO] Found %zu preset generator", chunk.size / sizeof(sfGenList));
-                    if (chunk.size / sizeof(sfGenList) > 1) { print_verbose("s"); }
+                    raw_sf.preset_gens = read_pdta_table<sfGenList>(curr_chunk_data, chunk, raw_sf.n_preset_gens, in_place, "preset generator");
                 }
                 else if (chunk.id == "inst") { // Instrument header
-                    // Allocate enough space and copy the data into it
-                    raw_sf.instruments = static_cast<sfInst*>(malloc(chunk.size));
-                    curr_chunk_data.get_data(raw_sf.instruments, chunk.size);
-                    raw_sf.n_instruments = chunk.size / sizeof(sfInst);
-                    print_verbose("[INFO] Found %zu instrument", chunk.size / sizeof(sfInst));
-                    if (chunk.size / sizeof(sfInst) > 1) { print_verbose("s"); }
+                    raw_sf.instruments = read_pdta_table<sfInst>(curr_chunk_data, chunk, raw_sf.n_instruments, in_place, "instrument");
                 }
                 else if (chunk.id == "ibag") { // Instrument bag
-                    // Allocate enough space and copy the data into it
-                    raw_sf.instr_bags = static_cast<SfBag*>(malloc(chunk.size));
-                    curr_chunk_data.get_data(raw_sf.instr_bags, chunk.size);
-                    raw_sf.n_instr_bags = chunk.size / sizeof(SfBag);
-                    print_verbose("[INFO] Found %zu instrument bag", chunk.size / sizeof(SfBag));
-                    if (chunk.size / sizeof(SfBag) > 1) { print_verbose("s"); }
+                    raw_sf.instr_bags = read_pdta_table<SfBag>(curr_chunk_data, chunk, raw_sf.n_instr_bags, in_place, "instrument bag");
                 }
                 else if (chunk.id == "imod") { // Instrument modulator
-                    // Allocate enough space and copy the data into it
-                    raw_sf.instr_mods = static_cast<sfModList*>(malloc(chunk.size));
-                    curr_chunk_data.get_data(raw_sf.instr_mods, chunk.size);
-                    raw_sf.n_instr_mods = chunk.size / sizeof(sfModList);
-                    print_verbose("[INFO] Found %zu instrument modulator", chunk.size / sizeof(sfModList));
-                    if (chunk.size / sizeof(sfModList) > 1) { print_verbose("s"); }
+                    raw_sf.instr_mods = read_pdta_table<sfModList>(curr_chunk_data, chunk, raw_sf.n_instr_mods, in_place, "instrument modulator");
                 }
                 else if (chunk.id == "igen") { // Instrument generator
-                    // Allocate enough space and copy the data into it
-                    raw_sf.instr_gens = static_cast<sfGenList*>(malloc(chunk.size));
-                    curr_chunk_data.get_data(raw_sf.instr_gens, chunk.size);
-                    raw_sf.n_instr_gens = chunk.size / sizeof(sfGenList);
-                    print_verbose("[INFO] Found %zu instrument generator", chunk.size / sizeof(sfGenList));
-                    if (chunk.size / sizeof(sfGenList) > 1) { print_verbose("s"); }
+                    raw_sf.instr_gens = read_pdta_table<sfGenList>(curr_chunk_data, chunk, raw_sf.n_instr_gens, in_place, "instrument generator");
                 }
                 else if (chunk.id == "shdr") { // Sample headers
-                    // Allocate enough space and copy the data into it
-                    raw_sf.sample_headers = static_cast<sfSample*>(malloc(chunk.size));
-                    curr_chunk_data.get_data(raw_sf.sample_headers, chunk.size);
-                    raw_sf.n_samples = chunk.size / sizeof(sfSample);
-                    print_verbose("[INFO] Found %zu sample", chunk.size / sizeof(sfSample));
-                    if (chunk.size / sizeof(sfSample) > 1) { print_verbose("s"); }
+                    raw_sf.sample_headers = read_pdta_table<sfSample>(curr_chunk_data, chunk, raw_sf.n_samples, in_place, "sample");
                 }
                 else { // Not a chunk we're interested in, skip it (unlikely in this list though)
                     curr_chunk_data.get_data(nullptr, chunk.size);
@@ -311,16 +419,20 @@ namespace Flan {
             corr_mul = powf(2.0f, corr_mul);
             new_sample.base_sample_rate = static_cast<float>(raw_sf.sample_headers[index].sample_rate) * corr_mul;
 
-            // Allocate memory and copy the sample data into it
+            // Point to the sample data - when streaming, this is done later once the resident parts are loaded
             auto start = raw_sf.sample_headers[index].start_index;
             new_sample.length = raw_sf.sample_headers[index].end_index - start;
-            new_sample.data = (i16*)&_sample_data[raw_sf.sample_headers[index].start_index];
+            new_sample.resident_length = new_sample.length;
+            if (!streaming)
+                new_sample.data = (i16*)&_sample_data[raw_sf.sample_headers[index].start_index];
 
             // Loop data
             new_sample.loop_start = raw_sf.sample_headers[index].loop_start_index - start;
             new_sample.loop_end = raw_sf.sample_headers[index].loop_end_index - start;
+            if (!streaming)
+                new_sample.loop_data = new_sample.data + new_sample.loop_start;
             new_sample.type = raw_sf.sample_headers[index].type;
-            if (new_sample.type != monoSample)
+            if (new_sample.type != monoSample && !streaming)
                 new_sample.linked = (i16*)&_sample_data[raw_sf.sample_headers[raw_sf.sample_headers[index].sample_link].start_index];
             else
                 new_sample.linked = nullptr;
@@ -346,9 +458,45 @@ namespace Flan {
             }
         }
 
+        // When streaming, load the parts of the samples that stay in memory, and start streaming the rest
+        timer.next(LoadPhase::sample_read);
+        if (streaming && !sf2_load_resident_samples(path, in_file, sample_data_offset, raw_sf, settings, timer)) {
+            print("[ERROR] Could not load resident sample data, or open the file for streaming!\n");
+            return false;
+        }
+
         print_verbose("\n--PRESETS--\n\n");
-        for (unsigned int p_id = 0; p_id < raw_sf.n_preset_headers - 1; p_id++) {
-            get_sf2_preset_from_index(p_id, raw_sf);
+        timer.next(LoadPhase::preset_build);
+        // In lazy mode, only remember where each preset is. The raw tables are kept around to build them when they're first requested
+        if (settings.lazy_presets) {
+            for (unsigned int p_id = 0; p_id + 1 < raw_sf.n_preset_headers; p_id++) {
+                _lazy_preset_indices[(raw_sf.preset_headers[p_id].bank << 8) | raw_sf.preset_headers[p_id].program] = p_id;
+            }
+            _built_presets = std::make_unique<std::atomic<const Preset*>[]>(65536);
+            _raw_sf = raw_sf;
+            _raw_sf_owned = !in_place;
+        }
+
+        // Every preset only depends on the raw soundfont data, so they can be built in parallel. The last phdr entry is the terminator
+        const size_t n_presets = (raw_sf.n_preset_headers > 0 && !settings.lazy_presets) ? raw_sf.n_preset_headers - 1 : 0;
+        std::vector<Preset> built_presets(n_presets);
+        std::vector<u64> n_unknown_generators(n_presets, 0);
+        parallel_for(n_presets, settings.n_threads, [&](const size_t p_id) {
+            built_presets[p_id] = get_sf2_preset_from_index(p_id, raw_sf, n_unknown_generators[p_id]);
+        });
+
+        // Add them to the presets in order, so duplicate preset numbers resolve the same way regardless of thread count
+        for (size_t p_id = 0; p_id < n_presets; p_id++) {
+            if (report) {
+                report->n_presets_built++;
+                report->n_zones += built_presets[p_id].zones.size();
+                report->n_unknown_generators += n_unknown_generators[p_id];
+            }
+            presets[(raw_sf.preset_headers[p_id].bank << 8) | raw_sf.preset_headers[p_id].program] = std::move(built_presets[p_id]);
+        }
+        if (report) {
+            report->n_presets = presets.size() + _lazy_preset_indices.size();
+            report->n_samples = samples.size();
         }
 
         if (!raw_sf.sample_headers) {
@@ -356,113 +504,482 @@ namespace Flan {
         }
 
         // Close the file
-        const int _ = fclose(in_file);
-        (void)_;
+        if (in_file) {
+            const int _ = fclose(in_file);
+            (void)_;
+        }
         print("Soundfont '%s' loaded succesfully!", path.c_str());
 
-        // Free temporary pointers
-        void* pointers_to_clear[] = { raw_sf.preset_headers, raw_sf.preset_bags, raw_sf.preset_mods, raw_sf.preset_gens, raw_sf.instruments, raw_sf.instr_bags, raw_sf.instr_mods, raw_sf.instr_gens, raw_sf.sample_headers };
-        for (auto pointer : pointers_to_clear)
-            free(pointer);
+        // Free temporary pointers - when memory mapped, these point into the mapping instead
+        if (!in_place && !settings.lazy_presets) {
+            void* pointers_to_clear[] = { raw_sf.preset_headers, raw_sf.preset_bags, raw_sf.preset_mods, raw_sf.preset_gens, raw_sf.instruments, raw_sf.instr_bags, raw_sf.instr_mods, raw_sf.instr_gens, raw_sf.sample_headers };
+            for (auto pointer : pointers_to_clear)
+                free(pointer);
+        }
+
+        // Compressed samples can't be padded or converted, since they aren't in memory anymore
+        timer.next(LoadPhase::sample_processing);
+        if (settings.compress_samples && !streaming && !in_place) {
+            compress_sample_data(settings, true);
+            return true;
+        }
+
+        // Lazily built presets might still need their loop offsets, so only bake them when all presets are built
+        if (settings.pad_samples && !streaming && !settings.lazy_presets)
+            bake_static_loop_offsets();
+
+        // The sm24 chunk should have one byte for every sample in the smpl chunk, otherwise it's ignored
+        if (settings.float_samples && !streaming) {
+            if (sm24 && sm24_size < sample_data_size / sizeof(i16)) {
+                print("[WARNING] The sm24 chunk is smaller than the smpl chunk, only using 16-bit sample data!\n");
+                sm24 = nullptr;
+            }
+            convert_samples_to_float(sm24, _sample_data, sample_data_size / sizeof(i16), settings.pad_samples, settings.n_threads);
+        }
+        if (settings.pad_samples && !streaming)
+            pad_sample_data(!in_place);
+        else if (settings.sample_pool && !streaming && !in_place)
+            share_sample_data(settings.sample_pool, true, settings.n_threads);
 
         return true;
     }
 
-    bool Soundfont::from_dls(const std::string& path)
+    static bool sample_has_loop(const Sample& sample) {
+        return sample.loop_start < sample.loop_end && sample.loop_end <= sample.length;
+    }
+
+    bool Soundfont::sf2_load_resident_samples(const std::string& path, FILE* file, const u64 sample_data_offset, const RawSoundfontData& raw_sf, const LoadSettings& settings, LoadPhaseTimer& timer) {
+        // Loops always stay in memory, whatever is left of the budget is used for the start of each sample
+        u64 loop_frames = 0;
+        for (const Sample& sample : samples) {
+            if (sample_has_loop(sample))
+                loop_frames += sample.loop_end - sample.loop_start;
+        }
+        const u64 budget_frames = settings.stream_memory_budget / sizeof(i16);
+        const u64 head_budget = budget_frames > loop_frames ? budget_frames - loop_frames : 0;
+
+        // Find the biggest number of samples to keep from the start of each sample that fits in the budget
+        auto frames_needed = [&](const u32 head_frames) {
+            u64 total = 0;
+            for (const Sample& sample : samples)
+                total += std::min(sample.length, head_frames);
+            return total;
+        };
+        u32 head_low = 0;
+        u32 head_high = settings.stream_head_frames;
+        while (head_low < head_high) {
+            const u32 head_mid = head_low + (head_high - head_low + 1) / 2;
+            if (frames_needed(head_mid) <= head_budget)
+                head_low = head_mid;
+            else
+                head_high = head_mid - 1;
+        }
+        const u32 head_frames = head_low;
+        print_verbose("[INFO] Keeping the first %u samples of each sample in memory\n", head_frames);
+
+        // Figure out how much memory we need - loops that are already inside the start of the sample don't need a copy
+        u64 pool_frames = 0;
+        for (Sample& sample : samples) {
+            sample.resident_length = std::min(sample.length, head_frames);
+            pool_frames += sample.resident_length;
+            if (sample_has_loop(sample) && sample.loop_end > sample.resident_length)
+                pool_frames += sample.loop_end - sample.loop_start;
+        }
+        _sample_data = static_cast<i16*>(counted_malloc(std::max<u64>(pool_frames, 1) * sizeof(i16)));
+        if (!_sample_data) return false;
+
+        // Read the resident parts of each sample into the pool
+        i16* pool = _sample_data;
+        auto read_frames = [&](const u32 first_frame, const u32 n_frames) {
+            i16* destination = pool;
+            file_seek(file, sample_data_offset + static_cast<u64>(first_frame) * sizeof(i16));
+            const size_t n_read = fread(destination, sizeof(i16), n_frames, file);
+            timer.count_read(n_read * sizeof(i16));
+            memset(destination + n_read, 0, (n_frames - n_read) * sizeof(i16));
+            pool += n_frames;
+            return destination;
+        };
+        for (size_t i = 0; i < samples.size(); i++) {
+            Sample& sample = samples[i];
+            const u32 start = raw_sf.sample_headers[i].start_index;
+            sample.data = read_frames(start, sample.resident_length);
+            if (sample_has_loop(sample) && sample.loop_end > sample.resident_length)
+                sample.loop_data = read_frames(start + sample.loop_start, sample.loop_end - sample.loop_start);
+            else
+                sample.loop_data = sample.data + sample.loop_start;
+        }
+
+        // Now that every sample is in memory, the linked samples can be set
+        for (size_t i = 0; i < samples.size(); i++) {
+            const u16 link = raw_sf.sample_headers[i].sample_link;
+            if (samples[i].type != monoSample && link < samples.size())
+                samples[i].linked = samples[link].data;
+        }
+
+        // Start streaming
+        std::vector<u32> sample_starts(samples.size());
+        for (size_t i = 0; i < samples.size(); i++)
+            sample_starts[i] = raw_sf.sample_headers[i].start_index;
+        _streamer = std::make_unique<SampleStreamer>();
+        return _streamer->open(path, sample_data_offset, std::move(sample_starts), settings.stream_voices, settings.stream_buffer_frames, settings.stream_threads);
+    }
+
+    bool Soundfont::from_dls(const std::string& path, const LoadSettings& settings)
     {
-        // Get a riff tree of the DLS file
+        LoadReport* report = start_report(settings);
+        LoadPhaseTimer timer(report, LoadPhase::riff_scan, settings.allocation_counter, settings.peak_memory_counter);
+
+        // Get a riff tree of the DLS file. Only the chunk headers are read here, the data is read when it's needed, or used in place when memory mapped
+        const bool in_place = settings.memory_map;
         RiffTree riff_tree;
-        riff_tree.from_file(path);
+        if (in_place) {
+            if (!_mapped_file.open(path)) { print("[ERROR] Could not map file!\n"); return false; }
+            if (!riff_tree.from_buffer(_mapped_file.data, _mapped_file.size)) return false;
+        }
+        else if (!riff_tree.open(path)) {
+            return false;
+        }
+        u64 bytes_read = 0;
+        auto count_read = [&] {
+            timer.count_read(riff_tree.bytes_read() - bytes_read);
+            bytes_read = riff_tree.bytes_read();
+        };
+        count_read();
 
         // Get samples
-        dls_get_samples(riff_tree);
-        _sample_data = reinterpret_cast<int16_t*>(riff_tree.data);
+        timer.next(LoadPhase::sample_read);
+        std::vector<u8> low_bytes;
+        if (!dls_get_samples(riff_tree, settings, low_bytes))
+            return false;
+        count_read();
 
-        // Get presets
+        // Get presets, the instrument headers count as table parsing and the rest as building presets
+        timer.next(LoadPhase::table_parse);
         {
-            // Loop over all instruments in the instrument list
-            for (RiffNode& ins : riff_tree["lins"].subchunks) {
-                // Init preset and global zone
-                Preset preset{};
-                Zone global_zone{};
+            // Read the whole instrument list at once, it's small compared to the wave pool
+            RiffNode* instrument_list_node = riff_tree.find(&riff_tree.root(), "lins");
+            riff_tree.load(instrument_list_node);
+            count_read();
+
+            // Loop over all instruments in the instrument list, and find out which preset each one is first
+            const std::span<RiffNode> instrument_list = riff_tree.children(instrument_list_node);
+            std::vector<u16> preset_ids(instrument_list.size());
+            for (size_t i = 0; i < instrument_list.size(); i++) {
+                RiffNode& ins = instrument_list[i];
 
                 // Get instrument header
                 DlsInsh insh{};
-                memcpy_s(&insh, sizeof(insh), ins["insh"].data, ins["insh"].size);
+                riff_tree.read(riff_tree.find(&ins, "insh"), insh);
 
-                // Get instrument name
-                preset.name = std::string(reinterpret_cast<char*>(ins["INFO"]["INAM"].data));
+                // Get preset number
+                insh.bank_id >>= 8;
+                if ((insh.bank_id & 0x800000) > 0) {
+                    insh.bank_id += 128;
+                    insh.bank_id -= 0x800000;
+                }
+                preset_ids[i] = static_cast<uint16_t>(insh.bank_id << 8 | insh.instr_id);
+            }
 
-                // Apply global zone if it exists
-                if (ins.exists("lart")) {
-                    ChunkDataHandler data;
-                    data.from_buffer(ins["lart"]["art1"].data, ins["lart"]["art1"].size);
-                    handle_art1(data, global_zone);
+            // Add the presets to the soundfont, or remember where they are so they can be built when they're first requested
+            if (!settings.lazy_presets)
+                timer.next(LoadPhase::preset_build);
+            else
+                _built_presets = std::make_unique<std::atomic<const Preset*>[]>(65536);
+            for (size_t i = 0; i < instrument_list.size(); i++) {
+                if (settings.lazy_presets) {
+                    _lazy_preset_indices[preset_ids[i]] = i;
+                    continue;
                 }
-                if (ins.exists("lar2")) {
-                    ChunkDataHandler data;
-                    data.from_buffer(ins["lar2"]["art2"].data, ins["lar2"]["art2"].size);
-                    handle_art1(data, global_zone);
+                u64 n_unknown_articulators = 0;
+                Preset& preset = presets[preset_ids[i]];
+                preset = get_dls_preset(instrument_list[i], riff_tree, n_unknown_articulators);
+                if (report) {
+                    report->n_presets_built++;
+                    report->n_zones += preset.zones.size();
+                    report->n_unknown_articulators += n_unknown_articulators;
                 }
+            }
+        }
+        if (report) {
+            report->n_presets = presets.size() + _lazy_preset_indices.size();
+            report->n_samples = samples.size();
+        }
 
-                // Loop over individual zones in the instrument
-                for (RiffNode& rgn : ins["lrgn"].subchunks) {
-                    // Get the zone chunks
-                    dlsRgnh rgnh{}; memcpy_s(&rgnh, sizeof(rgnh), rgn["rgnh"].data, rgn["rgnh"].size);
-                    dlsWsmp wsmp{}; memcpy_s(&wsmp, sizeof(wsmp), rgn["wsmp"].data, rgn["wsmp"].size);
-                    dlsWlnk wlnk{}; memcpy_s(&wlnk, sizeof(wlnk), rgn["wlnk"].data, rgn["wlnk"].size);
-
-                    // Create a zone out of it based on the global zone
-                    Zone zone = global_zone;
-                    zone.key_range_low = static_cast<uint8_t>(rgnh.key_low);
-                    zone.key_range_high = static_cast<uint8_t>(rgnh.key_high);
-                    zone.vel_range_low = static_cast<uint8_t>(rgnh.vel_low);
-                    zone.vel_range_high = static_cast<uint8_t>(rgnh.vel_high);
-                    zone.sample_index = wlnk.smpl_idx;
-                    zone.loop_enable = wsmp.loop_mode;
-
-                    // If the zone has an articulator, apply it
-                    if (rgn.exists("lart")) {
-                        ChunkDataHandler data;
-                        data.from_buffer(rgn["lart"]["art1"].data, rgn["lart"]["art1"].size);
-                        handle_art1(data, zone);
-                    }
-                    if (rgn.exists("lar2")) {
-                        ChunkDataHandler data;
-                        data.from_buffer(rgn["lar2"]["art2"].data, rgn["lar2"]["art2"].size);
-                        handle_art1(data, zone);
-                    }
+        // Everything that's needed has been read now. The instruments are read from the RIFF tree when they're requested, so keep it around
+        riff_tree.close_file();
+        if (settings.lazy_presets)
+            _riff_tree = std::move(riff_tree);
+
+        // The sample data has its own buffer, or lives in the mapping
+        timer.next(LoadPhase::sample_processing);
+        if (settings.compress_samples && !in_place) {
+            compress_sample_data(settings, true);
+            return true;
+        }
+        if (settings.pad_samples && !settings.lazy_presets)
+            bake_static_loop_offsets();
+        if (settings.float_samples)
+            convert_samples_to_float(low_bytes.empty() ? nullptr : low_bytes.data(), in_place ? _decoded_sample_data.data() : _sample_data, low_bytes.size(), settings.pad_samples, settings.n_threads);
+        if (settings.pad_samples)
+            pad_sample_data(!in_place);
+        else if (settings.sample_pool && !in_place)
+            share_sample_data(settings.sample_pool, true, settings.n_threads);
 
-                    // Apply wsmp chunk
-                    dlsWsmp sample_wsmp{};
-                    if (riff_tree["wvpl"][wlnk.smpl_idx].exists("wsmp"))
-                        memcpy_s(&sample_wsmp, sizeof(dlsWsmp), riff_tree["wvpl"][wlnk.smpl_idx]["wsmp"].data, riff_tree["wvpl"][wlnk.smpl_idx]["wsmp"].size);
-                    zone.root_key_offset = static_cast<int>(sample_wsmp.root_key) - static_cast<int>(wsmp.root_key);
-                    zone.sample_loop_start_offset = static_cast<int32_t>(wsmp.loop_start - samples[wlnk.smpl_idx].loop_start);
-                    zone.sample_loop_end_offset = static_cast<int32_t>((wsmp.loop_start + wsmp.loop_length) - samples[wlnk.smpl_idx].loop_end);
+        return true;
+    }
 
-                    // Add zone to preset
-                    preset.zones.push_back(zone);
+    void Soundfont::bake_static_loop_offsets() {
+        // Find the loop offsets every sample is used with. Samples used with different offsets keep their own loop
+        struct LoopOffsets {
+            i32 start = 0;
+            i32 end = 0;
+            bool used = false;
+            bool static_offsets = true;
+        };
+        std::vector<LoopOffsets> offsets(samples.size());
+        for (const auto& [preset_id, preset] : presets) {
+            for (const Zone& zone : preset.zones) {
+                if (zone.sample_index >= samples.size()) continue;
+                LoopOffsets& sample_offsets = offsets[zone.sample_index];
+                if (!sample_offsets.used) {
+                    sample_offsets = { zone.sample_loop_start_offset, zone.sample_loop_end_offset, true, true };
+                }
+                else if (sample_offsets.start != zone.sample_loop_start_offset || sample_offsets.end != zone.sample_loop_end_offset) {
+                    sample_offsets.static_offsets = false;
                 }
+            }
+        }
 
-                // Add the preset to the soundfont
-                insh.bank_id >>= 8;
-                if ((insh.bank_id & 0x800000) > 0) {
-                    insh.bank_id += 128;
-                    insh.bank_id -= 0x800000;
+        // Move the offsets into the sample loop, if the result is still a valid loop
+        std::vector<bool> baked(samples.size(), false);
+        for (size_t i = 0; i < samples.size(); i++) {
+            Sample& sample = samples[i];
+            const LoopOffsets& sample_offsets = offsets[i];
+            if (!sample_offsets.used || !sample_offsets.static_offsets || (sample_offsets.start == 0 && sample_offsets.end == 0))
+                continue;
+            const i64 loop_start = static_cast<i64>(sample.loop_start) + sample_offsets.start;
+            const i64 loop_end = static_cast<i64>(sample.loop_end) + sample_offsets.end;
+            if (loop_start < 0 || loop_start >= loop_end || loop_end > sample.length)
+                continue;
+            sample.loop_start = static_cast<u32>(loop_start);
+            sample.loop_end = static_cast<u32>(loop_end);
+            sample.loop_data = sample.data + sample.loop_start;
+            baked[i] = true;
+        }
+        for (auto& [preset_id, preset] : presets) {
+            for (Zone& zone : preset.zones) {
+                if (zone.sample_index < samples.size() && baked[zone.sample_index]) {
+                    zone.sample_loop_start_offset = 0;
+                    zone.sample_loop_end_offset = 0;
                 }
-                presets[static_cast<uint16_t>(insh.bank_id << 8 | insh.instr_id)] = preset;
             }
         }
+    }
 
-        return true;
+    void Soundfont::pad_sample_data(const bool free_original) {
+        // Every part of the pool starts on a 64 byte boundary
+        constexpr u64 alignment_frames = 64 / sizeof(i16);
+        auto align = [](const u64 frames) { return (frames + alignment_frames - 1) / alignment_frames * alignment_frames; };
+        constexpr u64 guard = sample_guard_frames;
+        static_assert(guard % alignment_frames == 0, "Guard frames should keep the sample data aligned");
+
+        // Lay out the pool: guard, sample, guard, and then guard, loop, guard for samples with a loop
+        std::vector<u64> data_offsets(samples.size());
+        std::vector<u64> loop_offsets(samples.size());
+        u64 pool_frames = 0;
+        for (size_t i = 0; i < samples.size(); i++) {
+            const Sample& sample = samples[i];
+            data_offsets[i] = pool_frames + guard;
+            pool_frames = align(data_offsets[i] + sample.length + guard);
+            if (sample_has_loop(sample)) {
+                loop_offsets[i] = pool_frames + guard;
+                pool_frames = align(loop_offsets[i] + (sample.loop_end - sample.loop_start) + guard);
+            }
+        }
+
+        // Allocate it, zeroed so all the guards around the sample data are already silent
+        std::vector<i16> pool(pool_frames + alignment_frames, 0);
+        const u64 pool_start = (alignment_frames - reinterpret_cast<uintptr_t>(pool.data()) / sizeof(i16) % alignment_frames) % alignment_frames;
+        i16* base = pool.data() + pool_start;
+
+        // Copy the samples and loops. Linked samples point to the other sample's new data
+        std::map<const i16*, i16*> new_data;
+        for (size_t i = 0; i < samples.size(); i++) {
+            const Sample& sample = samples[i];
+            if (sample.data) {
+                memcpy(base + data_offsets[i], sample.data, sample.length * sizeof(i16));
+                new_data[sample.data] = base + data_offsets[i];
+            }
+        }
+        for (size_t i = 0; i < samples.size(); i++) {
+            Sample& sample = samples[i];
+            const auto linked = new_data.find(sample.linked);
+            sample.linked = linked != new_data.end() ? linked->second : nullptr;
+            sample.data = sample.data ? base + data_offsets[i] : nullptr;
+            sample.guard_frames = sample.data ? sample_guard_frames : 0;
+            if (sample.data && sample_has_loop(sample)) {
+                const u32 loop_length = sample.loop_end - sample.loop_start;
+                i16* loop = base + loop_offsets[i];
+                for (i64 frame = -static_cast<i64>(guard); frame < static_cast<i64>(loop_length + guard); frame++) {
+                    const i64 wrapped = (frame % loop_length + loop_length) % loop_length;
+                    loop[frame] = sample.data[sample.loop_start + wrapped];
+                }
+                sample.loop_data = loop;
+            }
+            else if (sample.data) {
+                sample.loop_data = sample.data + std::min(sample.loop_start, sample.length);
+            }
+        }
+
+        // The old sample data isn't used anymore
+        if (free_original && !_mapped_file.is_open()) {
+            free(_sample_data);
+            _sample_data = nullptr;
+        }
+        _padded_sample_data = std::move(pool);
+    }
+
+    void Soundfont::compress_sample_data(const LoadSettings& settings, const bool free_original) {
+        _compressed = std::make_unique<CompressedSamples>();
+        _compressed->compress(samples, settings.compressed_cache_blocks, settings.n_threads);
+        u64 original_bytes = 0;
+        for (const Sample& sample : samples)
+            original_bytes += sample.data ? sample.length * sizeof(i16) : 0;
+        print_verbose("[INFO] Compressed %llu bytes of sample data to %llu bytes\n", static_cast<unsigned long long>(original_bytes), static_cast<unsigned long long>(_compressed->memory_usage()));
+
+        // Only the loops are left in memory
+        for (size_t i = 0; i < samples.size(); i++) {
+            Sample& sample = samples[i];
+            sample.data = nullptr;
+            sample.linked = nullptr;
+            sample.resident_length = 0;
+            sample.loop_data = _compressed->loop_data(static_cast<u32>(i));
+        }
+        if (free_original) {
+            free(_sample_data);
+            _sample_data = nullptr;
+        }
+    }
+
+    void Soundfont::share_sample_data(const std::shared_ptr<SharedSamplePool>& pool, const bool free_original, const u32 n_threads) {
+        // Hashing is the slow part, so do that on all threads first
+        std::vector<u64> hashes(samples.size());
+        parallel_for(samples.size(), n_threads, [&](const size_t i) {
+            if (samples[i].data)
+                hashes[i] = SharedSamplePool::hash(samples[i].data, samples[i].length);
+        });
+
+        // Move every sample into the pool. Linked samples point to the other sample's new data
+        std::vector<i16*> pooled_data(samples.size(), nullptr);
+        std::map<const i16*, i16*> new_data;
+        for (size_t i = 0; i < samples.size(); i++) {
+            if (!samples[i].data) continue;
+            pooled_data[i] = pool->acquire(samples[i].data, samples[i].length, hashes[i]);
+            new_data[samples[i].data] = pooled_data[i];
+            _pooled_samples.push_back(pooled_data[i]);
+        }
+        for (size_t i = 0; i < samples.size(); i++) {
+            Sample& sample = samples[i];
+            const auto linked = new_data.find(sample.linked);
+            sample.linked = linked != new_data.end() ? linked->second : nullptr;
+            sample.data = pooled_data[i];
+            if (sample.data)
+                sample.loop_data = sample.data + std::min(sample.loop_start, sample.length);
+        }
+        _sample_pool = pool;
+        print_verbose("[INFO] Shared sample pool: %zu samples, %llu bytes\n", pool->n_samples(), static_cast<unsigned long long>(pool->memory_usage()));
+
+        // The old sample data isn't used anymore
+        if (free_original) {
+            free(_sample_data);
+            _sample_data = nullptr;
+        }
+    }
+
+    Preset Soundfont::get_dls_preset(RiffNode& ins, RiffTree& riff_tree, u64& n_unknown_articulators) const
+    {
+        // Init preset and global zone
+        Preset preset{};
+        Zone global_zone{};
+
+        // Get instrument name, the chunk isn't always null terminated
+        RiffNode* inam = riff_tree.find(riff_tree.find(&ins, "INFO"), "INAM");
+        if (const u8* name = riff_tree.load(inam))
+            preset.name = std::string(reinterpret_cast<const char*>(name), strnlen(reinterpret_cast<const char*>(name), inam->size));
+
+        // Apply global zone if it exists
+        if (RiffNode* art1 = riff_tree.find(riff_tree.find(&ins, "lart"), "art1")) {
+            ChunkDataHandler data;
+            data.from_buffer(riff_tree.load(art1), art1->size);
+            handle_art1(data, global_zone, n_unknown_articulators);
+        }
+        if (RiffNode* art2 = riff_tree.find(riff_tree.find(&ins, "lar2"), "art2")) {
+            ChunkDataHandler data;
+            data.from_buffer(riff_tree.load(art2), art2->size);
+            handle_art1(data, global_zone, n_unknown_articulators);
+        }
+
+        // The wave pool is the same for every zone, so only look it up once
+        const RiffNode* wave_pool = riff_tree.find(&riff_tree.root(), "wvpl");
+
+        // Loop over individual zones in the instrument
+        for (RiffNode& rgn : riff_tree.children(riff_tree.find(&ins, "lrgn"))) {
+            // Get the zone chunks
+            dlsRgnh rgnh{}; riff_tree.read(riff_tree.find(&rgn, "rgnh"), rgnh);
+            dlsWsmp wsmp{}; riff_tree.read(riff_tree.find(&rgn, "wsmp"), wsmp);
+            dlsWlnk wlnk{}; riff_tree.read(riff_tree.find(&rgn, "wlnk"), wlnk);
+
+            // Skip zones that point to a sample that doesn't exist
+            if (wlnk.smpl_idx >= samples.size())
+                continue;
+
+            // Create a zone out of it based on the global zone
+            Zone zone = global_zone;
+            zone.key_range_low = static_cast<uint8_t>(rgnh.key_low);
+            zone.key_range_high = static_cast<uint8_t>(rgnh.key_high);
+            zone.vel_range_low = static_cast<uint8_t>(rgnh.vel_low);
+            zone.vel_range_high = static_cast<uint8_t>(rgnh.vel_high);
+            zone.sample_index = wlnk.smpl_idx;
+            zone.loop_enable = wsmp.loop_mode;
+
+            // If the zone has an articulator, apply it
+            if (RiffNode* art1 = riff_tree.find(riff_tree.find(&rgn, "lart"), "art1")) {
+                ChunkDataHandler data;
+                data.from_buffer(riff_tree.load(art1), art1->size);
+                handle_art1(data, zone, n_unknown_articulators);
+            }
+            if (RiffNode* art2 = riff_tree.find(riff_tree.find(&rgn, "lar2"), "art2")) {
+                ChunkDataHandler data;
+                data.from_buffer(riff_tree.load(art2), art2->size);
+                handle_art1(data, zone, n_unknown_articulators);
+            }
+
+            // Apply wsmp chunk
+            dlsWsmp sample_wsmp{};
+            riff_tree.read(riff_tree.find(riff_tree.child(wave_pool, wlnk.smpl_idx), "wsmp"), sample_wsmp);
+            zone.root_key_offset = static_cast<int>(sample_wsmp.root_key) - static_cast<int>(wsmp.root_key);
+            zone.sample_loop_start_offset = static_cast<int32_t>(wsmp.loop_start - samples[wlnk.smpl_idx].loop_start);
+            zone.sample_loop_end_offset = static_cast<int32_t>((wsmp.loop_start + wsmp.loop_length) - samples[wlnk.smpl_idx].loop_end);
+
+            // Add zone to preset
+            preset.zones.push_back(zone);
+        }
+
+        preset.build_zone_lookup();
+        return preset;
     }
 
-    void Soundfont::dls_get_samples(Flan::RiffTree& riff_tree)
+    bool Soundfont::dls_get_samples(Flan::RiffTree& riff_tree, const LoadSettings& settings, std::vector<u8>& low_bytes)
     {
+        const bool in_place = settings.memory_map;
+
         // Get ptbl chunk
+        RiffNode* pool_table = riff_tree.find(&riff_tree.root(), "ptbl");
+        RiffNode* wave_pool = riff_tree.find(&riff_tree.root(), "wvpl");
+        if (!pool_table || !wave_pool)
+            return true;
         Flan::ChunkDataHandler data;
-        data.from_buffer(riff_tree["ptbl"].data, riff_tree["ptbl"].size);
+        data.from_buffer(riff_tree.load(pool_table), pool_table->size);
 
         // Get ptbl header
         struct {
@@ -471,24 +988,39 @@ namespace Flan {
         } ptbl{};
         data.get_data(&ptbl, sizeof(ptbl));
 
-        // Get pool cues - each pool_table_offset points to a wave-list
+        // Get pool cues - each pool_table_offset points to a wave-list, relative to the start of the wave pool
         std::vector<u32> pool_table_offsets;
-        pool_table_offsets.resize(ptbl.n_cues);
-        data.get_data(pool_table_offsets.data(), ptbl.n_cues * sizeof(u32));
-
-        // Get wvpl chunk
-        data.from_buffer(riff_tree["wvpl"].data, riff_tree["wvpl"].size);
+        pool_table_offsets.resize(std::min<u64>(ptbl.n_cues, data.chunk_bytes_left / sizeof(u32)));
+        data.get_data(pool_table_offsets.data(), static_cast<u32>(pool_table_offsets.size() * sizeof(u32)));
+
+        // Find the wave list of a cue. They're usually in the same order as the cues, otherwise search for it, the waves are sorted by offset
+        const std::span<RiffNode> waves = riff_tree.children(wave_pool);
+        auto find_wave = [&](const size_t cue) -> RiffNode* {
+            const u64 offset = wave_pool->offset + pool_table_offsets[cue] + sizeof(RiffChunk);
+            if (cue < waves.size() && waves[cue].offset == offset)
+                return &waves[cue];
+            const auto wave = std::lower_bound(waves.begin(), waves.end(), offset, [](const RiffNode& node, const u64 value) { return node.offset < value; });
+            return (wave != waves.end() && wave->offset == offset) ? &*wave : nullptr;
+        };
 
         // Loop over each entry in the pool table
+        struct WaveData {
+            RiffNode* chunk = nullptr;
+            const u8* source = nullptr; // Where to decode the wave from, or nullptr if it's already in the pool or used in place
+            u64 pool_offset = 0;        // In samples
+            u16 bits_per_sample = 0;
+            u16 n_channels = 0;
+        };
         samples.resize(pool_table_offsets.size());
+        std::vector<WaveData> wave_data(pool_table_offsets.size());
+        u64 pool_frames = 0;
+        u64 staging_size = 0;
+        bool has_24_bit = false;
         for (size_t i = 0; i < pool_table_offsets.size(); i++) {
-            // Get wave chunk
-            RiffChunk wave;
-            memcpy_s(&wave, sizeof(wave), riff_tree["wvpl"].data + pool_table_offsets[i], sizeof(wave));
-
-            // Create a chunk handler for this for easy access - I'm too paranoid to assume everything is in order after reading the DLS spec
-            ChunkDataHandler wave_handler;
-            wave_handler.from_buffer(riff_tree["wvpl"].data + pool_table_offsets[i] + sizeof(RiffChunk), wave.size - 4);
+            // Get wave list, and skip cues that don't point to one
+            RiffNode* wave = find_wave(i);
+            if (!wave)
+                continue;
 
             // Here's the data we're hoping to collect from the pool cue
             struct {
@@ -506,159 +1038,244 @@ namespace Flan {
                 i32 attenuation = 0;
                 u32 options = 0; //ignored
                 u32 loop_mode = 0;
-            } wsmp;
-            struct {
                 u32 wsloop_size = 0; //should be 16
                 u32 loop_type = 0; // always forward loop
                 u32 loop_start = 0; // absolute offset in data chunk
                 u32 loop_length = 0;
-            } loop_hdr;
-            i16* sample_data = nullptr;
-            u32 sample_byte_length = 0;
+            } wsmp;
 
-            // Loop over each chunk
-            Chunk chunk;
-            while (chunk.from_chunk_data_handler(wave_handler)) {
-                if (chunk.id == "fmt ") {
-                    wave_handler.get_data(&fmt, sizeof(fmt));
-                    wave_handler.get_data(nullptr, chunk.size - sizeof(fmt)); // no idea why this is necessary but it is
-                }
-                else if (chunk.id == "wsmp") {
-                    wave_handler.get_data(&wsmp, sizeof(wsmp));
-                    if (wsmp.loop_mode == 1) {
-                        wave_handler.get_data(&loop_hdr, sizeof(loop_hdr));
-                    }
-                }
-                else if (chunk.id == "data") {
-                    sample_data = reinterpret_cast<int16_t*>(wave_handler.data_pointer);
-                    wave_handler.get_data(nullptr, chunk.size);
-                    sample_byte_length = chunk.size;
-                }
-                else {
-                    wave_handler.get_data(nullptr, chunk.size);
-                }
+            // Only PCM (or extensible PCM) waves of 8, 16 or 24 bits, in mono or stereo, can be decoded
+            riff_tree.read(riff_tree.find(wave, "fmt "), fmt);
+            const bool is_pcm = fmt.format_tag == 1 || fmt.format_tag == 0xFFFE;
+            if (!is_pcm || (fmt.bits_per_sample != 8 && fmt.bits_per_sample != 16 && fmt.bits_per_sample != 24) || (fmt.n_channels != 1 && fmt.n_channels != 2)) {
+                print("[WARNING] Wave %zu has an unsupported format (format tag %u, %u bits, %u channels), skipping it\n", i, fmt.format_tag, fmt.bits_per_sample, fmt.n_channels);
+                continue;
+            }
+
+            // The instruments read this wsmp chunk too, so keep it in memory
+            RiffNode* wsmp_chunk = riff_tree.find(wave, "wsmp");
+            riff_tree.load(wsmp_chunk);
+            riff_tree.read(wsmp_chunk, wsmp);
+            if (wsmp.loop_mode != 1) {
+                wsmp.loop_start = 0;
+                wsmp.loop_length = 0;
+            }
+
+            // Find the sample data. 16-bit mono waves are used as they are when memory mapped, every other wave gets a place in the pool
+            WaveData& data = wave_data[i];
+            data.chunk = riff_tree.find(wave, "data");
+            if (!data.chunk)
+                continue;
+            data.bits_per_sample = fmt.bits_per_sample;
+            data.n_channels = fmt.n_channels;
+            const u32 frame_size = fmt.bits_per_sample / 8 * fmt.n_channels;
+            const u32 length = data.chunk->size / frame_size;
+            const bool needs_decoding = fmt.bits_per_sample != 16 || fmt.n_channels != 1;
+            if (!in_place || needs_decoding) {
+                data.pool_offset = pool_frames;
+                pool_frames += length;
             }
+            if (!in_place && needs_decoding)
+                staging_size += data.chunk->size;
+            has_24_bit |= fmt.bits_per_sample == 24;
 
             // Assemble a sample from this
             samples[i] = {
-                sample_data,
-                sample_data,
+                nullptr,
+                nullptr,
                 static_cast<float>(fmt.sample_rate) * exp2f(((60.f - static_cast<float>(wsmp.root_key)) / 12.f) + (static_cast<float>(wsmp.fine_tune) / 1200.f)),
-                sample_byte_length * fmt.sample_rate / fmt.byte_rate,
-                loop_hdr.loop_start,
-                loop_hdr.loop_start + loop_hdr.loop_length,
-                monoSample
+                length,
+                wsmp.loop_start,
+                wsmp.loop_start + wsmp.loop_length,
+                monoSample,
+                nullptr,
+                length,
             };
         }
+
+        // Allocate the pool. When memory mapped, the pool only has the waves that need decoding
+        i16* pool = nullptr;
+        if (in_place) {
+            _decoded_sample_data.resize(pool_frames);
+            pool = _decoded_sample_data.data();
+        }
+        else {
+            _sample_data = static_cast<i16*>(counted_malloc(std::max<u64>(pool_frames, 1) * sizeof(i16)));
+            if (!_sample_data)
+                return false;
+            pool = _sample_data;
+        }
+
+        // The lower 8 bits of 24-bit waves are only kept for converting to float, like the sm24 chunk of SF2 files. They're indexed the same as the pool
+        if (settings.float_samples && has_24_bit)
+            low_bytes.assign(pool_frames, 0);
+
+        // Read the sample data in the order of the wave pool. 16-bit mono waves are read straight into the pool, the rest is read into a
+        // staging buffer first, so they can be decoded on multiple threads afterwards
+        std::vector<u8> staging(staging_size);
+        u64 staging_offset = 0;
+        for (size_t i = 0; i < samples.size(); i++) {
+            WaveData& data = wave_data[i];
+            if (!data.chunk)
+                continue;
+            const bool needs_decoding = data.bits_per_sample != 16 || data.n_channels != 1;
+            if (in_place) {
+                if (needs_decoding)
+                    data.source = data.chunk->data;
+            }
+            else if (needs_decoding) {
+                riff_tree.copy(data.chunk, staging.data() + staging_offset, data.chunk->size);
+                data.source = staging.data() + staging_offset;
+                staging_offset += data.chunk->size;
+            }
+            else {
+                riff_tree.copy(data.chunk, pool + data.pool_offset, static_cast<u64>(samples[i].length) * sizeof(i16));
+            }
+        }
+
+        // Decode the waves, split into ranges of the same size so one long wave doesn't end up on a single thread
+        constexpr u32 range_frames = 65536;
+        struct Range {
+            u32 wave;
+            u32 first_frame;
+        };
+        std::vector<Range> ranges;
+        for (size_t i = 0; i < samples.size(); i++) {
+            if (!wave_data[i].source) continue;
+            for (u32 frame = 0; frame < samples[i].length; frame += range_frames)
+                ranges.push_back({ static_cast<u32>(i), frame });
+        }
+        parallel_for(ranges.size(), settings.n_threads, [&](const size_t range_index) {
+            const Range& range = ranges[range_index];
+            const WaveData& data = wave_data[range.wave];
+            const u64 n_frames = std::min<u64>(range_frames, samples[range.wave].length - range.first_frame);
+            const u64 frame_size = data.bits_per_sample / 8 * data.n_channels;
+            const u64 destination = data.pool_offset + range.first_frame;
+            decode_pcm(data.source + range.first_frame * frame_size, pool + destination, low_bytes.empty() ? nullptr : low_bytes.data() + destination, n_frames, data.bits_per_sample, data.n_channels);
+        });
+
+        // Point the samples to their data
+        for (size_t i = 0; i < samples.size(); i++) {
+            const WaveData& data = wave_data[i];
+            if (!data.chunk)
+                continue;
+            i16* sample_data = (in_place && !data.source) ? reinterpret_cast<i16*>(data.chunk->data) : pool + data.pool_offset;
+            samples[i].data = sample_data;
+            samples[i].linked = sample_data;
+            samples[i].loop_data = sample_data + samples[i].loop_start;
+        }
+        return true;
     }
     
-    void Soundfont::handle_art1(Flan::ChunkDataHandler& dls_file, Zone& zone) const
+    // A DLS connection block that maps to one of the fields in Zone, and how to set that field from the block's scale
+    struct ArticulatorHandler {
+        u64 key;
+        void (*apply)(Zone& zone, i32 scale);
+    };
+
+    // The transform isn't part of the key, it only shapes the source curve (and holds the invert and bipolar flags in art2), which the
+    // fields in Zone don't have a use for
+    static constexpr u64 articulator_key(const u16 source, const u16 control, const u16 destination) {
+        return static_cast<u64>(source) << 32 | static_cast<u64>(control) << 16 | destination;
+    }
+
+    // Sorted by key, so a block's handler can be binary searched
+    static constexpr ArticulatorHandler articulator_handlers[] = {
+        // Panning
+        { articulator_key(CONN_SRC_NONE, CONN_SRC_NONE, CONN_DST_PAN), [](Zone& zone, const i32 scale) { zone.pan = fixed32_to_float(scale) / 1000.0; } },
+        // LFO
+        { articulator_key(CONN_SRC_NONE, CONN_SRC_NONE, CONN_DST_LFO_FREQUENCY), [](Zone& zone, const i32 scale) { zone.mod_lfo.freq = freq32_to_hz(scale); } },
+        { articulator_key(CONN_SRC_NONE, CONN_SRC_NONE, CONN_DST_LFO_STARTDELAY), [](Zone& zone, const i32 scale) { zone.mod_lfo.delay = tc32_to_seconds(scale); } },
+        // Envelope 1 (volume), 96 for decay and release, since the inferred EG1 attenuation is 96 dB
+        { articulator_key(CONN_SRC_NONE, CONN_SRC_NONE, CONN_DST_EG1_ATTACKTIME), [](Zone& zone, const i32 scale) { zone.vol_env.attack = 1.0 / tc32_to_seconds(scale); } },
+        { articulator_key(CONN_SRC_NONE, CONN_SRC_NONE, CONN_DST_EG1_DECAYTIME), [](Zone& zone, const i32 scale) { zone.vol_env.decay = 96.0 / tc32_to_seconds(scale); } },
+        { articulator_key(CONN_SRC_NONE, CONN_SRC_NONE, CONN_DST_EG1_RELEASETIME), [](Zone& zone, const i32 scale) { zone.vol_env.release = 96.0 / tc32_to_seconds(scale); } },
+        { articulator_key(CONN_SRC_NONE, CONN_SRC_NONE, CONN_DST_EG1_SUSTAINLEVEL), [](Zone& zone, const i32 scale) { zone.vol_env.sustain = std::max(-100.0, 6.0 * log2(fixed32_to_float(scale) / 1000.0)); } },
+        { articulator_key(CONN_SRC_NONE, CONN_SRC_NONE, CONN_DST_EG1_DELAYTIME), [](Zone& zone, const i32 scale) { zone.vol_env.delay = 1.0 / tc32_to_seconds(scale); } },
+        { articulator_key(CONN_SRC_NONE, CONN_SRC_NONE, CONN_DST_EG1_HOLDTIME), [](Zone& zone, const i32 scale) { zone.vol_env.hold = 1.0 / tc32_to_seconds(scale); } },
+        // Envelope 2 (modulator)
+        { articulator_key(CONN_SRC_NONE, CONN_SRC_NONE, CONN_DST_EG2_ATTACKTIME), [](Zone& zone, const i32 scale) { zone.mod_env.attack = 1.0 / tc32_to_seconds(scale); } },
+        { articulator_key(CONN_SRC_NONE, CONN_SRC_NONE, CONN_DST_EG2_DECAYTIME), [](Zone& zone, const i32 scale) { zone.mod_env.decay = 96.0 / tc32_to_seconds(scale); } },
+        { articulator_key(CONN_SRC_NONE, CONN_SRC_NONE, CONN_DST_EG2_RELEASETIME), [](Zone& zone, const i32 scale) { zone.mod_env.release = 96.0 / tc32_to_seconds(scale); } },
+        { articulator_key(CONN_SRC_NONE, CONN_SRC_NONE, CONN_DST_EG2_SUSTAINLEVEL), [](Zone& zone, const i32 scale) { zone.mod_env.sustain = std::max(-100.0, 6.0 * log2(fixed32_to_float(scale) / 1000.0)); } },
+        { articulator_key(CONN_SRC_NONE, CONN_SRC_NONE, CONN_DST_EG2_DELAYTIME), [](Zone& zone, const i32 scale) { zone.mod_env.delay = 1.0 / tc32_to_seconds(scale); } },
+        { articulator_key(CONN_SRC_NONE, CONN_SRC_NONE, CONN_DST_EG2_HOLDTIME), [](Zone& zone, const i32 scale) { zone.mod_env.hold = 1.0 / tc32_to_seconds(scale); } },
+        // LFO attenuation and pitch scale
+        { articulator_key(CONN_SRC_LFO, CONN_SRC_NONE, CONN_DST_GAIN), [](Zone& zone, const i32 scale) { zone.mod_lfo_to_volume = fixed32_to_float(scale) / 10.0; } },
+        { articulator_key(CONN_SRC_LFO, CONN_SRC_NONE, CONN_DST_PITCH), [](Zone& zone, const i32 scale) { zone.mod_lfo_to_pitch = fixed32_to_float(scale); } },
+        // Key number to volume decay (65536 for fixed16.16, 128 for number of keys)
+        { articulator_key(CONN_SRC_KEYNUMBER, CONN_SRC_NONE, CONN_DST_EG1_DECAYTIME), [](Zone& zone, const i32 scale) { zone.key_to_vol_env_decay = -static_cast<double>(scale) / 65536.0 / 128.0; } },
+        // Envelope 2 pitch scale
+        { articulator_key(CONN_SRC_EG2, CONN_SRC_NONE, CONN_DST_PITCH), [](Zone& zone, const i32 scale) { zone.mod_env_to_pitch = tc32_to_cents(scale); } },
+    };
+    static_assert(std::is_sorted(std::begin(articulator_handlers), std::end(articulator_handlers), [](const ArticulatorHandler& lhs, const ArticulatorHandler& rhs) { return lhs.key < rhs.key; }),
+        "articulator_handlers has to be sorted by key");
+
+    // Convert a connection block's scale to the unit of the Zone fields with the same destination, for ZoneModulator::amount
+    static f32 modulator_amount(const u16 destination, const i32 scale) {
+        switch (destination) {
+        case CONN_DST_GAIN: return static_cast<f32>(fixed32_to_float(scale) / 10.0);  // dB
+        case CONN_DST_PAN: return static_cast<f32>(fixed32_to_float(scale) / 1000.0); // -1.0 to 1.0
+        case CONN_DST_EG1_SUSTAINLEVEL:
+        case CONN_DST_EG2_SUSTAINLEVEL: return static_cast<f32>(fixed32_to_float(scale) / 1000.0); // Fraction of the peak level, the scale is in 0.1%
+        default: return static_cast<f32>(fixed32_to_float(scale));                    // Cents for pitch and filter cutoff, time cents for envelope times
+        }
+    }
+
+    void Soundfont::handle_art1(Flan::ChunkDataHandler& dls_file, Zone& zone, u64& n_unknown_articulators) const
     {
         // Get number of connection blocks
-        u32 cb_size;
-        u32 n_connection_blocks;
+        u32 cb_size = 0;
+        u32 n_connection_blocks = 0;
         dls_file.get_data(&cb_size, sizeof(u32));
         dls_file.get_data(&n_connection_blocks, sizeof(u32));
 
-        // Loop over all the connection blocks
+        // Loop over all the connection blocks that are actually in the chunk
+        struct {
+            dlsArtSrc source;
+            dlsArtSrc control;
+            dlsArtDst destination;
+            dlsArtTrn transform;
+            i32 scale;
+        } block{};
+        n_connection_blocks = std::min<u32>(n_connection_blocks, dls_file.chunk_bytes_left / sizeof(block));
         for (size_t cb_idx = 0; cb_idx < n_connection_blocks; cb_idx++) {
-            struct {
-                dlsArtSrc source;
-                dlsArtSrc control;
-                dlsArtDst destination;
-                dlsArtTrn transform;
-                i32 scale;
-            } block{};
             dls_file.get_data(&block, sizeof(block));
 
-            //LFO Section
-            if (block.source == CONN_SRC_NONE       && block.control == CONN_SRC_NONE   && block.destination == CONN_DST_LFO_FREQUENCY) { // LFO frequency
-                zone.mod_lfo.freq = freq32_to_hz(block.scale);
-            }
-            else if (block.source == CONN_SRC_NONE  && block.control == CONN_SRC_NONE   && block.destination == CONN_DST_LFO_STARTDELAY) { // LFO start delay
-                zone.mod_lfo.delay = tc32_to_seconds(block.scale);
-            }
-            else if (block.source == CONN_SRC_LFO   && block.control == CONN_SRC_NONE   && block.destination == CONN_DST_GAIN) { // LFO attenuation scale
-                zone.mod_lfo_to_volume = fixed32_to_float(block.scale) / 10.0;
-            }
-            else if (block.source == CONN_SRC_LFO   && block.control == CONN_SRC_NONE   && block.destination == CONN_DST_PITCH) { // LFO pitch scale
-                zone.mod_lfo_to_pitch = fixed32_to_float(block.scale);
-            }
-            /*else if (block.source == CONN_SRC_LFO && block.control == CONN_SRC_CC1 && block.destination == CONN_DST_ATTENUATION) { // LFO attenuation scale
-                zone.mod_lfo_to_volume = fixed32_to_float(block.scale) / 10.f;
-            }
-            else if (block.source == CONN_SRC_LFO   && block.control == CONN_SRC_CC1    && block.destination == CONN_DST_PITCH) { // LFO pitch scale
-                zone.mod_lfo_to_volume = fixed32_to_float(block.scale);
-            }*/ // not sure what to do with these
-            // Envelope 1 (volume)
-            else if (block.source == CONN_SRC_NONE && block.control == CONN_SRC_NONE && block.destination == CONN_DST_EG1_DELAYTIME) { // Vol delay
-                zone.vol_env.delay = 1.0 / tc32_to_seconds(block.scale);
-            }
-            else if (block.source == CONN_SRC_NONE && block.control == CONN_SRC_NONE && block.destination == CONN_DST_EG1_ATTACKTIME) { // Vol attack
-                zone.vol_env.attack = 1.0 / tc32_to_seconds(block.scale);
-            }
-            else if (block.source == CONN_SRC_NONE && block.control == CONN_SRC_NONE && block.destination == CONN_DST_EG1_HOLDTIME) { // Vol hold
-                zone.vol_env.hold = 1.0 / tc32_to_seconds(block.scale);
-            }
-            else if (block.source == CONN_SRC_NONE && block.control == CONN_SRC_NONE && block.destination == CONN_DST_EG1_DECAYTIME) { // Vol decay
-                zone.vol_env.decay = 96.0 / tc32_to_seconds(block.scale); // 96, since the inferred EG1 attenuation is 96 dB
-            }
-            else if (block.source == CONN_SRC_NONE && block.control == CONN_SRC_NONE && block.destination == CONN_DST_EG1_SUSTAINLEVEL) { // Vol sustain
-                zone.vol_env.sustain = std::max(-100.0, 6.0 * log2(fixed32_to_float(block.scale) / 1000.0));
-            }
-            else if (block.source == CONN_SRC_NONE && block.control == CONN_SRC_NONE && block.destination == CONN_DST_EG1_RELEASETIME) { // Vol release
-                zone.vol_env.release = 96.0 / tc32_to_seconds(block.scale);
-            }
-            /*else if (block.source == CONN_SRC_KEYONVELOCITY && block.control == CONN_SRC_NONE && block.destination == CONN_DST_EG1_ATTACKTIME) { // Vol attack
-                zone.vol_env.attack = 1.0f / tc32_to_seconds(block.scale);
-            }*/ // no equivalent in sf2 i think
-            else if (block.source == CONN_SRC_KEYNUMBER && block.control == CONN_SRC_NONE && block.destination == CONN_DST_EG1_DECAYTIME) { // Vol decay
-                zone.key_to_vol_env_decay = -static_cast<double>(block.scale) / 65536.0 / 128.0; // (65536 for fixed16.16, 128 for number of keys); 
-            }
-            // Envelope 2 (modulator)
-            else if (block.source == CONN_SRC_NONE && block.control == CONN_SRC_NONE && block.destination == CONN_DST_EG2_DELAYTIME) { // Mod delay
-                zone.mod_env.delay = 1.0 / tc32_to_seconds(block.scale);
-            }
-            else if (block.source == CONN_SRC_NONE && block.control == CONN_SRC_NONE && block.destination == CONN_DST_EG2_ATTACKTIME) { // Mod attack
-                zone.mod_env.attack = 1.0 / tc32_to_seconds(block.scale);
-            }
-            else if (block.source == CONN_SRC_NONE && block.control == CONN_SRC_NONE && block.destination == CONN_DST_EG2_HOLDTIME) { // Mod Hold
-                zone.mod_env.hold = 1.0 / tc32_to_seconds(block.scale);
-            }
-            else if (block.source == CONN_SRC_NONE && block.control == CONN_SRC_NONE && block.destination == CONN_DST_EG2_DECAYTIME) { // Mod decay
-                zone.mod_env.decay = 96.0 / tc32_to_seconds(block.scale); // 96, since the inferred EG1 attenuation is 96 dB
-            }
-            else if (block.source == CONN_SRC_NONE && block.control == CONN_SRC_NONE && block.destination == CONN_DST_EG2_SUSTAINLEVEL) { // Mod sustain
-                zone.mod_env.sustain = std::max(-100.0, 6.0 * log2(fixed32_to_float(block.scale) / 1000.0));
-            }
-            else if (block.source == CONN_SRC_NONE && block.control == CONN_SRC_NONE && block.destination == CONN_DST_EG2_RELEASETIME) { // Mod release
-                zone.mod_env.release = 96.0 / tc32_to_seconds(block.scale);
-            }
-            /*else if (block.source == CONN_SRC_KEYONVELOCITY && block.control == CONN_SRC_NONE && block.destination == CONN_DST_EG2_ATTACKTIME) { // Mod attack
-                zone.vol_env.attack = 1.0f / tc32_to_seconds(block.scale);
-            }*/ // no equivalent in sf2 i think
-            else if (block.source == CONN_SRC_EG2 && block.control == CONN_SRC_NONE && block.destination == CONN_DST_PITCH) { // Mod decay
-                zone.mod_env_to_pitch = tc32_to_cents(block.scale); // 96, since the inferred EG1 attenuation is 96 dB
-            }
-            else if (block.source == CONN_SRC_NONE && block.control == CONN_SRC_NONE && block.destination == CONN_DST_PAN) { // Panning
-                zone.pan = fixed32_to_float(block.scale) / 1000.0;
-                if (block.scale != 0) {
-                    printf("yeet");
-                }
+            // Blocks that map to a field in the zone
+            const u64 key = articulator_key(block.source, block.control, block.destination);
+            const auto handler = std::lower_bound(std::begin(articulator_handlers), std::end(articulator_handlers), key, [](const ArticulatorHandler& entry, const u64 value) { return entry.key < value; });
+            if (handler != std::end(articulator_handlers) && handler->key == key) {
+                handler->apply(zone, block.scale);
+                continue;
             }
-            else {
-                printf("unknown articulator found!\n");
+
+            // Other blocks with a source, like key velocity or MIDI controllers, are kept as modulators. A block with the same source,
+            // control, destination and transform as one from the instrument's global articulation replaces it
+            if ((block.source == CONN_SRC_NONE && block.control == CONN_SRC_NONE) || block.destination == CONN_DST_NONE) {
+                n_unknown_articulators++;
+                continue;
             }
+            const ZoneModulator modulator{ block.source, block.control, block.destination, block.transform, modulator_amount(block.destination, block.scale) };
+            ZoneModulator* existing = std::find_if(zone.modulators, zone.modulators + zone.n_modulators, [&](const ZoneModulator& other) {
+                return other.source == modulator.source && other.control == modulator.control && other.destination == modulator.destination && other.transform == modulator.transform;
+            });
+            if (existing != zone.modulators + zone.n_modulators)
+                *existing = modulator;
+            else if (zone.n_modulators < max_zone_modulators)
+                zone.modulators[zone.n_modulators++] = modulator;
+            else
+                n_unknown_articulators++;
         }
 
         // Correct decay based on key vol env decay
         zone.vol_env.decay *= pow(2, zone.key_to_vol_env_decay * 60 / 1200);
     }
 
-    Preset Soundfont::get_sf2_preset_from_index(size_t index, RawSoundfontData& raw_sf) {
+    Preset Soundfont::get_sf2_preset_from_index(size_t index, const RawSoundfontData& raw_sf, u64& n_unknown_generators) const {
         // Prepare misc variables
-        std::map<std::string, GenAmountType> preset_global_generator_values;
-        std::map<std::string, GenAmountType> instrument_global_generator_values;
+        GeneratorValues preset_global_generator_values;
+        GeneratorValues instrument_global_generator_values;
         Preset final_preset;
         final_preset.name = raw_sf.preset_headers[index].preset_name;
 
@@ -668,30 +1285,23 @@ namespace Flan {
 
         // Loop over all preset zones
         for (uint16_t preset_zone_index = preset_zone_start; preset_zone_index < zone_end; preset_zone_index++) {
-            // Prepare loop variables
-            std::map<std::string, GenAmountType> preset_zone_generator_values;
-            uint16_t generator_start = raw_sf.preset_bags[preset_zone_index].generator_index;
-            uint16_t generator_end = raw_sf.preset_bags[preset_zone_index + 1].generator_index;
-
-            // Loop over all preset zone's generator values
-            for (uint16_t generator_index = generator_start; generator_index < generator_end; generator_index++) {
-                // Get name and value
-                std::string oper_name = SFGenerator_names[raw_sf.preset_gens[generator_index].oper];
-                GenAmountType oper_value = raw_sf.preset_gens[generator_index].amount;
-
-                // Insert into zone map
-                preset_zone_generator_values[oper_name] = oper_value;
-            }
+            // Get all of this preset zone's generator values
+            GeneratorValues preset_zone_generator_values;
+            n_unknown_generators += read_zone_generators(raw_sf.preset_gens, raw_sf.preset_bags[preset_zone_index].generator_index, raw_sf.preset_bags[preset_zone_index + 1].generator_index, preset_zone_generator_values);
 
             // Does the instrument ID exist?
-            if (!preset_zone_generator_values.contains("instrument")) {
+            if (!preset_zone_generator_values.is_set(instrument)) {
                 // If not, this is the global preset zone, save it and go to next preset zone
                 preset_global_generator_values = preset_zone_generator_values;
                 continue;
             }
 
+            // Apply current preset zone on top of the global preset zone
+            GeneratorValues preset_generator_values = preset_global_generator_values;
+            preset_generator_values.override_with(preset_zone_generator_values);
+
             // Get instrument ID
-            uint16_t instrument_id = preset_zone_generator_values["instrument"].u_amount;
+            uint16_t instrument_id = preset_zone_generator_values[instrument].u_amount;
 
             // Get instrument zones
             uint16_t instrument_start = raw_sf.instruments[instrument_id].bag_index;
@@ -699,158 +1309,206 @@ namespace Flan {
 
             // Loop over all instrument zones
             for (uint16_t instrument_index = instrument_start; instrument_index < instrument_end; instrument_index++) {
-                // Prepare instrument zone
-                std::map<std::string, GenAmountType> instrument_zone_generator_values;
-                uint16_t instrument_gen_start = raw_sf.instr_bags[instrument_index].generator_index;
-                uint16_t instrument_gen_end = raw_sf.instr_bags[instrument_index + 1].generator_index;
-
-                // Loop over all instrument zone's values
-                for (uint16_t instrument_gen_index = instrument_gen_start; instrument_gen_index < instrument_gen_end; instrument_gen_index++) {
-                    // Get name and value
-                    std::string oper_name = SFGenerator_names[raw_sf.instr_gens[instrument_gen_index].oper];
-                    GenAmountType oper_value = raw_sf.instr_gens[instrument_gen_index].amount;
-                    instrument_zone_generator_values[oper_name] = oper_value;
-                }
+                // Get all of this instrument zone's generator values
+                GeneratorValues instrument_zone_generator_values;
+                n_unknown_generators += read_zone_generators(raw_sf.instr_gens, raw_sf.instr_bags[instrument_index].generator_index, raw_sf.instr_bags[instrument_index + 1].generator_index, instrument_zone_generator_values);
 
                 // Does the instrument ID exist?
-                if (!instrument_zone_generator_values.contains("sampleID")) {
+                if (!instrument_zone_generator_values.is_set(sampleID)) {
                     // If not, this is the global preset zone, save it and go to next preset zone
                     instrument_global_generator_values = instrument_zone_generator_values;
                     continue;
                 }
 
-                // Create final zone from default zones
-                std::map<std::string, GenAmountType> final_zone_generator_values;
-                init_default_zone(final_zone_generator_values);
+                // Create final zone from default zone, then apply the global and current instrument zone
+                GeneratorValues final_zone_generator_values = default_zone;
+                final_zone_generator_values.override_with(instrument_global_generator_values);
+                final_zone_generator_values.override_with(instrument_zone_generator_values);
 
-                // Apply global instrument zone to final zone
-                for (auto& entry : instrument_global_generator_values) {
-                    final_zone_generator_values[entry.first] = entry.second;
+                // Apply preset zone
+                for (u64 mask = preset_generator_values.set_mask & preset_gen_add_mask; mask != 0; mask &= mask - 1) {
+                    const int gen = std::countr_zero(mask);
+                    final_zone_generator_values.values[gen].s_amount += preset_generator_values.values[gen].s_amount;
                 }
-
-                // Apply current instrument zone to final zone
-                for (auto& entry : instrument_zone_generator_values) {
-                    final_zone_generator_values[entry.first] = entry.second;
+                for (u64 mask = preset_generator_values.set_mask & preset_gen_clamp_mask; mask != 0; mask &= mask - 1) {
+                    const int gen = std::countr_zero(mask);
+                    RangesType& range = final_zone_generator_values.values[gen].ranges;
+                    range.low = std::max(preset_generator_values.values[gen].ranges.low, range.low);
+                    range.high = std::min(preset_generator_values.values[gen].ranges.high, range.high);
                 }
 
-                // Apply global preset zone to current preset zone
-                for (auto& entry : preset_global_generator_values) {
-                    if (!preset_zone_generator_values.contains(entry.first)) {
-                        preset_zone_generator_values[entry.first] = entry.second;
-                    }
-                }
-
-                // Apply current preset zone
-                for (auto& entry : preset_zone_generator_values) {
-                    // Get index in flag array from the string
-                    int index2 = -1;
-                    while (SFGenerator_names[++index2] != entry.first) {}
-                    assert(index2 >= 0 && index2 < 59);
-
-                    // Get flags
-                    GenFlags flags = gen_flags[index2];
-                    if (flags.instr_only) continue;
-                    switch (flags.apply_mode)
-                    {
-                    case add:
-                        final_zone_generator_values[entry.first].s_amount += entry.second.s_amount;
-                        break;
-                    case clamp_range:
-                        final_zone_generator_values[entry.first].ranges.low = std::max(entry.second.ranges.low, final_zone_generator_values[entry.first].ranges.low);
-                        final_zone_generator_values[entry.first].ranges.high = std::min(entry.second.ranges.high, final_zone_generator_values[entry.first].ranges.high);
-                        break;
-                    default:
-                        break;
-                    }
-                }
-
-                if (final_zone_generator_values["overridingRootKey"].s_amount == -1)
+                if (final_zone_generator_values[overridingRootKey].s_amount == -1)
                 {
-                    final_zone_generator_values["overridingRootKey"].s_amount = raw_sf.sample_headers[final_zone_generator_values["sampleID"].u_amount].original_key;
+                    final_zone_generator_values[overridingRootKey].s_amount = raw_sf.sample_headers[final_zone_generator_values[sampleID].u_amount].original_key;
                 }
 
                 // Parse zone to custom zone format
                 Zone new_zone_to_add {
-                    final_zone_generator_values["keyRange"].ranges.low,
-                    final_zone_generator_values["keyRange"].ranges.high,
-                    final_zone_generator_values["velRange"].ranges.low,
-                    final_zone_generator_values["velRange"].ranges.high,
-                    final_zone_generator_values["sampleID"].u_amount,
-                    final_zone_generator_values["startAddrsOffset"].s_amount + final_zone_generator_values["startAddrsCoarseOffset"].s_amount * 32768,
-                    final_zone_generator_values["endAddrsOffset"].s_amount + final_zone_generator_values["startAddrsCoarseOffset"].s_amount * 32768,
-                    final_zone_generator_values["startloopAddrsOffset"].s_amount + final_zone_generator_values["startAddrsCoarseOffset"].s_amount * 32768,
-                    final_zone_generator_values["endloopAddrsOffset"].s_amount + final_zone_generator_values["startAddrsCoarseOffset"].s_amount * 32768,
-                    raw_sf.sample_headers[final_zone_generator_values["sampleID"].u_amount].original_key - final_zone_generator_values["overridingRootKey"].s_amount,
-                    final_zone_generator_values["sampleModes"].u_amount % 2 == 1,
-                    static_cast<u8>(final_zone_generator_values["keynum"].u_amount),
-                    static_cast<u8>(final_zone_generator_values["velocity"].u_amount),
-                    static_cast<double>(final_zone_generator_values["pan"].s_amount) / 500.0,
+                    final_zone_generator_values[keyRange].ranges.low,
+                    final_zone_generator_values[keyRange].ranges.high,
+                    final_zone_generator_values[velRange].ranges.low,
+                    final_zone_generator_values[velRange].ranges.high,
+                    final_zone_generator_values[sampleID].u_amount,
+                    final_zone_generator_values[startAddrsOffset].s_amount + final_zone_generator_values[startAddrsCoarseOffset].s_amount * 32768,
+                    final_zone_generator_values[endAddrsOffset].s_amount + final_zone_generator_values[startAddrsCoarseOffset].s_amount * 32768,
+                    final_zone_generator_values[startloopAddrsOffset].s_amount + final_zone_generator_values[startAddrsCoarseOffset].s_amount * 32768,
+                    final_zone_generator_values[endloopAddrsOffset].s_amount + final_zone_generator_values[startAddrsCoarseOffset].s_amount * 32768,
+                    raw_sf.sample_headers[final_zone_generator_values[sampleID].u_amount].original_key - final_zone_generator_values[overridingRootKey].s_amount,
+                    final_zone_generator_values[sampleModes].u_amount % 2 == 1,
+                    static_cast<u8>(final_zone_generator_values[keynum].u_amount),
+                    static_cast<u8>(final_zone_generator_values[velocity].u_amount),
+                    static_cast<double>(final_zone_generator_values[pan].s_amount) / 500.0,
                     EnvParams {
-                        1.0 / pow(2.0, static_cast<double>(final_zone_generator_values["delayVolEnv"].s_amount) / 1200.0),
-                        1.0 / pow(2.0, static_cast<double>(final_zone_generator_values["attackVolEnv"].s_amount) / 1200.0),
-                        1.0 / pow(2.0, static_cast<double>(final_zone_generator_values["holdVolEnv"].s_amount) / 1200.0),
-                        100.0 / pow(2.0, static_cast<double>(final_zone_generator_values["decayVolEnv"].s_amount) / 1200.0),
-                        0.0 - static_cast<double>(final_zone_generator_values["sustainVolEnv"].u_amount) / 10.0,
-                        100.0 / pow(2.0, static_cast<double>(final_zone_generator_values["releaseVolEnv"].s_amount) / 1200.0),
+                        1.0 / pow(2.0, static_cast<double>(final_zone_generator_values[delayVolEnv].s_amount) / 1200.0),
+                        1.0 / pow(2.0, static_cast<double>(final_zone_generator_values[attackVolEnv].s_amount) / 1200.0),
+                        1.0 / pow(2.0, static_cast<double>(final_zone_generator_values[holdVolEnv].s_amount) / 1200.0),
+                        100.0 / pow(2.0, static_cast<double>(final_zone_generator_values[decayVolEnv].s_amount) / 1200.0),
+                        0.0 - static_cast<double>(final_zone_generator_values[sustainVolEnv].u_amount) / 10.0,
+                        100.0 / pow(2.0, static_cast<double>(final_zone_generator_values[releaseVolEnv].s_amount) / 1200.0),
                     },
                     EnvParams {
-                        1.0 / pow(2.0, static_cast<double>(final_zone_generator_values["delayModEnv"].s_amount) / 1200.0),
-                        1.0 / pow(2.0, static_cast<double>(final_zone_generator_values["attackModEnv"].s_amount) / 1200.0),
-                        1.0 / pow(2.0, static_cast<double>(final_zone_generator_values["holdModEnv"].s_amount) / 1200.0),
-                        100.0 / pow(2.0, static_cast<double>(final_zone_generator_values["decayModEnv"].s_amount) / 1200.0),
-                        0.0 - static_cast<double>(final_zone_generator_values["sustainModEnv"].u_amount) / 10.0,
-                        100.0 / pow(2.0, static_cast<double>(final_zone_generator_values["releaseModEnv"].s_amount) / 1200.0),
+                        1.0 / pow(2.0, static_cast<double>(final_zone_generator_values[delayModEnv].s_amount) / 1200.0),
+                        1.0 / pow(2.0, static_cast<double>(final_zone_generator_values[attackModEnv].s_amount) / 1200.0),
+                        1.0 / pow(2.0, static_cast<double>(final_zone_generator_values[holdModEnv].s_amount) / 1200.0),
+                        100.0 / pow(2.0, static_cast<double>(final_zone_generator_values[decayModEnv].s_amount) / 1200.0),
+                        0.0 - static_cast<double>(final_zone_generator_values[sustainModEnv].u_amount) / 10.0,
+                        100.0 / pow(2.0, static_cast<double>(final_zone_generator_values[releaseModEnv].s_amount) / 1200.0),
                     },
                     LfoParams{
                         //freq, intensity, delay
-                        8.176 * pow(2.0, static_cast<double>(final_zone_generator_values["freqVibLFO"].s_amount) / 1200.0),
-                        pow(2.0, static_cast<double>(final_zone_generator_values["delayVibLFO"].s_amount) / 1200.0),
+                        8.176 * pow(2.0, static_cast<double>(final_zone_generator_values[freqVibLFO].s_amount) / 1200.0),
+                        pow(2.0, static_cast<double>(final_zone_generator_values[delayVibLFO].s_amount) / 1200.0),
                     },
                     LfoParams{
                         //freq, intensity, delay
-                        8.176 * pow(2.0, static_cast<double>(final_zone_generator_values["freqModLFO"].s_amount) / 1200.0),
-                        pow(2.0, static_cast<double>(final_zone_generator_values["delayModLFO"].s_amount) / 1200.0),
+                        8.176 * pow(2.0, static_cast<double>(final_zone_generator_values[freqModLFO].s_amount) / 1200.0),
+                        pow(2.0, static_cast<double>(final_zone_generator_values[delayModLFO].s_amount) / 1200.0),
                     },
                     LowPassFilter{
-                        8.176f * powf(2.0f, static_cast<float>(final_zone_generator_values["initialFilterFc"].s_amount) / 1200.0f),
-                        powf(2, static_cast<float>(final_zone_generator_values["initialFilterQ"].s_amount) / 150.0f),
+                        8.176f * powf(2.0f, static_cast<float>(final_zone_generator_values[initialFilterFc].s_amount) / 1200.0f),
+                        powf(2, static_cast<float>(final_zone_generator_values[initialFilterQ].s_amount) / 150.0f),
                     },
-                    static_cast<double>(final_zone_generator_values["modEnvToPitch"].s_amount),
-                    static_cast<double>(final_zone_generator_values["modEnvToFilterFc"].s_amount),
-                    static_cast<double>(final_zone_generator_values["modLfoToPitch"].s_amount),
-                    static_cast<double>(final_zone_generator_values["modLfoToFilterFc"].s_amount),
-                    static_cast<double>(final_zone_generator_values["modLfoToVolume"].s_amount) / 10.0,
-                    static_cast<double>(final_zone_generator_values["vibLfoToPitch"].s_amount),
-                    static_cast<double>(final_zone_generator_values["keynumToVolEnvHold"].s_amount),
-                    static_cast<double>(final_zone_generator_values["keynumToVolEnvDecay"].s_amount),
-                    static_cast<double>(final_zone_generator_values["keynumToModEnvHold"].s_amount),
-                    static_cast<double>(final_zone_generator_values["keynumToModEnvDecay"].s_amount),
-                    static_cast<double>(final_zone_generator_values["scaleTuning"].s_amount) / 100.0,
-                    static_cast<double>(final_zone_generator_values["coarseTune"].s_amount) + static_cast<double>(final_zone_generator_values["fineTune"].s_amount) / 100.0,
-                    static_cast<double>(final_zone_generator_values["initialAttenuation"].s_amount) / 10.0,
+                    static_cast<double>(final_zone_generator_values[modEnvToPitch].s_amount),
+                    static_cast<double>(final_zone_generator_values[modEnvToFilterFc].s_amount),
+                    static_cast<double>(final_zone_generator_values[modLfoToPitch].s_amount),
+                    static_cast<double>(final_zone_generator_values[modLfoToFilterFc].s_amount),
+                    static_cast<double>(final_zone_generator_values[modLfoToVolume].s_amount) / 10.0,
+                    static_cast<double>(final_zone_generator_values[vibLfoToPitch].s_amount),
+                    static_cast<double>(final_zone_generator_values[keynumToVolEnvHold].s_amount),
+                    static_cast<double>(final_zone_generator_values[keynumToVolEnvDecay].s_amount),
+                    static_cast<double>(final_zone_generator_values[keynumToModEnvHold].s_amount),
+                    static_cast<double>(final_zone_generator_values[keynumToModEnvDecay].s_amount),
+                    static_cast<double>(final_zone_generator_values[scaleTuning].s_amount) / 100.0,
+                    static_cast<double>(final_zone_generator_values[coarseTune].s_amount) + static_cast<double>(final_zone_generator_values[fineTune].s_amount) / 100.0,
+                    static_cast<double>(final_zone_generator_values[initialAttenuation].s_amount) / 10.0,
                     "",
                 };
 
                 // Set the name
-                auto& instrument = raw_sf.instruments[preset_zone_index];
-                strncpy_s(new_zone_to_add.name, reinterpret_cast<char*>(instrument.name), sizeof(instrument.name));
+                auto& instrument_header = raw_sf.instruments[instrument_id];
+                strncpy_s(new_zone_to_add.name, reinterpret_cast<char*>(instrument_header.name), sizeof(instrument_header.name));
 
                 // Add to final preset
                 final_preset.zones.push_back(new_zone_to_add);
             }
         }
 
-        // Add it to the presets
-        presets[(raw_sf.preset_headers[index].bank << 8) | raw_sf.preset_headers[index].program] = final_preset;
-
         // Return preset
+        final_preset.build_zone_lookup();
         return final_preset;
     }
 
+    const Preset* Soundfont::get_preset(const u16 preset_id) {
+        // Without lazy presets, the preset map doesn't change after loading, so it can be read without the lock
+        if (!_built_presets) {
+            const auto preset = presets.find(preset_id);
+            return preset != presets.end() ? &preset->second : nullptr;
+        }
+
+        // Presets that were built already are published in _built_presets, so looking them up again doesn't lock either.
+        // _lazy_preset_indices doesn't change after loading, so presets that don't exist don't need the lock to find out
+        if (const Preset* preset = _built_presets[preset_id].load(std::memory_order_acquire))
+            return preset;
+        const auto lazy_index = _lazy_preset_indices.find(preset_id);
+        if (lazy_index == _lazy_preset_indices.end())
+            return nullptr;
+        std::lock_guard lock(_lazy_mutex);
+
+        // Another thread might have built it in the meantime, otherwise build it now
+        if (const auto preset = presets.find(preset_id); preset != presets.end())
+            return &preset->second;
+        LoadPhaseTimer timer(_report, LoadPhase::preset_build, _allocation_counter, _peak_memory_counter);
+        u64 n_unknown = 0;
+        Preset& preset = presets[preset_id];
+        if (_raw_sf.preset_headers)
+            preset = get_sf2_preset_from_index(lazy_index->second, _raw_sf, n_unknown);
+        else
+            preset = get_dls_preset(*_riff_tree.child(_riff_tree.find(&_riff_tree.root(), "lins"), lazy_index->second), _riff_tree, n_unknown);
+        if (_report) {
+            _report->n_presets_built++;
+            _report->n_zones += preset.zones.size();
+            (_raw_sf.preset_headers ? _report->n_unknown_generators : _report->n_unknown_articulators) += n_unknown;
+        }
+        _built_presets[preset_id].store(&preset, std::memory_order_release);
+        return &preset;
+    }
+
+    const Preset* Soundfont::get_preset(const u8 bank, const u8 program) {
+        return get_preset(static_cast<u16>(bank << 8 | program));
+    }
+
+    std::vector<u16> Soundfont::preset_ids() {
+        std::lock_guard lock(_lazy_mutex);
+        std::vector<u16> ids;
+        ids.reserve(presets.size() + _lazy_preset_indices.size());
+        for (const auto& [preset_id, preset] : presets)
+            ids.push_back(preset_id);
+        for (const auto& [preset_id, index] : _lazy_preset_indices)
+            ids.push_back(preset_id);
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+        return ids;
+    }
+
+    std::span<const u32> Soundfont::find_zones(const u16 preset_id, const u8 key, const u8 velocity) {
+        const Preset* preset = get_preset(preset_id);
+        if (!preset)
+            return {};
+        return preset->find_zones(key, velocity);
+    }
+
     void Soundfont::clear() {
-        // Delete sample data
-        free(_sample_data);
+        // Stop streaming before the sample data goes away
+        _streamer.reset();
+        _compressed.reset();
+
+        // Let go of the shared samples
+        for (const i16* pooled_data : _pooled_samples)
+            _sample_pool->release(pooled_data);
+        _pooled_samples.clear();
+        _sample_pool.reset();
+
+        // Delete the raw tables kept around for lazy preset building
+        if (_raw_sf_owned) {
+            void* pointers_to_clear[] = { _raw_sf.preset_headers, _raw_sf.preset_bags, _raw_sf.preset_mods, _raw_sf.preset_gens, _raw_sf.instruments, _raw_sf.instr_bags, _raw_sf.instr_mods, _raw_sf.instr_gens, _raw_sf.sample_headers };
+            for (auto pointer : pointers_to_clear)
+                free(pointer);
+        }
+        _raw_sf = {};
+        _raw_sf_owned = false;
+        _riff_tree = {};
+        _lazy_preset_indices.clear();
+        _built_presets.reset();
+
+        // Delete sample data - if the soundfont was memory mapped, the sample data lives in the mapping
+        if (_mapped_file.is_open())
+            _mapped_file.close();
+        else
+            free(_sample_data);
         _sample_data = nullptr;
+        _padded_sample_data = {};
+        _float_sample_data = {};
+        _decoded_sample_data = {};
         samples.clear();
         presets.clear();
     };
@@ -1,24 +1,142 @@
 #pragma once
+#include <atomic>
 #include <map>
+#include <mutex>
 #include "structs.h"
 #include "riff_tree.h"
+#include "mapped_file.h"
+#include "sample_streamer.h"
+#include "compressed_samples.h"
+#include "shared_sample_pool.h"
+#include "load_report.h"
 
 namespace Flan {
+    struct LoadSettings {
+        bool memory_map = false;   // Map the file instead of reading it. Sample data and preset tables (SF2) or instruments (DLS) are then used in place, without copying
+        u32 n_threads = 1;         // Number of worker threads used to build the presets (SF2) or decode the wave pool (DLS), 0 to use one per hardware thread
+        bool lazy_presets = false; // Only build presets when they're first requested through Soundfont::get_preset(), instead of building all of them while loading
+
+        // SF2 only: keep only the start and the loop of each sample in memory, and stream the rest from disk through Soundfont::streamer().
+        // Ignored when memory mapping, since the operating system already pages the sample data in on demand then.
+        bool stream_samples = false;
+        u64 stream_memory_budget = 256ull << 20; // Max number of bytes of sample data to keep in memory. Loops are always kept, the start of each sample gets what's left
+        u32 stream_head_frames = 65536;          // Max number of samples to keep in memory from the start of each sample
+        u32 stream_voices = 256;                 // Number of streams that can be open at the same time
+        u32 stream_buffer_frames = 32768;        // Size of each stream's ring buffer, in samples
+        u32 stream_threads = 2;                  // Number of background threads reading from disk
+
+        // Keep the sample data losslessly compressed in memory, and decode it in blocks through Soundfont::compressed_samples() when it's needed.
+        // Loops stay uncompressed in loop_data. VoicePool decodes the frames each voice needs as it plays. Ignored when memory mapping or streaming samples.
+        bool compress_samples = false;
+        u32 compressed_cache_blocks = 64; // Number of decoded blocks to keep in memory, each one is CompressedSamples::block_frames samples
+
+        // If set, the sample data is moved into this pool, which can be shared between soundfonts. Samples that are identical to a sample
+        // that's already in the pool use that one instead of a copy. Ignored when memory mapping, streaming, compressing or padding samples.
+        std::shared_ptr<SharedSamplePool> sample_pool;
+
+        // Copy every sample into a new pool with silence around it, and its loop into a separate copy that's wrapped around on both sides,
+        // so resampling doesn't have to check for the sample edges or the loop end. Zone loop offsets that are the same for every zone that
+        // uses a sample are applied to the sample's loop. Ignored when streaming or compressing samples.
+        bool pad_samples = false;
+
+        // Also convert every sample to 32-bit floats at load time, so playback doesn't have to convert every sample it reads (see Sample::format).
+        // SF2 files with an sm24 chunk and 24-bit DLS waves keep their full 24-bit precision in the floats. The 16-bit data stays available. Ignored when streaming or compressing samples.
+        bool float_samples = false;
+
+        // If not empty, load from this cache file instead when it was built from the same source file. Otherwise the source file
+        // is loaded as usual, and the cache is (re)written afterwards. Not used when streaming, compressing or converting samples to floats.
+        std::string cache_path;
+
+        // Collect a LoadReport while loading, see Soundfont::load_report(). Without it, loading only pays for a few null checks.
+        bool collect_report = false;
+        AllocationCounter allocation_counter = nullptr; // If set, the report also counts operator new in each phase, on top of the library's own mallocs
+        PeakMemoryCounter peak_memory_counter = nullptr; // If set, the report also has the peak memory usage of each phase
+    };
+
     struct Soundfont {
     public:
-        explicit Soundfont(const std::string& path) { from_file(path); }
+        explicit Soundfont(const std::string& path, const LoadSettings& settings = {}) { from_file(path, settings); }
         Soundfont() = default;
         ~Soundfont() { clear(); }
         std::map<u16, Preset> presets;
         std::vector<Sample> samples;
-        bool from_file(const std::string& path);
-        bool from_sf2(const std::string& path);
-        bool from_dls(const std::string& path);
-        void dls_get_samples(Flan::RiffTree& riff_tree);
+        bool from_file(const std::string& path, const LoadSettings& settings = {});
+        bool from_sf2(const std::string& path, const LoadSettings& settings = {});
+        bool from_dls(const std::string& path, const LoadSettings& settings = {});
+        bool dls_get_samples(Flan::RiffTree& riff_tree, const LoadSettings& settings, std::vector<u8>& low_bytes);
         void clear();
+
+        // Write everything that's loaded to a cache file, which from_cache() can load again without parsing source_path.
+        // settings should be the ones the soundfont was loaded with
+        bool save_cache(const std::string& cache_path, const std::string& source_path, const LoadSettings& settings = {});
+
+        // Load a cache file written by save_cache(). The sample data is used straight from the mapped cache file. Fails without changing
+        // anything if the cache is from an older version, source_path has changed since it was written, or it was written by a load with
+        // different settings that change the sample data (pad_samples).
+        bool from_cache(const std::string& cache_path, const std::string& source_path, const LoadSettings& settings = {});
+
+        // Get a preset by bank and program number, or nullptr if it doesn't exist. When loaded with lazy_presets, the preset
+        // is built on the first request and cached in the presets map afterwards. Safe to call from multiple threads, and only locks
+        // while building a preset.
+        const Preset* get_preset(u16 preset_id);
+        const Preset* get_preset(u8 bank, u8 program);
+
+        // Get the numbers of all presets in the soundfont, including the ones that haven't been built yet when loaded with lazy_presets
+        std::vector<u16> preset_ids();
+
+        // Get the indices of the zones in a preset that should play for a MIDI key and velocity, without allocating
+        std::span<const u32> find_zones(u16 preset_id, u8 key, u8 velocity);
+
+        // The streamer for sample data that isn't in memory, or nullptr if the soundfont wasn't loaded with stream_samples.
+        // Samples with resident_length below length need their remaining data streamed, except for the loop which is in loop_data.
+        // VoicePool opens a stream for every voice that plays past resident_length.
+        SampleStreamer* streamer() const { return _streamer.get(); }
+
+        // The compressed sample data, or nullptr if the soundfont wasn't loaded with compress_samples. The samples then have no data and a
+        // resident_length of 0, and only their loops are in memory in loop_data. Everything else can be read with CompressedSamples::read().
+        CompressedSamples* compressed_samples() const { return _compressed.get(); }
+
+        // Where the time went during the last load, when it was loaded with collect_report. Presets built later by get_preset() when
+        // loaded with lazy_presets are added to it as they're built, so only read it while no other thread is calling get_preset().
+        [[nodiscard]] const LoadReport& load_report() const { return _load_report; }
     private:
-        void handle_art1(Flan::ChunkDataHandler& dls_file, Zone& zone) const;
-        Preset get_sf2_preset_from_index(size_t index, RawSoundfontData& raw_sf);
+        LoadReport* start_report(const LoadSettings& settings);
+        bool sf2_load_resident_samples(const std::string& path, FILE* file, u64 sample_data_offset, const RawSoundfontData& raw_sf, const LoadSettings& settings, LoadPhaseTimer& timer);
+        void handle_art1(Flan::ChunkDataHandler& dls_file, Zone& zone, u64& n_unknown_articulators) const;
+        [[nodiscard]] Preset get_dls_preset(RiffNode& ins, RiffTree& riff_tree, u64& n_unknown_articulators) const;
+        [[nodiscard]] Preset get_sf2_preset_from_index(size_t index, const RawSoundfontData& raw_sf, u64& n_unknown_generators) const;
+        void bake_static_loop_offsets();
+        void pad_sample_data(bool free_original);
+        // sm24 has the lower 8 bits of the samples in sm24_base, which has sm24_frames samples. Samples outside of it are converted from 16 bits
+        void convert_samples_to_float(const u8* sm24, const i16* sm24_base, u64 sm24_frames, bool pad, u32 n_threads);
+
+        // Convert PCM frames of 8 (unsigned), 16 or 24 bits with 1 or 2 channels to 16-bit mono. Stereo is mixed down to mono.
+        // For 24-bit frames, the lowest 8 bits are written to low_bytes, unless it's nullptr
+        static void decode_pcm(const u8* source, i16* destination, u8* low_bytes, u64 n_frames, u16 bits_per_sample, u16 n_channels);
+        void compress_sample_data(const LoadSettings& settings, bool free_original);
+        void share_sample_data(const std::shared_ptr<SharedSamplePool>& pool, bool free_original, u32 n_threads);
         i16* _sample_data = nullptr;
+        std::vector<i16> _padded_sample_data;
+        std::vector<f32> _float_sample_data;
+        std::vector<i16> _decoded_sample_data; // DLS waves that aren't 16-bit mono, decoded when the file is memory mapped
+        MappedFile _mapped_file;
+        std::unique_ptr<SampleStreamer> _streamer;
+        std::unique_ptr<CompressedSamples> _compressed;
+        std::shared_ptr<SharedSamplePool> _sample_pool;
+        std::vector<i16*> _pooled_samples; // Every sample data pointer acquired from _sample_pool, released again in clear()
+
+        // Lazy preset building
+        std::map<u16, size_t> _lazy_preset_indices; // Preset number -> index into the phdr table (SF2) or lins list (DLS)
+        RawSoundfontData _raw_sf{};
+        bool _raw_sf_owned = false;
+        RiffTree _riff_tree;
+        std::mutex _lazy_mutex;                     // Held while building a preset
+        std::unique_ptr<std::atomic<const Preset*>[]> _built_presets; // Preset number -> preset once it's built, only when loaded with lazy_presets
+
+        // Load report, _report points to _load_report when it's being collected
+        LoadReport _load_report;
+        LoadReport* _report = nullptr;
+        AllocationCounter _allocation_counter = nullptr;
+        PeakMemoryCounter _peak_memory_counter = nullptr;
     };
 }
\ No newline at end of file
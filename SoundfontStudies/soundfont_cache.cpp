@@ -0,0 +1,365 @@
+#include "soundfont.h"
+#include <cstring>
+#include <filesystem>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace Flan {
+    // Cache file layout: a CacheHeader, followed by the sections it points to. Every section starts on a 64 byte boundary.
+    // Bump cache_version whenever anything that ends up in the cache changes meaning, so old caches get rebuilt.
+    static constexpr char cache_magic[8] = { 'F', 'L', 'A', 'N', 'S', 'F', 'C', 0 };
+    static constexpr u32 cache_version = 4;
+    static constexpr u64 cache_alignment = 64;
+    static constexpr u64 cache_null_offset = ~0ull;
+
+    // Identifies the exact source file a cache was built from
+    struct SourceFingerprint {
+        u64 size = 0;
+        i64 write_time = 0;
+        u64 hash = 0; // Hash of the start and end of the file
+    };
+
+    // Flags for the LoadSettings that change the cached sample data, a cache is only used by loads with the same ones
+    static constexpr u32 cache_option_padded = 1 << 0;
+
+    static u32 cache_load_options(const LoadSettings& settings) {
+        return settings.pad_samples ? cache_option_padded : 0;
+    }
+
+    struct CacheHeader {
+        char magic[8];
+        u32 version;
+        u32 zone_size;                 // sizeof(Zone), in case the struct layout changes without a version bump
+        SourceFingerprint source;
+        u32 load_options;              // cache_option_ flags, see cache_load_options()
+        u32 n_samples;
+        u32 n_presets;
+        u64 n_zones;
+        u64 n_velocity_ranges;
+        u64 n_zone_indices;
+        u64 names_size;
+        u64 pool_frames;
+        u64 samples_offset;
+        u64 presets_offset;
+        u64 zones_offset;
+        u64 velocity_ranges_offset;
+        u64 zone_indices_offset;
+        u64 names_offset;
+        u64 pool_offset;
+    };
+
+    struct CachedSample {
+        u64 data;                      // Offsets into the sample pool in samples, or cache_null_offset for nullptr
+        u64 linked;
+        u64 loop_data;
+        f32 base_sample_rate;
+        u32 length;
+        u32 loop_start;
+        u32 loop_end;
+        u32 resident_length;
+        u32 guard_frames;
+        u16 type;
+    };
+
+    struct CachedPreset {
+        u16 id;
+        u32 name_length;
+        u64 name_offset;               // Offset into the names section
+        u64 first_zone;                // Offset into the zones section
+        u64 n_zones;
+        u64 first_velocity_range;      // Offset into the velocity ranges section, the preset's KeyEntry indices are relative to this
+        u64 n_velocity_ranges;
+        u64 first_zone_index;          // Offset into the zone indices section, the preset's VelocityRange indices are relative to this
+        u64 n_zone_indices;
+        ZoneLookup::KeyEntry keys[128];
+    };
+
+    static_assert(std::is_trivially_copyable_v<Zone>, "Zones are written to the cache as raw bytes");
+    static_assert(std::is_trivially_copyable_v<ZoneLookup::VelocityRange>, "Velocity ranges are written to the cache as raw bytes");
+
+    static u64 align_up(const u64 value) {
+        return (value + cache_alignment - 1) / cache_alignment * cache_alignment;
+    }
+
+    static bool sample_has_loop(const CachedSample& sample) {
+        return sample.loop_start < sample.loop_end && sample.loop_end <= sample.length;
+    }
+
+    static bool get_source_fingerprint(const std::string& path, SourceFingerprint& fingerprint) {
+        std::error_code error;
+        fingerprint.size = std::filesystem::file_size(path, error);
+        if (error) return false;
+        fingerprint.write_time = static_cast<i64>(std::filesystem::last_write_time(path, error).time_since_epoch().count());
+        if (error) return false;
+
+        // Hash the first and last 64 KiB, which covers the RIFF headers and the pdta chunk in most files
+        FILE* file = nullptr;
+        if (fopen_s(&file, path.c_str(), "rb") != 0 || !file) return false;
+        constexpr u64 part_size = 64 * 1024;
+        std::vector<u8> buffer(part_size);
+        u64 hash = 0xcbf29ce484222325ull; // FNV-1a
+        for (const u64 part_start : { 0ull, fingerprint.size > part_size ? fingerprint.size - part_size : 0ull }) {
+            file_seek(file, part_start);
+            const size_t n_read = fread(buffer.data(), 1, buffer.size(), file);
+            for (size_t i = 0; i < n_read; i++)
+                hash = (hash ^ buffer[i]) * 0x100000001b3ull;
+        }
+        const int _ = fclose(file);
+        (void)_;
+        fingerprint.hash = hash;
+        return true;
+    }
+
+    bool Soundfont::save_cache(const std::string& cache_path, const std::string& source_path, const LoadSettings& settings) {
+        // Streamed samples aren't fully in memory, so they can't be cached
+        if (_streamer) return false;
+
+        // Every preset has to be built to be cached
+        for (const auto& [preset_id, index] : _lazy_preset_indices)
+            get_preset(preset_id);
+
+        CacheHeader header{};
+        memcpy(header.magic, cache_magic, sizeof(cache_magic));
+        header.version = cache_version;
+        header.zone_size = sizeof(Zone);
+        header.load_options = cache_load_options(settings);
+        if (!get_source_fingerprint(source_path, header.source)) return false;
+
+        // Lay out the sample pool. Linked samples and loops that point into another sample's data reuse that data.
+        // Every part starts on a 64 byte boundary, like in pad_sample_data(), and the guard frames keep the data after them aligned too
+        constexpr u64 alignment_frames = cache_alignment / sizeof(i16);
+        struct PoolPart {
+            u64 offset;
+            const i16* data;
+            u32 n_frames;
+        };
+        std::unordered_map<const i16*, u64> data_offsets;
+        std::vector<CachedSample> cached_samples(samples.size());
+        std::vector<PoolPart> pool_parts;
+        u64 pool_frames = 0;
+        auto add_to_pool = [&](const i16* data, const u32 n_frames) {
+            if (!data) return cache_null_offset;
+            const u64 offset = (pool_frames + alignment_frames - 1) / alignment_frames * alignment_frames;
+            pool_parts.push_back({ offset, data, n_frames });
+            pool_frames = offset + n_frames;
+            return offset;
+        };
+        // Padded samples are written with their guard frames, so they're still padded when loaded from the cache
+        auto add_padded_to_pool = [&](const i16* data, const u32 n_frames, const u32 guard_frames) {
+            if (!data) return cache_null_offset;
+            return add_to_pool(data - guard_frames, n_frames + 2 * guard_frames) + guard_frames;
+        };
+        for (size_t i = 0; i < samples.size(); i++) {
+            const Sample& sample = samples[i];
+            cached_samples[i].data = add_padded_to_pool(sample.data, sample.resident_length, sample.guard_frames);
+            data_offsets[sample.data] = cached_samples[i].data;
+        }
+        for (size_t i = 0; i < samples.size(); i++) {
+            const Sample& sample = samples[i];
+            CachedSample& cached = cached_samples[i];
+            const auto linked = data_offsets.find(sample.linked);
+            cached.linked = linked != data_offsets.end() ? linked->second : cache_null_offset;
+            if (sample.loop_data && sample.loop_data == sample.data + sample.loop_start)
+                cached.loop_data = cached.data + sample.loop_start;
+            else
+                cached.loop_data = add_padded_to_pool(sample.loop_data, sample.loop_end > sample.loop_start ? sample.loop_end - sample.loop_start : 0, sample.guard_frames);
+            cached.base_sample_rate = sample.base_sample_rate;
+            cached.length = sample.length;
+            cached.loop_start = sample.loop_start;
+            cached.loop_end = sample.loop_end;
+            cached.resident_length = sample.resident_length;
+            cached.guard_frames = sample.guard_frames;
+            cached.type = sample.type;
+        }
+
+        // Flatten the presets
+        std::vector<CachedPreset> cached_presets;
+        std::vector<Zone> zones;
+        std::vector<ZoneLookup::VelocityRange> velocity_ranges;
+        std::vector<u32> zone_indices;
+        std::string names;
+        for (const auto& [preset_id, preset] : presets) {
+            CachedPreset& cached = cached_presets.emplace_back();
+            cached.id = preset_id;
+            cached.name_offset = names.size();
+            cached.name_length = static_cast<u32>(preset.name.size());
+            cached.first_zone = zones.size();
+            cached.n_zones = preset.zones.size();
+            cached.first_velocity_range = velocity_ranges.size();
+            cached.n_velocity_ranges = preset.zone_lookup.velocity_ranges.size();
+            cached.first_zone_index = zone_indices.size();
+            cached.n_zone_indices = preset.zone_lookup.zone_indices.size();
+            memcpy(cached.keys, preset.zone_lookup.keys, sizeof(cached.keys));
+            names += preset.name;
+            zones.insert(zones.end(), preset.zones.begin(), preset.zones.end());
+            velocity_ranges.insert(velocity_ranges.end(), preset.zone_lookup.velocity_ranges.begin(), preset.zone_lookup.velocity_ranges.end());
+            zone_indices.insert(zone_indices.end(), preset.zone_lookup.zone_indices.begin(), preset.zone_lookup.zone_indices.end());
+        }
+
+        // Figure out where every section goes
+        header.n_samples = static_cast<u32>(cached_samples.size());
+        header.n_presets = static_cast<u32>(cached_presets.size());
+        header.n_zones = zones.size();
+        header.n_velocity_ranges = velocity_ranges.size();
+        header.n_zone_indices = zone_indices.size();
+        header.names_size = names.size();
+        header.pool_frames = pool_frames;
+        header.samples_offset = align_up(sizeof(CacheHeader));
+        header.presets_offset = align_up(header.samples_offset + cached_samples.size() * sizeof(CachedSample));
+        header.zones_offset = align_up(header.presets_offset + cached_presets.size() * sizeof(CachedPreset));
+        header.velocity_ranges_offset = align_up(header.zones_offset + zones.size() * sizeof(Zone));
+        header.zone_indices_offset = align_up(header.velocity_ranges_offset + velocity_ranges.size() * sizeof(ZoneLookup::VelocityRange));
+        header.names_offset = align_up(header.zone_indices_offset + zone_indices.size() * sizeof(u32));
+        header.pool_offset = align_up(header.names_offset + names.size());
+
+        // Write to a temporary file first, so nobody ever maps a half written cache
+        const std::string temp_path = cache_path + ".tmp";
+        FILE* file = nullptr;
+        if (fopen_s(&file, temp_path.c_str(), "wb") != 0 || !file) return false;
+        bool ok = true;
+        auto write_section = [&](const u64 offset, const void* data, const u64 size) {
+            static constexpr u8 padding[cache_alignment]{};
+            const u64 position = file_tell(file);
+            if (offset > position)
+                ok &= fwrite(padding, 1, offset - position, file) == offset - position;
+            if (size > 0)
+                ok &= fwrite(data, 1, size, file) == size;
+        };
+        write_section(0, &header, sizeof(header));
+        write_section(header.samples_offset, cached_samples.data(), cached_samples.size() * sizeof(CachedSample));
+        write_section(header.presets_offset, cached_presets.data(), cached_presets.size() * sizeof(CachedPreset));
+        write_section(header.zones_offset, zones.data(), zones.size() * sizeof(Zone));
+        write_section(header.velocity_ranges_offset, velocity_ranges.data(), velocity_ranges.size() * sizeof(ZoneLookup::VelocityRange));
+        write_section(header.zone_indices_offset, zone_indices.data(), zone_indices.size() * sizeof(u32));
+        write_section(header.names_offset, names.data(), names.size());
+        write_section(header.pool_offset, nullptr, 0);
+        for (const PoolPart& part : pool_parts)
+            write_section(header.pool_offset + part.offset * sizeof(i16), part.data, static_cast<u64>(part.n_frames) * sizeof(i16));
+        ok &= fclose(file) == 0;
+
+        std::error_code error;
+        if (ok)
+            std::filesystem::rename(temp_path, cache_path, error);
+        if (!ok || error) {
+            std::filesystem::remove(temp_path, error);
+            return false;
+        }
+        return true;
+    }
+
+    bool Soundfont::from_cache(const std::string& cache_path, const std::string& source_path, const LoadSettings& settings) {
+        // Map the cache and check if it's still valid for the source file
+        MappedFile cache;
+        if (!cache.open(cache_path) || cache.size < sizeof(CacheHeader)) return false;
+        CacheHeader header;
+        memcpy(&header, cache.data, sizeof(header));
+        SourceFingerprint source;
+        if (memcmp(header.magic, cache_magic, sizeof(cache_magic)) != 0 || header.version != cache_version || header.zone_size != sizeof(Zone)) return false;
+        if (header.load_options != cache_load_options(settings)) return false;
+        if (!get_source_fingerprint(source_path, source)) return false;
+        if (source.size != header.source.size || source.write_time != header.source.write_time || source.hash != header.source.hash) return false;
+
+        // Make sure every section is inside the file
+        auto section_fits = [&](const u64 offset, const u64 count, const u64 element_size) {
+            return offset <= cache.size && count <= (cache.size - offset) / element_size;
+        };
+        if (!section_fits(header.samples_offset, header.n_samples, sizeof(CachedSample)) ||
+            !section_fits(header.presets_offset, header.n_presets, sizeof(CachedPreset)) ||
+            !section_fits(header.zones_offset, header.n_zones, sizeof(Zone)) ||
+            !section_fits(header.velocity_ranges_offset, header.n_velocity_ranges, sizeof(ZoneLookup::VelocityRange)) ||
+            !section_fits(header.zone_indices_offset, header.n_zone_indices, sizeof(u32)) ||
+            !section_fits(header.names_offset, header.names_size, 1) ||
+            !section_fits(header.pool_offset, header.pool_frames, sizeof(i16))) return false;
+
+        // Make sure every sample's data, with its guard frames, is inside the pool. Linked samples have to point to another sample's data
+        const auto* cached_samples = reinterpret_cast<const CachedSample*>(cache.data + header.samples_offset);
+        auto pool_range_fits = [&](const u64 offset, const u64 n_frames, const u64 guard_frames) {
+            return offset == cache_null_offset || (offset >= guard_frames && offset <= header.pool_frames && n_frames + guard_frames <= header.pool_frames - offset);
+        };
+        std::unordered_set<u64> sample_data_offsets;
+        for (u32 i = 0; i < header.n_samples; i++)
+            sample_data_offsets.insert(cached_samples[i].data);
+        for (u32 i = 0; i < header.n_samples; i++) {
+            const CachedSample& cached = cached_samples[i];
+            const u64 loop_frames = sample_has_loop(cached) ? cached.loop_end - cached.loop_start : 0;
+            if (!pool_range_fits(cached.data, cached.resident_length, cached.guard_frames) ||
+                !pool_range_fits(cached.loop_data, loop_frames, cached.guard_frames) ||
+                (cached.linked != cache_null_offset && !sample_data_offsets.contains(cached.linked))) return false;
+        }
+
+        // Make sure every zone uses a sample that exists
+        const auto* zones = reinterpret_cast<const Zone*>(cache.data + header.zones_offset);
+        for (u64 i = 0; i < header.n_zones; i++) {
+            if (zones[i].sample_index >= header.n_samples) return false;
+        }
+
+        // Make sure every preset's parts are inside their sections, and its lookup tables only point inside the preset's own parts
+        const auto* cached_presets = reinterpret_cast<const CachedPreset*>(cache.data + header.presets_offset);
+        const auto* velocity_ranges = reinterpret_cast<const ZoneLookup::VelocityRange*>(cache.data + header.velocity_ranges_offset);
+        const auto* zone_indices = reinterpret_cast<const u32*>(cache.data + header.zone_indices_offset);
+        auto range_fits = [](const u64 first, const u64 count, const u64 total) {
+            return count <= total && first <= total - count;
+        };
+        for (u32 i = 0; i < header.n_presets; i++) {
+            const CachedPreset& cached = cached_presets[i];
+            if (!range_fits(cached.name_offset, cached.name_length, header.names_size) ||
+                !range_fits(cached.first_zone, cached.n_zones, header.n_zones) ||
+                !range_fits(cached.first_velocity_range, cached.n_velocity_ranges, header.n_velocity_ranges) ||
+                !range_fits(cached.first_zone_index, cached.n_zone_indices, header.n_zone_indices)) return false;
+            for (const ZoneLookup::KeyEntry& key : cached.keys) {
+                if (!range_fits(key.first_range, key.n_ranges, cached.n_velocity_ranges)) return false;
+            }
+            for (u64 j = 0; j < cached.n_velocity_ranges; j++) {
+                const ZoneLookup::VelocityRange& range = velocity_ranges[cached.first_velocity_range + j];
+                if (!range_fits(range.first_zone, range.n_zones, cached.n_zone_indices)) return false;
+            }
+            for (u64 j = 0; j < cached.n_zone_indices; j++) {
+                if (zone_indices[cached.first_zone_index + j] >= cached.n_zones) return false;
+            }
+        }
+
+        // Everything checks out, so replace whatever was loaded before
+        clear();
+        _mapped_file = std::move(cache);
+        const u8* base = _mapped_file.data;
+        i16* pool = reinterpret_cast<i16*>(_mapped_file.data + header.pool_offset);
+
+        // Samples point straight into the mapped sample pool
+        cached_samples = reinterpret_cast<const CachedSample*>(base + header.samples_offset);
+        auto pool_pointer = [&](const u64 offset) { return offset == cache_null_offset ? nullptr : pool + offset; };
+        samples.resize(header.n_samples);
+        for (u32 i = 0; i < header.n_samples; i++) {
+            const CachedSample& cached = cached_samples[i];
+            samples[i] = {
+                pool_pointer(cached.data),
+                pool_pointer(cached.linked),
+                cached.base_sample_rate,
+                cached.length,
+                cached.loop_start,
+                cached.loop_end,
+                static_cast<SFSampleLink>(cached.type),
+                pool_pointer(cached.loop_data),
+                cached.resident_length,
+                cached.guard_frames,
+            };
+        }
+
+        // Presets, zones and lookup tables are copied into the preset map
+        cached_presets = reinterpret_cast<const CachedPreset*>(base + header.presets_offset);
+        zones = reinterpret_cast<const Zone*>(base + header.zones_offset);
+        velocity_ranges = reinterpret_cast<const ZoneLookup::VelocityRange*>(base + header.velocity_ranges_offset);
+        zone_indices = reinterpret_cast<const u32*>(base + header.zone_indices_offset);
+        const auto* names = reinterpret_cast<const char*>(base + header.names_offset);
+        for (u32 i = 0; i < header.n_presets; i++) {
+            const CachedPreset& cached = cached_presets[i];
+            Preset& preset = presets[cached.id];
+            preset.name.assign(names + cached.name_offset, cached.name_length);
+            preset.zones.assign(zones + cached.first_zone, zones + cached.first_zone + cached.n_zones);
+            memcpy(preset.zone_lookup.keys, cached.keys, sizeof(cached.keys));
+            preset.zone_lookup.velocity_ranges.assign(velocity_ranges + cached.first_velocity_range, velocity_ranges + cached.first_velocity_range + cached.n_velocity_ranges);
+            preset.zone_lookup.zone_indices.assign(zone_indices + cached.first_zone_index, zone_indices + cached.first_zone_index + cached.n_zone_indices);
+        }
+        return true;
+    }
+}
@@ -0,0 +1,70 @@
+#include "soundfont_stack.h"
+
+namespace Flan {
+    SoundfontStack::SoundfontStack() : SoundfontStack(Fallback{}) {}
+
+    SoundfontStack::SoundfontStack(const Fallback& fallback) {
+        _fallback = fallback;
+        _slots = std::make_unique<Slot[]>(n_preset_ids);
+    }
+
+    void SoundfontStack::push(std::shared_ptr<Soundfont> soundfont) {
+        if (!soundfont)
+            return;
+        _soundfonts.push_back(std::move(soundfont));
+        rebuild();
+    }
+
+    void SoundfontStack::clear() {
+        _soundfonts.clear();
+        rebuild();
+    }
+
+    void SoundfontStack::rebuild() {
+        // Exact matches first. Go from the bottom of the stack to the top, so the soundfonts on top overwrite the ones below
+        std::vector<Soundfont*> owner(n_preset_ids, nullptr);
+        for (const auto& soundfont : _soundfonts) {
+            for (const u16 preset_id : soundfont->preset_ids())
+                owner[preset_id] = soundfont.get();
+        }
+
+        // Then fill in the gaps with the fallbacks, which only use exact matches so they never chain
+        for (u32 preset_id = 0; preset_id < n_preset_ids; preset_id++) {
+            Slot& slot = _slots[preset_id];
+            const u8 bank = static_cast<u8>(preset_id >> 8);
+            const u8 program = static_cast<u8>(preset_id);
+            u32 target = preset_id;
+            if (!owner[target] && bank < 128 && _fallback.melodic_to_bank_0)
+                target = program;
+            if (!owner[target] && bank >= 128 && _fallback.drums_to_bank_128) {
+                target = 128 << 8 | program;
+                if (!owner[target])
+                    target = 128 << 8;
+            }
+
+            slot.soundfont = owner[target];
+            slot.preset_id = static_cast<u16>(target);
+            slot.preset.store(nullptr, std::memory_order_relaxed);
+
+            // Presets that are already built can be pointed to right away
+            if (slot.soundfont) {
+                if (const auto preset = slot.soundfont->presets.find(slot.preset_id); preset != slot.soundfont->presets.end())
+                    slot.preset.store(&preset->second, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    SoundfontStack::Entry SoundfontStack::resolve(const u16 preset_id) {
+        Slot& slot = _slots[preset_id];
+        if (!slot.soundfont)
+            return {};
+
+        // The preset might still need to be built, the soundfont takes care of that. Presets in its map never move, so keep the pointer
+        const Preset* preset = slot.preset.load(std::memory_order_acquire);
+        if (!preset) {
+            preset = slot.soundfont->get_preset(slot.preset_id);
+            slot.preset.store(preset, std::memory_order_release);
+        }
+        return { slot.soundfont, preset };
+    }
+}
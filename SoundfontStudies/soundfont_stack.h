@@ -0,0 +1,56 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "soundfont.h"
+
+namespace Flan {
+    // A stack of soundfonts, where the presets of a soundfont override the ones with the same number in the soundfonts below it.
+    // All preset numbers are resolved ahead of time into one flat table, so finding a preset is a single lookup. The presets and
+    // samples aren't copied, they stay in the soundfont they came from.
+    class SoundfontStack {
+    public:
+        // What to use when no soundfont in the stack has the exact bank and program that's requested
+        struct Fallback {
+            bool melodic_to_bank_0 = true;  // Banks below 128 fall back to the same program in bank 0
+            bool drums_to_bank_128 = true;  // Banks 128 and up fall back to the same program in bank 128, and then to program 0 in bank 128
+        };
+
+        // A preset, and the soundfont that has its samples
+        struct Entry {
+            Soundfont* soundfont = nullptr;
+            const Preset* preset = nullptr;
+        };
+
+        SoundfontStack();
+        explicit SoundfontStack(const Fallback& fallback);
+
+        // Put a soundfont on top of the stack, so its presets override the ones of every soundfont that was pushed before it.
+        // Rebuilds the lookup table, so this shouldn't be called while other threads are looking up presets
+        void push(std::shared_ptr<Soundfont> soundfont);
+        void clear();
+
+        // Find the preset that plays for a bank and program number, following the fallback rules. Both are nullptr if nothing plays.
+        // When a soundfont was loaded with lazy_presets, the preset is built on the first request. Safe to call from multiple threads.
+        Entry resolve(u16 preset_id);
+        Entry resolve(u8 bank, u8 program) { return resolve(static_cast<u16>(bank << 8 | program)); }
+        const Preset* get_preset(u16 preset_id) { return resolve(preset_id).preset; }
+        const Preset* get_preset(u8 bank, u8 program) { return resolve(bank, program).preset; }
+
+        // Number of soundfonts in the stack
+        [[nodiscard]] size_t size() const { return _soundfonts.size(); }
+
+    private:
+        static constexpr u32 n_preset_ids = 65536;
+        struct Slot {
+            Soundfont* soundfont = nullptr;
+            u16 preset_id = 0;                       // The preset to use for this slot, after falling back
+            std::atomic<const Preset*> preset = nullptr; // Filled in on the first lookup if the preset wasn't built yet
+        };
+        void rebuild();
+
+        Fallback _fallback;
+        std::vector<std::shared_ptr<Soundfont>> _soundfonts; // Bottom of the stack first
+        std::unique_ptr<Slot[]> _slots;
+    };
+}
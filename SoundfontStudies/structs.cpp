@@ -1,5 +1,8 @@
 #include "structs.h"
+#include <algorithm>
+#include <bit>
 #include <fstream>
+#include "load_report.h"
 
 namespace Flan {
 
@@ -20,6 +23,104 @@ namespace Flan {
         return *this == other_id;
     }
 
+    void GeneratorValues::override_with(const GeneratorValues& other) {
+        // Copy every generator that is set in the other zone, only visiting the set bits
+        for (u64 mask = other.set_mask; mask != 0; mask &= mask - 1) {
+            const int index = std::countr_zero(mask);
+            values[index] = other.values[index];
+        }
+        set_mask |= other.set_mask;
+    }
+
+    void Preset::build_zone_lookup() {
+        zone_lookup = {};
+        std::vector<u32> key_zones;
+        std::vector<u32> range_zones;
+        std::vector<int> boundaries;
+        for (int key = 0; key < 128; key++) {
+            // Find all the zones in this key's range, and the velocities where the set of zones changes
+            key_zones.clear();
+            boundaries.assign({ 0, 128 });
+            for (u32 i = 0; i < zones.size(); i++) {
+                const Zone& zone = zones[i];
+                if (key < zone.key_range_low || key > zone.key_range_high || zone.vel_range_low > zone.vel_range_high)
+                    continue;
+                key_zones.push_back(i);
+                boundaries.push_back(zone.vel_range_low);
+                boundaries.push_back(zone.vel_range_high + 1);
+            }
+            std::sort(boundaries.begin(), boundaries.end());
+            boundaries.erase(std::unique(boundaries.begin(), boundaries.end()), boundaries.end());
+
+            // Create a velocity range for each section between boundaries, merging it with the previous one if the zones are the same
+            ZoneLookup::KeyEntry& entry = zone_lookup.keys[key];
+            entry.first_range = static_cast<u32>(zone_lookup.velocity_ranges.size());
+            for (size_t b = 0; b + 1 < boundaries.size() && boundaries[b] < 128; b++) {
+                range_zones.clear();
+                for (const u32 i : key_zones) {
+                    if (zones[i].vel_range_low <= boundaries[b] && zones[i].vel_range_high >= boundaries[b])
+                        range_zones.push_back(i);
+                }
+                const u8 vel_high = static_cast<u8>(std::min(boundaries[b + 1], 128) - 1);
+
+                if (entry.n_ranges > 0) {
+                    ZoneLookup::VelocityRange& prev = zone_lookup.velocity_ranges.back();
+                    if (std::equal(range_zones.begin(), range_zones.end(), zone_lookup.zone_indices.begin() + prev.first_zone, zone_lookup.zone_indices.begin() + prev.first_zone + prev.n_zones)) {
+                        prev.vel_high = vel_high;
+                        continue;
+                    }
+                }
+                zone_lookup.velocity_ranges.push_back({ vel_high, static_cast<u32>(zone_lookup.zone_indices.size()), static_cast<u32>(range_zones.size()) });
+                zone_lookup.zone_indices.insert(zone_lookup.zone_indices.end(), range_zones.begin(), range_zones.end());
+                entry.n_ranges++;
+            }
+
+            // Neighbouring keys usually share the same zones - if so, reuse the previous key's ranges
+            if (key > 0) {
+                const ZoneLookup::KeyEntry& prev_entry = zone_lookup.keys[key - 1];
+                const auto range_equal = [&](const ZoneLookup::VelocityRange& a, const ZoneLookup::VelocityRange& b) {
+                    return a.vel_high == b.vel_high && std::equal(
+                        zone_lookup.zone_indices.begin() + a.first_zone, zone_lookup.zone_indices.begin() + a.first_zone + a.n_zones,
+                        zone_lookup.zone_indices.begin() + b.first_zone, zone_lookup.zone_indices.begin() + b.first_zone + b.n_zones);
+                };
+                const auto ranges = zone_lookup.velocity_ranges.begin();
+                if (prev_entry.n_ranges == entry.n_ranges && std::equal(ranges + prev_entry.first_range, ranges + prev_entry.first_range + prev_entry.n_ranges, ranges + entry.first_range, range_equal)) {
+                    zone_lookup.zone_indices.resize(zone_lookup.velocity_ranges[entry.first_range].first_zone);
+                    zone_lookup.velocity_ranges.resize(entry.first_range);
+                    entry = prev_entry;
+                }
+            }
+        }
+    }
+
+    std::span<const u32> Preset::find_zones(const u8 key, const u8 velocity) const {
+        if (key >= 128)
+            return {};
+        const ZoneLookup::KeyEntry& entry = zone_lookup.keys[key];
+        for (u32 i = entry.first_range; i < entry.first_range + entry.n_ranges; i++) {
+            const ZoneLookup::VelocityRange& range = zone_lookup.velocity_ranges[i];
+            if (velocity <= range.vel_high)
+                return { zone_lookup.zone_indices.data() + range.first_zone, range.n_zones };
+        }
+        return {};
+    }
+
+    bool file_seek(FILE* file, const u64 offset) {
+#ifdef _WIN32
+        return _fseeki64(file, static_cast<i64>(offset), SEEK_SET) == 0;
+#else
+        return fseeko(file, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+    }
+
+    u64 file_tell(FILE* file) {
+#ifdef _WIN32
+        return static_cast<u64>(_ftelli64(file));
+#else
+        return static_cast<u64>(ftello(file));
+#endif
+    }
+
     bool ChunkDataHandler::from_buffer(uint8_t* buffer_to_use, uint32_t size) {
         if (buffer_to_use == nullptr)
             return false;
@@ -35,7 +136,7 @@ namespace Flan {
         if (size == 0) {
             return false;
         }
-        original_pointer = static_cast<uint8_t*>(malloc(size));
+        original_pointer = static_cast<uint8_t*>(counted_malloc(size));
         data_pointer = original_pointer;
         if (!data_pointer) { return false; }
         fread_s(data_pointer, size, size, 1, file);
@@ -47,7 +148,7 @@ namespace Flan {
         if (size == 0) {
             return false;
         }
-        data_pointer = static_cast<uint8_t*>(malloc(size));
+        data_pointer = static_cast<uint8_t*>(counted_malloc(size));
         if (free_on_destruction)
             original_pointer = data_pointer;
         if (!data_pointer) { return false; }
@@ -1,5 +1,7 @@
 #pragma once
 #include "common.h"
+#include <memory>
+#include <span>
 #include <string>
 #include <vector>
 #include <iostream>
@@ -18,6 +20,11 @@ namespace Flan {
         RomLinkedSample = 0x8008
     };
 
+    enum class SampleFormat : u8 {
+        pcm16,   // Only the 16-bit data is loaded
+        float32, // The sample is also loaded as floats from -1.0 to +1.0, in float_data and float_loop_data
+    };
+
     struct Sample {
         i16* data;                        // Pointer to the sample data - should always be a valid pointer
         i16* linked;                      // Pointer to linked sample data - only used if sample link type is not monoSample
@@ -26,7 +33,34 @@ namespace Flan {
         u32 loop_start;                   // In samples
         u32 loop_end;                     // In samples
         Flan::SFSampleLink type;          // Sample link type
-    };
+        i16* loop_data = nullptr;         // Pointer to the sample data from loop_start to loop_end, this is always in memory
+        u32 resident_length = 0;          // Number of samples from the start of data that are in memory. Usually equal to length, but
+                                          // when streaming, the samples after this (except for the loop) have to come from the SampleStreamer.
+                                          // When compressed, this is 0, and the samples come from Soundfont::compressed_samples()
+        u32 guard_frames = 0;             // When loaded with pad_samples, this many samples before data and after length are silence, and
+                                          // loop_data is a separate copy of the loop with this many samples of the loop wrapped around on both sides
+        SampleFormat format = SampleFormat::pcm16;
+        f32* float_data = nullptr;        // When the format is float32: the sample data as floats, including the extra precision from the sm24 chunk.
+                                          // Has the same guard frames as data
+        f32* float_loop_data = nullptr;   // When the format is float32: the loop as floats, laid out the same way as loop_data
+    };
+
+    // Number of guard samples around every sample when loading with pad_samples, enough for every interpolation kernel
+    constexpr u32 sample_guard_frames = 32;
+
+    // A DLS connection block that doesn't have its own field in Zone, like key velocity or a MIDI controller changing the pitch or volume.
+    // The amount is how much the destination changes when the source is at its maximum, in the same unit as the matching Zone field,
+    // except for envelope sustain levels, which are a fraction of the peak level. VoicePool and the MIDI renderer don't apply these yet
+    struct ZoneModulator {
+        u16 source = 0;                   // dlsArtSrc
+        u16 control = 0;                  // dlsArtSrc, scales the source if it isn't CONN_SRC_NONE
+        u16 destination = 0;              // dlsArtDst
+        u16 transform = 0;                // dlsArtTrn, applied to the source
+        f32 amount = 0.0f;
+    };
+
+    // Max number of ZoneModulators in a zone
+    constexpr u32 max_zone_modulators = 8;
 
     struct Zone {
         u8 key_range_low = 0;		      // Lowest MIDI key in this zone
@@ -62,6 +96,8 @@ namespace Flan {
         double tuning = 0.0f;		      // Combination of the sf2 coarse and fine tuning, could be added to MIDI key directly to get corrected pitch
         double init_attenuation = 0.0f;    // Value to subtract from note volume in cB
         char name[24]{ 0 };
+        ZoneModulator modulators[max_zone_modulators]{}; // DLS only: modulation that isn't covered by the fields above
+        u8 n_modulators = 0;
     };
 
     struct PresetIndex {
@@ -69,9 +105,29 @@ namespace Flan {
         u8 program;
     };
 
+    // Lookup table from MIDI key and velocity to the zones that should play, so they don't have to be searched on every note
+    struct ZoneLookup {
+        struct VelocityRange {
+            u8 vel_high = 127;           // Highest velocity in this range, the lowest one is right after the previous range
+            u32 first_zone = 0;          // Index of the first entry in zone_indices for this range
+            u32 n_zones = 0;             // Number of zones that play in this range
+        };
+        struct KeyEntry {
+            u32 first_range = 0;         // Index of the first velocity range of this key in velocity_ranges
+            u32 n_ranges = 0;            // Number of velocity ranges of this key, together they cover velocities 0-127
+        };
+        KeyEntry keys[128]{};
+        std::vector<VelocityRange> velocity_ranges;
+        std::vector<u32> zone_indices;   // Indices into Preset::zones
+    };
+
     struct Preset {
         std::string name;
         std::vector<Zone> zones;
+        ZoneLookup zone_lookup;          // Built from the zones while loading, used by find_zones()
+        void build_zone_lookup();
+        // Returns the indices of all zones that should play for this key and velocity, in the same order as in zones
+        [[nodiscard]] std::span<const u32> find_zones(u8 key, u8 velocity) const;
     };
 
     struct ChunkId {
@@ -84,6 +140,11 @@ namespace Flan {
             return *reinterpret_cast<const uint32_t*>(v);
         }
 
+        // The same as from_string(), but for string literals at compile time, so chunk ids can be compared as numbers without any strings
+        static constexpr u32 fourcc(const char (&v)[5]) {
+            return static_cast<u32>(static_cast<u8>(v[0])) | static_cast<u32>(static_cast<u8>(v[1])) << 8 | static_cast<u32>(static_cast<u8>(v[2])) << 16 | static_cast<u32>(static_cast<u8>(v[3])) << 24;
+        }
+
         [[nodiscard]] std::shared_ptr<char> c_str() const;
         bool verify(const char* other_id) const;
         bool operator==(const ChunkId& rhs) const { return id == rhs.id; }
@@ -107,6 +168,10 @@ namespace Flan {
         bool get_data(void* destination, u32 byte_count);
     };
 
+    // Seek to and get absolute file positions, with 64-bit offsets on every platform
+    bool file_seek(FILE* file, u64 offset);
+    u64 file_tell(FILE* file);
+
     struct Chunk {
         ChunkId id;
         u32 size = 0;
@@ -301,7 +366,7 @@ namespace Flan {
         GenApplyMode apply_mode : 2;
     };
 
-    static GenFlags gen_flags[59] = {
+    inline GenFlags gen_flags[59] = {
         GenFlags{true, add}, // 0
         GenFlags{true, add},
         GenFlags{true, add},
@@ -363,6 +428,20 @@ namespace Flan {
         GenFlags{true, add},
     };
 
+    // Generator values of a single zone, indexed by SFGenerator. Each generator that was explicitly set has its bit set in set_mask
+    struct GeneratorValues {
+        GenAmountType values[endOper]{};
+        u64 set_mask = 0;
+        GenAmountType& operator[](const SFGenerator oper) { return values[oper]; }
+        const GenAmountType& operator[](const SFGenerator oper) const { return values[oper]; }
+        [[nodiscard]] bool is_set(const SFGenerator oper) const { return (set_mask >> oper) & 1; }
+        void set(const SFGenerator oper, const GenAmountType amount) {
+            values[oper] = amount;
+            set_mask |= 1ull << oper;
+        }
+        void override_with(const GeneratorValues& other);
+    };
+
     enum SFTransform : u16 {
         linear = 0,
         absolute_value = 2,
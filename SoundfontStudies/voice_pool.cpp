@@ -0,0 +1,368 @@
+#include "voice_pool.h"
+#include <algorithm>
+#include <cmath>
+
+namespace Flan {
+    VoicePool::VoicePool(const u32 capacity, const float output_sample_rate) {
+        _capacity = capacity;
+        _output_sample_rate = output_sample_rate;
+        auto allocate = [capacity](auto&... arrays) { (arrays.resize(capacity), ...); };
+        allocate(_cursor, _base_step, _interpolation, _compressed, _sample_index, _stream);
+        allocate(_zone, _vol_env, _mod_env, _vib_lfo, _mod_lfo);
+        allocate(_base_gain_left, _base_gain_right, _gain_left, _gain_right, _target_gain_left, _target_gain_right);
+        allocate(_filter_a, _filter_feedback, _filter_state1, _filter_state2, _tag, _playing);
+        _lanes.resize(control_block_size * filter_lanes);
+    }
+
+    bool VoicePool::start_voice(const Soundfont& soundfont, const Zone& zone, u8 key, u8 velocity, const u32 tag, const Interpolation interpolation) {
+        if (_n_active >= _capacity || zone.sample_index >= soundfont.samples.size())
+            return false;
+        const Sample& sample = soundfont.samples[zone.sample_index];
+        CompressedSamples* compressed = sample.data ? nullptr : soundfont.compressed_samples();
+        SampleStreamer* streamer = sample.data && sample.resident_length < sample.length ? soundfont.streamer() : nullptr;
+        if (compressed ? compressed->length(zone.sample_index) == 0 : !sample.data || (sample.resident_length == 0 && !streamer))
+            return false;
+        if (zone.key_override < 128) key = zone.key_override;
+        if (zone.vel_override < 128) velocity = zone.vel_override;
+
+        SampleCursor cursor;
+        StreamState stream;
+        if (compressed) {
+            cursor = SampleCursor::from_windowed_zone(sample, compressed->length(zone.sample_index), zone);
+        }
+        else if (streamer) {
+            cursor = SampleCursor::from_windowed_zone(sample, sample.length, zone);
+
+            // The stream can't go back, so if the zone moves the loop out of what's in memory, play the sample's own loop instead
+            const bool has_loop = sample.loop_start < sample.loop_end && sample.loop_end <= sample.length;
+            const u32 memory_end = has_loop && sample.loop_start <= sample.resident_length ? std::max(sample.resident_length, sample.loop_end) : sample.resident_length;
+            const bool loop_in_memory = cursor.loop_end <= memory_end || (has_loop && cursor.loop_start >= sample.loop_start && cursor.loop_end <= sample.loop_end);
+            if (cursor.loop_enable && !loop_in_memory) {
+                cursor.loop_end = has_loop ? std::min(sample.loop_end, cursor.end) : 0;
+                cursor.loop_start = std::min(sample.loop_start, cursor.loop_end);
+                cursor.loop_enable = cursor.loop_end > cursor.loop_start;
+            }
+
+            // Stream everything the voice reads past the part in memory, up to the loop if it loops
+            const u32 start = static_cast<u32>(cursor.position >> 32);
+            stream.sample = &sample;
+            stream.streamer = streamer;
+            stream.stream_start = std::max(sample.resident_length, start > max_kernel_left ? start - max_kernel_left : 0);
+            stream.stream_end = std::max(stream.stream_start, cursor.loop_enable ? cursor.loop_start : cursor.end);
+            stream.next_frame = stream.stream_start;
+            if (stream.stream_end > stream.stream_start) {
+                stream.stream = streamer->open_stream(zone.sample_index, stream.stream_start, stream.stream_end);
+                if (stream.stream < 0)
+                    return false;
+            }
+        }
+        else {
+            cursor = SampleCursor::from_zone(sample, zone);
+        }
+
+        const u32 voice = _n_active++;
+        _cursor[voice] = cursor;
+        _interpolation[voice] = interpolation;
+        _compressed[voice] = compressed;
+        _sample_index[voice] = zone.sample_index;
+        _stream[voice] = stream;
+
+        // The sample's base sample rate already plays at the right pitch for MIDI key 60
+        const double semitones = (static_cast<double>(key) - 60.0 + zone.root_key_offset) * zone.scale_tuning + zone.tuning;
+        _base_step[voice] = static_cast<double>(sample.base_sample_rate) / _output_sample_rate * exp2(semitones / 12.0);
+
+        // Constant power panning, with the velocity and attenuation on top
+        const double velocity_gain = (velocity / 127.0) * (velocity / 127.0);
+        const double attenuation_gain = exp2(-zone.init_attenuation / 15.0);
+        const double pan_angle = (std::clamp(zone.pan, -1.0, 1.0) + 1.0) * 3.141592653589793 / 4.0;
+        _base_gain_left[voice] = static_cast<float>(velocity_gain * attenuation_gain * cos(pan_angle));
+        _base_gain_right[voice] = static_cast<float>(velocity_gain * attenuation_gain * sin(pan_angle));
+
+        _zone[voice] = &zone;
+        _vol_env[voice] = {};
+        _mod_env[voice] = {};
+        _vib_lfo[voice] = {};
+        _mod_lfo[voice] = {};
+        _filter_state1[voice] = 0.0f;
+        _filter_state2[voice] = 0.0f;
+        _tag[voice] = tag;
+
+        // Start at the initial envelope level instead of ramping to it
+        update_controls(voice, 0);
+        _gain_left[voice] = _target_gain_left[voice];
+        _gain_right[voice] = _target_gain_right[voice];
+        return true;
+    }
+
+    u32 VoicePool::note_on(Soundfont& soundfont, const u16 preset_id, const u8 key, const u8 velocity, const u32 tag, const Interpolation interpolation) {
+        const Preset* preset = soundfont.get_preset(preset_id);
+        if (!preset)
+            return 0;
+        return note_on(soundfont, *preset, key, velocity, tag, interpolation);
+    }
+
+    u32 VoicePool::note_on(const Soundfont& soundfont, const Preset& preset, const u8 key, const u8 velocity, const u32 tag, const Interpolation interpolation) {
+        u32 n_started = 0;
+        for (const u32 zone_index : preset.find_zones(key, velocity))
+            n_started += start_voice(soundfont, preset.zones[zone_index], key, velocity, tag, interpolation);
+        return n_started;
+    }
+
+    u32 VoicePool::note_on(SoundfontStack& stack, const u16 preset_id, const u8 key, const u8 velocity, const u32 tag, const Interpolation interpolation) {
+        const SoundfontStack::Entry entry = stack.resolve(preset_id);
+        if (!entry.preset)
+            return 0;
+        u32 n_started = 0;
+        for (const u32 zone_index : entry.preset->find_zones(key, velocity))
+            n_started += start_voice(*entry.soundfont, entry.preset->zones[zone_index], key, velocity, tag, interpolation);
+        return n_started;
+    }
+
+    void VoicePool::release(const u32 tag) {
+        for (u32 voice = 0; voice < _n_active; voice++) {
+            if (_tag[voice] != tag)
+                continue;
+            _vol_env[voice].stage = static_cast<double>(EnvStage::release);
+            _mod_env[voice].stage = static_cast<double>(EnvStage::release);
+        }
+    }
+
+    void VoicePool::release_all() {
+        for (u32 voice = 0; voice < _n_active; voice++) {
+            _vol_env[voice].stage = static_cast<double>(EnvStage::release);
+            _mod_env[voice].stage = static_cast<double>(EnvStage::release);
+        }
+    }
+
+    void VoicePool::stop_all() {
+        for (u32 voice = 0; voice < _n_active; voice++)
+            close_stream(voice);
+        _n_active = 0;
+    }
+
+    void VoicePool::render(float* output_left, float* output_right, const u32 n_frames) {
+        for (u32 frame = 0; frame < n_frames; frame += control_block_size) {
+            const u32 block_frames = std::min(control_block_size, n_frames - frame);
+
+            for (u32 voice = 0; voice < _n_active; voice++)
+                update_controls(voice, block_frames);
+
+            // Render the voices in groups, so the filter can run on all voices of a group at once
+            for (u32 first_voice = 0; first_voice < _n_active; first_voice += filter_lanes) {
+                const u32 n_lanes = std::min(filter_lanes, _n_active - first_voice);
+                for (u32 lane = 0; lane < n_lanes; lane++) {
+                    const u32 voice = first_voice + lane;
+                    if (_compressed[voice] || _stream[voice].sample)
+                        _playing[voice] = resample_window(voice, _lanes.data() + lane, n_lanes, block_frames);
+                    else
+                        _playing[voice] = resample(_interpolation[voice], _cursor[voice], _lanes.data() + lane, n_lanes, block_frames);
+                }
+                lowpass_filter_lanes(_lanes.data(), block_frames, n_lanes, &_filter_a[first_voice], &_filter_feedback[first_voice], &_filter_state1[first_voice], &_filter_state2[first_voice]);
+                for (u32 lane = 0; lane < n_lanes; lane++)
+                    mix_voice(first_voice + lane, _lanes.data() + lane, n_lanes, output_left + frame, output_right + frame, block_frames);
+            }
+
+            // Free the voices that reached the end of their sample or volume envelope.
+            // Go backwards, so freeing a voice (which moves the last voice into its slot) doesn't skip any voices
+            for (u32 voice = _n_active; voice-- > 0;) {
+                if (!_playing[voice] || static_cast<EnvStage>(_vol_env[voice].stage) == EnvStage::off)
+                    free_voice(voice);
+            }
+        }
+    }
+
+    void VoicePool::update_controls(const u32 voice, const u32 n_frames) {
+        const Zone& zone = *_zone[voice];
+        const double dt = static_cast<double>(n_frames) / _output_sample_rate;
+        _mod_env[voice].update(zone.mod_env, dt, true);
+        _vib_lfo[voice].update(zone.vib_lfo, dt);
+        _mod_lfo[voice].update(zone.mod_lfo, dt);
+        const double mod_env = exp2(_mod_env[voice].value / 6.0);
+        const double mod_lfo = _mod_lfo[voice].state;
+
+        // Pitch
+        const double cents = zone.mod_env_to_pitch * mod_env + zone.mod_lfo_to_pitch * mod_lfo + zone.vib_lfo_to_pitch * _vib_lfo[voice].state + _pitch_offset * 100.0;
+        _cursor[voice].step = SampleCursor::ratio_to_step(_base_step[voice] * exp2(cents / 1200.0));
+
+        // Volume, in dB where -6 dB is half the volume. The volume envelope is applied per frame in mix_voice
+        const float gain = static_cast<float>(exp2(zone.mod_lfo_to_volume * mod_lfo / 6.0));
+        _target_gain_left[voice] = _base_gain_left[voice] * gain;
+        _target_gain_right[voice] = _base_gain_right[voice] * gain;
+
+        // Filter coefficients
+        LowPassFilter filter = zone.filter;
+        filter.cutoff *= static_cast<float>(exp2((zone.mod_env_to_filter * mod_env + zone.mod_lfo_to_filter * mod_lfo) / 1200.0));
+        filter.get_coefficients(1.0 / _output_sample_rate, _filter_a[voice], _filter_feedback[voice]);
+    }
+
+    bool VoicePool::resample_window(const u32 voice, float* output, const u32 output_stride, const u32 n_frames) {
+        SampleCursor& cursor = _cursor[voice];
+        const u64 loop_start = static_cast<u64>(cursor.loop_start) << 32;
+        const u64 loop_end = static_cast<u64>(cursor.loop_end) << 32;
+        auto wrap = [&](const u64 position) { return cursor.loop_enable && position >= loop_end ? loop_start + (position - loop_start) % (loop_end - loop_start) : position; };
+        cursor.position = wrap(cursor.position);
+        if (!cursor.loop_enable && cursor.position >= static_cast<u64>(cursor.end) << 32) {
+            for (u32 frame = 0; frame < n_frames; frame++)
+                output[frame * output_stride] = 0.0f;
+            return false;
+        }
+
+        // Read every frame the kernel can read in this block, up to where the cursor ends up. Frames past the loop end are unrolled,
+        // so the window can be resampled as if it had no loop. Frames before the start or past the end of the sample are silence
+        const i64 first = static_cast<i64>(cursor.position >> 32) - max_kernel_left;
+        const i64 last = static_cast<i64>((cursor.position + cursor.step * n_frames) >> 32) + max_kernel_right + 1;
+        if (_decode_window.size() < static_cast<size_t>(last - first))
+            _decode_window.resize(static_cast<size_t>(last - first));
+        i16* destination = _decode_window.data();
+        for (i64 index = first; index < last;) {
+            i64 source = index;
+            i64 n_read = last - index;
+            if (cursor.loop_enable && index >= cursor.loop_end)
+                source = cursor.loop_start + (index - cursor.loop_end) % (cursor.loop_end - cursor.loop_start);
+            if (cursor.loop_enable)
+                n_read = std::min<i64>(n_read, cursor.loop_end - source);
+            if (source < 0)
+                n_read = std::min<i64>(n_read, -source);
+            else if (source < cursor.end)
+                n_read = std::min<i64>(n_read, cursor.end - source);
+            if (source < 0 || source >= cursor.end)
+                std::fill_n(destination, n_read, static_cast<i16>(0));
+            else if (_compressed[voice])
+                _compressed[voice]->read(_sample_index[voice], static_cast<u32>(source), destination, static_cast<u32>(n_read));
+            else
+                read_streamed(voice, static_cast<u32>(source), destination, static_cast<u32>(n_read));
+            destination += n_read;
+            index += n_read;
+        }
+
+        // Resample the window, then move the cursor ahead by the same amount
+        SampleCursor window;
+        window.data = _decode_window.data();
+        window.position = cursor.position - (static_cast<u64>(first) << 32);
+        window.step = cursor.step;
+        window.end = static_cast<u32>(last - first);
+        const u64 window_start = window.position;
+        resample(_interpolation[voice], window, output, output_stride, n_frames);
+        cursor.position = wrap(cursor.position + (window.position - window_start));
+        return cursor.loop_enable || cursor.position < static_cast<u64>(cursor.end) << 32;
+    }
+
+    void VoicePool::read_streamed(const u32 voice, u32 first_frame, i16* destination, u32 n_frames) {
+        StreamState& state = _stream[voice];
+        const Sample& sample = *state.sample;
+        const bool has_loop = sample.loop_start < sample.loop_end && sample.loop_end <= sample.length;
+        constexpr u32 tail_frames = StreamState::tail_frames;
+        while (n_frames > 0) {
+            u32 n_read = n_frames;
+            if (first_frame < sample.resident_length) {
+                n_read = std::min(n_read, sample.resident_length - first_frame);
+                std::copy_n(sample.data + first_frame, n_read, destination);
+            }
+            else if (first_frame >= state.stream_start && first_frame < state.stream_end) {
+                n_read = std::min(n_read, state.stream_end - first_frame);
+                u32 n_filled = 0;
+                if (first_frame < state.next_frame) {
+                    // Read again by this block, these are in the tail unless the cursor went back further than a kernel
+                    n_read = std::min(n_read, state.next_frame - first_frame);
+                    if (state.next_frame - first_frame <= tail_frames) {
+                        std::copy_n(state.tail + tail_frames - (state.next_frame - first_frame), n_read, destination);
+                        n_filled = n_read;
+                    }
+                }
+                else {
+                    // Skip what an earlier block didn't get in time, so the stream stays in step with the cursor
+                    while (state.next_frame < first_frame) {
+                        i16 skipped[64];
+                        const u32 n_skip = std::min(64u, first_frame - state.next_frame);
+                        if (pull_stream(voice, skipped, n_skip) < n_skip)
+                            break;
+                    }
+                    if (state.next_frame == first_frame)
+                        n_filled = pull_stream(voice, destination, n_read);
+                }
+
+                // Whatever the stream didn't have yet plays as silence
+                std::fill(destination + n_filled, destination + n_read, static_cast<i16>(0));
+            }
+            else if (has_loop && first_frame >= sample.loop_start && first_frame < sample.loop_end) {
+                n_read = std::min(n_read, sample.loop_end - first_frame);
+                std::copy_n(sample.loop_data + (first_frame - sample.loop_start), n_read, destination);
+            }
+            else {
+                // Nothing to read up to the next part that has data
+                if (first_frame < state.stream_start)
+                    n_read = std::min(n_read, state.stream_start - first_frame);
+                if (has_loop && first_frame < sample.loop_start)
+                    n_read = std::min(n_read, sample.loop_start - first_frame);
+                std::fill_n(destination, n_read, static_cast<i16>(0));
+            }
+            first_frame += n_read;
+            destination += n_read;
+            n_frames -= n_read;
+        }
+    }
+
+    u32 VoicePool::pull_stream(const u32 voice, i16* destination, const u32 n_frames) {
+        StreamState& state = _stream[voice];
+        if (state.stream < 0)
+            return 0;
+        const u32 n_read = state.streamer->read(state.stream, destination, n_frames);
+        state.next_frame += n_read;
+
+        // Keep the last frames for the next block
+        constexpr u32 tail_frames = StreamState::tail_frames;
+        if (n_read >= tail_frames) {
+            std::copy_n(destination + n_read - tail_frames, tail_frames, state.tail);
+        }
+        else {
+            std::copy(state.tail + n_read, state.tail + tail_frames, state.tail);
+            std::copy_n(destination, n_read, state.tail + tail_frames - n_read);
+        }
+
+        // Free the stream for other voices as soon as it's been read entirely
+        if (state.next_frame >= state.stream_end)
+            close_stream(voice);
+        return n_read;
+    }
+
+    void VoicePool::close_stream(const u32 voice) {
+        StreamState& state = _stream[voice];
+        if (state.stream >= 0)
+            state.streamer->close_stream(state.stream);
+        state.stream = -1;
+    }
+
+    void VoicePool::mix_voice(const u32 voice, const float* lane, const u32 lane_stride, float* output_left, float* output_right, const u32 n_frames) {
+        float envelope[control_block_size];
+        _vol_env[voice].render_block(_zone[voice]->vol_env, 1.0 / _output_sample_rate, true, envelope, n_frames);
+
+        // Pan and mix, ramping the gain to the target gain
+        float gain_left = _gain_left[voice];
+        float gain_right = _gain_right[voice];
+        const float gain_step_left = (_target_gain_left[voice] - gain_left) / static_cast<float>(n_frames);
+        const float gain_step_right = (_target_gain_right[voice] - gain_right) / static_cast<float>(n_frames);
+        for (u32 i = 0; i < n_frames; i++) {
+            gain_left += gain_step_left;
+            gain_right += gain_step_right;
+            const float sample = lane[i * lane_stride] * envelope[i];
+            output_left[i] += sample * gain_left;
+            output_right[i] += sample * gain_right;
+        }
+        _gain_left[voice] = _target_gain_left[voice];
+        _gain_right[voice] = _target_gain_right[voice];
+    }
+
+    void VoicePool::free_voice(const u32 voice) {
+        close_stream(voice);
+
+        // Move the last active voice into this slot, so the active voices stay packed
+        const u32 last = --_n_active;
+        if (voice == last)
+            return;
+        auto move_last = [voice, last](auto&... arrays) { ((arrays[voice] = arrays[last]), ...); };
+        move_last(_cursor, _base_step, _interpolation, _compressed, _sample_index, _stream);
+        move_last(_zone, _vol_env, _mod_env, _vib_lfo, _mod_lfo);
+        move_last(_base_gain_left, _base_gain_right, _gain_left, _gain_right, _target_gain_left, _target_gain_right);
+        move_last(_filter_a, _filter_feedback, _filter_state1, _filter_state2, _tag);
+    }
+}
@@ -0,0 +1,115 @@
+#pragma once
+#include <vector>
+#include "interpolation.h"
+#include "soundfont.h"
+#include "soundfont_stack.h"
+
+namespace Flan {
+    // Fixed capacity pool of playing voices, stored as a structure of arrays so a block of frames can be rendered for all voices at once.
+    // Active voices are always packed at the start of the arrays, so rendering never has to skip over free slots.
+    // The volume envelope is rendered for every frame. The modulation envelope, LFOs and filter coefficients are updated once every
+    // control_block_size frames, and the gain is ramped in between. Samples of soundfonts loaded with compress_samples are decoded
+    // every control block, only the frames the voice reads in that block. Samples of soundfonts loaded with stream_samples are read
+    // the same way, from the part in memory, the loop copy, and a stream that the voice opens when it starts.
+    class VoicePool {
+    public:
+        static constexpr u32 control_block_size = 32;
+        static constexpr u32 filter_lanes = 16; // Number of voices that are filtered at the same time
+
+        VoicePool(u32 capacity, float output_sample_rate);
+        VoicePool(const VoicePool&) = delete;
+        VoicePool& operator=(const VoicePool&) = delete;
+        ~VoicePool() { stop_all(); }
+
+        // Start a voice for a zone. The tag can be anything, and is used to release the voice later (e.g. MIDI channel and key).
+        // Returns false if the pool is full, the zone's sample has no data, or it needs a stream and every stream is in use.
+        bool start_voice(const Soundfont& soundfont, const Zone& zone, u8 key, u8 velocity, u32 tag, Interpolation interpolation = Interpolation::linear);
+
+        // Start a voice for every zone in a preset that plays at this key and velocity, returns the number of voices started
+        u32 note_on(Soundfont& soundfont, u16 preset_id, u8 key, u8 velocity, u32 tag, Interpolation interpolation = Interpolation::linear);
+
+        // Same as above, with a preset that was already looked up in the soundfont, so it doesn't need the soundfont's lock
+        u32 note_on(const Soundfont& soundfont, const Preset& preset, u8 key, u8 velocity, u32 tag, Interpolation interpolation = Interpolation::linear);
+
+        // Same as above, with the preset looked up in a stack of soundfonts
+        u32 note_on(SoundfontStack& stack, u16 preset_id, u8 key, u8 velocity, u32 tag, Interpolation interpolation = Interpolation::linear);
+
+        // Move all voices with this tag to their release stage
+        void release(u32 tag);
+        void release_all();
+
+        // Stop all voices immediately
+        void stop_all();
+
+        // Shift the pitch of every voice, for example for MIDI pitch bend. Takes effect at the start of the next control block
+        void set_pitch_offset(const f64 semitones) { _pitch_offset = semitones; }
+
+        // Render n_frames frames of all voices, and add them to the output buffers
+        void render(float* output_left, float* output_right, u32 n_frames);
+
+        [[nodiscard]] u32 active_voices() const { return _n_active; }
+        [[nodiscard]] u32 capacity() const { return _capacity; }
+
+    private:
+        void update_controls(u32 voice, u32 n_frames);
+        bool resample_window(u32 voice, float* output, u32 output_stride, u32 n_frames);
+        void read_streamed(u32 voice, u32 first_frame, i16* destination, u32 n_frames);
+        u32 pull_stream(u32 voice, i16* destination, u32 n_frames);
+        void close_stream(u32 voice);
+        void mix_voice(u32 voice, const float* lane, u32 lane_stride, float* output_left, float* output_right, u32 n_frames);
+        void free_voice(u32 voice);
+
+        u32 _capacity = 0;
+        u32 _n_active = 0;
+        float _output_sample_rate = 44100.0f;
+        f64 _pitch_offset = 0.0; // In semitones
+
+        // Playback position
+        std::vector<SampleCursor> _cursor;   // The cursor's step includes pitch modulation
+        std::vector<f64> _base_step;         // Position increment per frame without pitch modulation
+        std::vector<Interpolation> _interpolation;
+        std::vector<CompressedSamples*> _compressed; // Set if the voice's sample is only in CompressedSamples, data in _cursor is nullptr then
+        std::vector<u32> _sample_index;
+        std::vector<i16> _decode_window;             // Frames of a compressed or streamed sample that the current block reads, with the loop unrolled
+
+        // The frames of a streamed sample past resident_length come from a stream, which can only move forward. The loop is read from
+        // loop_data instead, so a looping voice only streams up to its loop
+        struct StreamState {
+            const Sample* sample = nullptr;     // Set if the voice's sample is streamed, data in _cursor is nullptr then
+            SampleStreamer* streamer = nullptr;
+            i32 stream = -1;                    // -1 once every frame up to stream_end was read
+            u32 stream_start = 0;               // Frames from stream_start up to stream_end come from the stream
+            u32 stream_end = 0;
+            u32 next_frame = 0;                 // The frame the stream delivers next
+            static constexpr u32 tail_frames = max_kernel_left + max_kernel_right + 1;
+            i16 tail[tail_frames]{};            // The frames right before next_frame, the next block reads these again
+        };
+        std::vector<StreamState> _stream;
+
+        // Modulation
+        std::vector<const Zone*> _zone;
+        std::vector<EnvState> _vol_env;
+        std::vector<EnvState> _mod_env;
+        std::vector<LfoState> _vib_lfo;
+        std::vector<LfoState> _mod_lfo;
+
+        // Gain, ramped from the current gain to the target gain over every control block
+        std::vector<f32> _base_gain_left;    // Velocity, attenuation and panning
+        std::vector<f32> _base_gain_right;
+        std::vector<f32> _gain_left;
+        std::vector<f32> _gain_right;
+        std::vector<f32> _target_gain_left;
+        std::vector<f32> _target_gain_right;
+
+        // Low pass filter, the same one as LowPassFilter. Voices are mono until they're panned, so it's applied before the gain.
+        // Voices are resampled into lanes, filtered together with lowpass_filter_lanes, then mixed from the lanes
+        std::vector<f32> _filter_a;
+        std::vector<f32> _filter_feedback;
+        std::vector<f32> _filter_state1;
+        std::vector<f32> _filter_state2;
+        std::vector<f32> _lanes;             // control_block_size frames of filter_lanes voices, interleaved by voice
+
+        std::vector<u32> _tag;
+        std::vector<u8> _playing;            // False once a voice reached the end of its sample during the current block
+    };
+}
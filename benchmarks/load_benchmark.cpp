@@ -0,0 +1,316 @@
+// Times loading every .sf2 and .dls file in a corpus, phase by phase using Soundfont::load_report(), and reports the throughput, bytes read,
+// peak memory usage and allocations of each phase. Every file is loaded once more before the timed repeats, to measure the peak memory usage
+// of each phase without slowing down the timed loads.
+// Usage: load_benchmark [--repeat n] [--threads n] [--mmap] [--lazy] <file or folder>...
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <new>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "riff_tree.h"
+#include "soundfont.h"
+
+// Count every allocation made through operator new, the load report reads these through LoadSettings::allocation_counter and adds the
+// library's own mallocs to them
+static std::atomic<u64> n_allocations{0};
+static std::atomic<u64> n_allocated_bytes{0};
+
+static void* counted_alloc(size_t size, const size_t alignment) {
+    n_allocations.fetch_add(1, std::memory_order_relaxed);
+    n_allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (size == 0) size = 1;
+#ifdef _WIN32
+    void* pointer = alignment > alignof(std::max_align_t) ? _aligned_malloc(size, alignment) : malloc(size);
+#else
+    void* pointer = alignment > alignof(std::max_align_t) ? std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment) : malloc(size);
+#endif
+    if (!pointer) throw std::bad_alloc();
+    return pointer;
+}
+
+static void counted_free(void* pointer, const size_t alignment) noexcept {
+#ifdef _WIN32
+    if (alignment > alignof(std::max_align_t)) {
+        _aligned_free(pointer);
+        return;
+    }
+#endif
+    (void)alignment;
+    free(pointer);
+}
+
+void* operator new(const size_t size) { return counted_alloc(size, alignof(std::max_align_t)); }
+void* operator new(const size_t size, const std::align_val_t alignment) { return counted_alloc(size, static_cast<size_t>(alignment)); }
+void operator delete(void* pointer) noexcept { counted_free(pointer, alignof(std::max_align_t)); }
+void operator delete(void* pointer, size_t) noexcept { counted_free(pointer, alignof(std::max_align_t)); }
+void operator delete(void* pointer, const std::align_val_t alignment) noexcept { counted_free(pointer, static_cast<size_t>(alignment)); }
+void operator delete(void* pointer, size_t, const std::align_val_t alignment) noexcept { counted_free(pointer, static_cast<size_t>(alignment)); }
+
+// Start measuring the peak memory usage from the current memory usage. Only Linux can do this, elsewhere the peak is since the program started
+static void reset_peak_rss() {
+#ifdef __linux__
+    FILE* file = fopen("/proc/self/clear_refs", "w");
+    if (file) {
+        fputs("5", file);
+        fclose(file);
+    }
+#endif
+}
+
+// Peak resident memory in bytes
+static u64 peak_rss() {
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters{};
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return counters.PeakWorkingSetSize;
+    return 0;
+#else
+#ifdef __linux__
+    // VmHWM is reset by reset_peak_rss(), ru_maxrss isn't
+    FILE* file = fopen("/proc/self/status", "r");
+    if (file) {
+        char line[256];
+        u64 kilobytes = 0;
+        while (fgets(line, sizeof(line), file)) {
+            if (strncmp(line, "VmHWM:", 6) == 0) {
+                kilobytes = strtoull(line + 6, nullptr, 10);
+                break;
+            }
+        }
+        fclose(file);
+        if (kilobytes > 0)
+            return kilobytes * 1024;
+    }
+#endif
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return static_cast<u64>(usage.ru_maxrss);
+#else
+    return static_cast<u64>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+// The load report samples this at every phase boundary, through LoadSettings::peak_memory_counter
+static u64 phase_peak_rss() {
+    const u64 peak = peak_rss();
+    reset_peak_rss();
+    return peak;
+}
+
+// Rows of the results: RiffTree::from_file on its own, then every phase of a full load from its LoadReport, then the whole load
+static constexpr int riff_tree_row = 0;
+static constexpr int first_phase_row = 1;
+static constexpr int total_row = first_phase_row + static_cast<int>(Flan::LoadPhase::count);
+static constexpr int n_rows = total_row + 1;
+
+struct PhaseResult {
+    f64 seconds = 0.0;     // Fastest of the timed repeats
+    u64 bytes_read = 0;
+    u64 peak_rss = 0;      // Of the memory pass
+    u64 allocations = 0;   // Of the last repeat
+    u64 allocated_bytes = 0;
+};
+
+static void count_allocations(u64& allocations, u64& allocated_bytes) {
+    allocations = n_allocations.load();
+    allocated_bytes = n_allocated_bytes.load();
+}
+
+// Allocations through operator new and the library's own mallocs together
+static void count_all_allocations(u64& allocations, u64& allocated_bytes) {
+    Flan::library_allocations(allocations, allocated_bytes);
+    allocations += n_allocations.load();
+    allocated_bytes += n_allocated_bytes.load();
+}
+
+// Repeat 0 is the memory pass, which samples the peak memory usage at every phase boundary. That takes a while, so it isn't timed
+template <typename Function>
+static void measure(PhaseResult& result, const u32 repeat, Function&& function) {
+    reset_peak_rss();
+    u64 allocations_before = 0;
+    u64 allocated_bytes_before = 0;
+    count_all_allocations(allocations_before, allocated_bytes_before);
+    const auto start = std::chrono::steady_clock::now();
+    function();
+    const f64 seconds = std::chrono::duration<f64>(std::chrono::steady_clock::now() - start).count();
+    if (repeat == 0)
+        result.peak_rss = peak_rss();
+    else
+        result.seconds = repeat == 1 ? seconds : std::min(result.seconds, seconds);
+    u64 allocations_after = 0;
+    u64 allocated_bytes_after = 0;
+    count_all_allocations(allocations_after, allocated_bytes_after);
+    result.allocations = allocations_after - allocations_before;
+    result.allocated_bytes = allocated_bytes_after - allocated_bytes_before;
+}
+
+static std::string lowercase_extension(const std::filesystem::path& path) {
+    std::string extension = path.extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](const char c) { return static_cast<char>(tolower(c)); });
+    return extension;
+}
+
+static bool is_soundfont(const std::filesystem::path& path) {
+    const std::string extension = lowercase_extension(path);
+    return extension == ".sf2" || extension == ".dls";
+}
+
+static bool load(Flan::Soundfont& soundfont, const std::filesystem::path& path, const Flan::LoadSettings& settings) {
+    if (lowercase_extension(path) == ".sf2")
+        return soundfont.from_sf2(path.string(), settings);
+    return soundfont.from_dls(path.string(), settings);
+}
+
+static const char* row_name(const int row) {
+    if (row == riff_tree_row) return "riff tree";
+    if (row == total_row) return "total";
+    return Flan::LoadReport::phase_name(static_cast<Flan::LoadPhase>(row - first_phase_row));
+}
+
+static void print_header() {
+    printf("  %-18s %10s %10s %10s %13s %12s %14s\n", "phase", "time (ms)", "read (MB)", "MB/s", "peak RSS (MB)", "allocations", "allocated (MB)");
+}
+
+static void print_row(const int row, const PhaseResult& result) {
+    // Phases that didn't run are left out
+    if (row != riff_tree_row && row != total_row && result.seconds <= 0.0)
+        return;
+    char throughput[32] = "-";
+    if (result.bytes_read > 0)
+        snprintf(throughput, sizeof(throughput), "%.1f", static_cast<f64>(result.bytes_read) / (1 << 20) / std::max(result.seconds, 1e-9));
+    char peak_rss[32] = "-";
+    if (result.peak_rss > 0)
+        snprintf(peak_rss, sizeof(peak_rss), "%.1f", static_cast<f64>(result.peak_rss) / (1 << 20));
+    printf("  %-18s %10.3f %10.2f %10s %13s %12llu %14.2f\n", row_name(row), result.seconds * 1000.0, static_cast<f64>(result.bytes_read) / (1 << 20),
+        throughput, peak_rss, static_cast<unsigned long long>(result.allocations), static_cast<f64>(result.allocated_bytes) / (1 << 20));
+}
+
+int main(const int argc, char** argv) {
+    u32 n_repeats = 3;
+    Flan::LoadSettings settings;
+    std::vector<std::filesystem::path> corpus;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+            n_repeats = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            settings.n_threads = static_cast<u32>(atoi(argv[++i]));
+        else if (strcmp(argv[i], "--mmap") == 0)
+            settings.memory_map = true;
+        else if (strcmp(argv[i], "--lazy") == 0)
+            settings.lazy_presets = true;
+        else if (std::filesystem::is_directory(argv[i])) {
+            for (const auto& entry : std::filesystem::recursive_directory_iterator(argv[i])) {
+                if (entry.is_regular_file() && is_soundfont(entry.path()))
+                    corpus.push_back(entry.path());
+            }
+        }
+        else if (std::filesystem::is_regular_file(argv[i]))
+            corpus.push_back(argv[i]);
+        else
+            printf("[WARNING] Skipping '%s', it's not a file or folder\n", argv[i]);
+    }
+    if (corpus.empty()) {
+        printf("Usage: load_benchmark [--repeat n] [--threads n] [--mmap] [--lazy] <file or folder>...\n");
+        printf("Loads every .sf2 and .dls file in the corpus n times (3 by default), and reports the fastest time of each phase\n");
+        printf("Each file is loaded once more beforehand to measure the peak memory usage of each phase\n");
+        return 1;
+    }
+    std::sort(corpus.begin(), corpus.end());
+
+    settings.collect_report = true;
+    settings.allocation_counter = count_allocations;
+
+    PhaseResult totals[n_rows];
+    u64 total_size = 0;
+    int n_failed = 0;
+    for (const auto& path : corpus) {
+        const u64 file_size = std::filesystem::file_size(path);
+        PhaseResult results[n_rows];
+        Flan::LoadReport report;
+        bool ok = true;
+        for (u32 repeat = 0; repeat <= n_repeats && ok; repeat++) {
+            const bool memory_pass = repeat == 0;
+            settings.peak_memory_counter = memory_pass ? phase_peak_rss : nullptr;
+
+            measure(results[riff_tree_row], repeat, [&] {
+                Flan::RiffTree riff_tree;
+                if (riff_tree.from_file(path.string()))
+                    results[riff_tree_row].bytes_read = riff_tree.bytes_read();
+                else
+                    ok = false;
+            });
+
+            // With lazy presets, build all of them afterwards so they still show up in the report
+            Flan::Soundfont soundfont;
+            measure(results[total_row], repeat, [&] {
+                ok &= load(soundfont, path, settings);
+                if (settings.lazy_presets) {
+                    for (const u16 preset_id : soundfont.preset_ids())
+                        ok &= soundfont.get_preset(preset_id) != nullptr;
+                }
+            });
+            // The report restarts the peak at every phase boundary, so the whole load peaked at the highest of the phases or whatever came after them
+            report = soundfont.load_report();
+            results[total_row].bytes_read = report.total().bytes_read;
+            if (memory_pass)
+                results[total_row].peak_rss = std::max(results[total_row].peak_rss, report.total().peak_memory);
+            for (int phase = 0; phase < static_cast<int>(Flan::LoadPhase::count); phase++) {
+                const Flan::LoadReport::Phase& phase_report = report[static_cast<Flan::LoadPhase>(phase)];
+                PhaseResult& result = results[first_phase_row + phase];
+                if (memory_pass)
+                    result.peak_rss = phase_report.peak_memory;
+                else
+                    result.seconds = repeat == 1 ? phase_report.seconds : std::min(result.seconds, phase_report.seconds);
+                result.bytes_read = phase_report.bytes_read;
+                result.allocations = phase_report.n_allocations;
+                result.allocated_bytes = phase_report.allocated_bytes;
+            }
+        }
+        if (!ok) {
+            printf("[ERROR] Could not load '%s'\n\n", path.string().c_str());
+            n_failed++;
+            continue;
+        }
+
+        printf("%s (%.2f MB, %llu presets, %llu zones, %llu samples", path.string().c_str(), static_cast<f64>(file_size) / (1 << 20),
+            static_cast<unsigned long long>(report.n_presets), static_cast<unsigned long long>(report.n_zones), static_cast<unsigned long long>(report.n_samples));
+        if (report.n_unknown_generators > 0)
+            printf(", %llu unknown generators", static_cast<unsigned long long>(report.n_unknown_generators));
+        if (report.n_unknown_articulators > 0)
+            printf(", %llu unknown articulators", static_cast<unsigned long long>(report.n_unknown_articulators));
+        printf(")\n");
+        print_header();
+        for (int row = 0; row < n_rows; row++) {
+            print_row(row, results[row]);
+            totals[row].seconds += results[row].seconds;
+            totals[row].bytes_read += results[row].bytes_read;
+            totals[row].peak_rss = std::max(totals[row].peak_rss, results[row].peak_rss);
+            totals[row].allocations += results[row].allocations;
+            totals[row].allocated_bytes += results[row].allocated_bytes;
+        }
+        printf("\n");
+        total_size += file_size;
+    }
+
+    printf("Total (%zu files, %.2f MB, %i failed)\n", corpus.size() - n_failed, static_cast<f64>(total_size) / (1 << 20), n_failed);
+    print_header();
+    for (int row = 0; row < n_rows; row++)
+        print_row(row, totals[row]);
+    return n_failed > 0 ? 1 : 0;
+}
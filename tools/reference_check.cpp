@@ -0,0 +1,385 @@
+// Compares the library against the simpler code it replaced, to check that the optimized versions still give the same results:
+//  - SF2 zones resolved with GeneratorValues, against the string-keyed generator maps the loader used before them. Every file is loaded
+//    in the default, memory mapped and lazy preset modes
+//  - lowpass_filter_lanes, against LowPassFilter::update on one voice at a time
+// Files from soundfont_generator with --preset-generators have global zones and preset generators, so every way of layering zones is covered.
+// Usage: reference_check <file.sf2>...
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "envs_lfos.h"
+#include "riff_tree.h"
+#include "soundfont.h"
+
+namespace {
+    using GeneratorMap = std::map<std::string, Flan::GenAmountType>;
+
+    // The pdta tables of an .sf2 file, read without the loader
+    struct Sf2Tables {
+        std::vector<Flan::SfPresetHeader> preset_headers;
+        std::vector<Flan::SfBag> preset_bags;
+        std::vector<Flan::sfGenList> preset_gens;
+        std::vector<Flan::sfInst> instruments;
+        std::vector<Flan::SfBag> instr_bags;
+        std::vector<Flan::sfGenList> instr_gens;
+        std::vector<Flan::sfSample> sample_headers;
+    };
+
+    template <typename T>
+    bool read_table(Flan::RiffTree& riff_tree, const Flan::RiffNode* pdta, const char (&id)[5], std::vector<T>& table) {
+        const Flan::RiffNode* node = riff_tree.find(pdta, id);
+        if (!node || !node->data)
+            return false;
+        table.resize(node->size / sizeof(T));
+        memcpy(table.data(), node->data, table.size() * sizeof(T));
+        return !table.empty();
+    }
+
+    bool read_tables(const std::string& path, Sf2Tables& tables) {
+        Flan::RiffTree riff_tree;
+        if (!riff_tree.from_file(path))
+            return false;
+        const Flan::RiffNode* pdta = riff_tree.find(&riff_tree.root(), "pdta");
+        return read_table(riff_tree, pdta, "phdr", tables.preset_headers) && read_table(riff_tree, pdta, "pbag", tables.preset_bags) &&
+            read_table(riff_tree, pdta, "pgen", tables.preset_gens) && read_table(riff_tree, pdta, "inst", tables.instruments) &&
+            read_table(riff_tree, pdta, "ibag", tables.instr_bags) && read_table(riff_tree, pdta, "igen", tables.instr_gens) &&
+            read_table(riff_tree, pdta, "shdr", tables.sample_headers);
+    }
+
+    void init_default_zone(GeneratorMap& zone) {
+        // Zero initialize everything
+        for (const std::string& name : Flan::SFGenerator_names)
+            zone[name].u_amount = 0x0000;
+
+        // Handle non zero values
+        zone["initialFilterFc"].s_amount = 13500;
+        zone["delayModLFO"].s_amount = -12000;
+        zone["delayVibLFO"].s_amount = -12000;
+        zone["delayModEnv"].s_amount = -12000;
+        zone["attackModEnv"].s_amount = -12000;
+        zone["holdModEnv"].s_amount = -12000;
+        zone["decayModEnv"].s_amount = -12000;
+        zone["releaseModEnv"].s_amount = -12000;
+        zone["delayVolEnv"].s_amount = -12000;
+        zone["attackVolEnv"].s_amount = -12000;
+        zone["holdVolEnv"].s_amount = -12000;
+        zone["decayVolEnv"].s_amount = -12000;
+        zone["releaseVolEnv"].s_amount = -12000;
+        zone["keyRange"].ranges = { 0, 127 };
+        zone["velRange"].ranges = { 0, 127 };
+        zone["keynum"].s_amount = -1;
+        zone["velocity"].s_amount = -1;
+        zone["scaleTuning"].u_amount = 100;
+        zone["overridingRootKey"].s_amount = -1;
+        zone["initialAttenuation"].u_amount = 0;
+    }
+
+    GeneratorMap read_generators(const std::vector<Flan::sfGenList>& gens, const u16 start, const u16 end) {
+        GeneratorMap zone;
+        for (u16 i = start; i < end; i++) {
+            if (gens[i].oper < Flan::endOper)
+                zone[Flan::SFGenerator_names[gens[i].oper]] = gens[i].amount;
+        }
+        return zone;
+    }
+
+    // Converts the generators of a final zone the same way the loader does
+    Flan::Zone zone_from_generators(GeneratorMap& gens, const Flan::sfSample& sample, const Flan::sfInst& instrument) {
+        Flan::Zone zone {
+            gens["keyRange"].ranges.low,
+            gens["keyRange"].ranges.high,
+            gens["velRange"].ranges.low,
+            gens["velRange"].ranges.high,
+            gens["sampleID"].u_amount,
+            gens["startAddrsOffset"].s_amount + gens["startAddrsCoarseOffset"].s_amount * 32768,
+            gens["endAddrsOffset"].s_amount + gens["startAddrsCoarseOffset"].s_amount * 32768,
+            gens["startloopAddrsOffset"].s_amount + gens["startAddrsCoarseOffset"].s_amount * 32768,
+            gens["endloopAddrsOffset"].s_amount + gens["startAddrsCoarseOffset"].s_amount * 32768,
+            sample.original_key - gens["overridingRootKey"].s_amount,
+            gens["sampleModes"].u_amount % 2 == 1,
+            static_cast<u8>(gens["keynum"].u_amount),
+            static_cast<u8>(gens["velocity"].u_amount),
+            static_cast<double>(gens["pan"].s_amount) / 500.0,
+            Flan::EnvParams {
+                1.0 / pow(2.0, static_cast<double>(gens["delayVolEnv"].s_amount) / 1200.0),
+                1.0 / pow(2.0, static_cast<double>(gens["attackVolEnv"].s_amount) / 1200.0),
+                1.0 / pow(2.0, static_cast<double>(gens["holdVolEnv"].s_amount) / 1200.0),
+                100.0 / pow(2.0, static_cast<double>(gens["decayVolEnv"].s_amount) / 1200.0),
+                0.0 - static_cast<double>(gens["sustainVolEnv"].u_amount) / 10.0,
+                100.0 / pow(2.0, static_cast<double>(gens["releaseVolEnv"].s_amount) / 1200.0),
+            },
+            Flan::EnvParams {
+                1.0 / pow(2.0, static_cast<double>(gens["delayModEnv"].s_amount) / 1200.0),
+                1.0 / pow(2.0, static_cast<double>(gens["attackModEnv"].s_amount) / 1200.0),
+                1.0 / pow(2.0, static_cast<double>(gens["holdModEnv"].s_amount) / 1200.0),
+                100.0 / pow(2.0, static_cast<double>(gens["decayModEnv"].s_amount) / 1200.0),
+                0.0 - static_cast<double>(gens["sustainModEnv"].u_amount) / 10.0,
+                100.0 / pow(2.0, static_cast<double>(gens["releaseModEnv"].s_amount) / 1200.0),
+            },
+            Flan::LfoParams {
+                8.176 * pow(2.0, static_cast<double>(gens["freqVibLFO"].s_amount) / 1200.0),
+                pow(2.0, static_cast<double>(gens["delayVibLFO"].s_amount) / 1200.0),
+            },
+            Flan::LfoParams {
+                8.176 * pow(2.0, static_cast<double>(gens["freqModLFO"].s_amount) / 1200.0),
+                pow(2.0, static_cast<double>(gens["delayModLFO"].s_amount) / 1200.0),
+            },
+            Flan::LowPassFilter {
+                8.176f * powf(2.0f, static_cast<float>(gens["initialFilterFc"].s_amount) / 1200.0f),
+                powf(2, static_cast<float>(gens["initialFilterQ"].s_amount) / 150.0f),
+            },
+            static_cast<double>(gens["modEnvToPitch"].s_amount),
+            static_cast<double>(gens["modEnvToFilterFc"].s_amount),
+            static_cast<double>(gens["modLfoToPitch"].s_amount),
+            static_cast<double>(gens["modLfoToFilterFc"].s_amount),
+            static_cast<double>(gens["modLfoToVolume"].s_amount) / 10.0,
+            static_cast<double>(gens["vibLfoToPitch"].s_amount),
+            static_cast<double>(gens["keynumToVolEnvHold"].s_amount),
+            static_cast<double>(gens["keynumToVolEnvDecay"].s_amount),
+            static_cast<double>(gens["keynumToModEnvHold"].s_amount),
+            static_cast<double>(gens["keynumToModEnvDecay"].s_amount),
+            static_cast<double>(gens["scaleTuning"].s_amount) / 100.0,
+            static_cast<double>(gens["coarseTune"].s_amount) + static_cast<double>(gens["fineTune"].s_amount) / 100.0,
+            static_cast<double>(gens["initialAttenuation"].s_amount) / 10.0,
+            "",
+        };
+        strncpy_s(zone.name, reinterpret_cast<const char*>(instrument.name), sizeof(instrument.name));
+        return zone;
+    }
+
+    // Resolves the zones of a preset by layering generator maps, like the loader did before GeneratorValues
+    std::vector<Flan::Zone> reference_zones(const Sf2Tables& tables, const size_t preset_index) {
+        std::vector<Flan::Zone> zones;
+        GeneratorMap preset_global;
+        GeneratorMap instrument_global;
+        for (u16 preset_zone = tables.preset_headers[preset_index].pbag_index; preset_zone < tables.preset_headers[preset_index + 1].pbag_index; preset_zone++) {
+            GeneratorMap preset_gens = read_generators(tables.preset_gens, tables.preset_bags[preset_zone].generator_index, tables.preset_bags[preset_zone + 1].generator_index);
+            if (!preset_gens.contains("instrument")) {
+                preset_global = preset_gens;
+                continue;
+            }
+            for (const auto& [name, amount] : preset_global)
+                preset_gens.try_emplace(name, amount);
+
+            const u16 instrument_id = preset_gens["instrument"].u_amount;
+            for (u16 instrument_zone = tables.instruments[instrument_id].bag_index; instrument_zone < tables.instruments[instrument_id + 1].bag_index; instrument_zone++) {
+                const GeneratorMap instrument_gens = read_generators(tables.instr_gens, tables.instr_bags[instrument_zone].generator_index, tables.instr_bags[instrument_zone + 1].generator_index);
+                if (!instrument_gens.contains("sampleID")) {
+                    instrument_global = instrument_gens;
+                    continue;
+                }
+
+                // Defaults, then the global and local instrument zone, then the preset zone is added or narrows the ranges
+                GeneratorMap final_gens;
+                init_default_zone(final_gens);
+                for (const auto& [name, amount] : instrument_global)
+                    final_gens[name] = amount;
+                for (const auto& [name, amount] : instrument_gens)
+                    final_gens[name] = amount;
+                for (const auto& [name, amount] : preset_gens) {
+                    int index = -1;
+                    while (Flan::SFGenerator_names[++index] != name) {}
+                    const Flan::GenFlags flags = Flan::gen_flags[index];
+                    if (flags.instr_only)
+                        continue;
+                    if (flags.apply_mode == Flan::add)
+                        final_gens[name].s_amount += amount.s_amount;
+                    else if (flags.apply_mode == Flan::clamp_range) {
+                        final_gens[name].ranges.low = std::max(amount.ranges.low, final_gens[name].ranges.low);
+                        final_gens[name].ranges.high = std::min(amount.ranges.high, final_gens[name].ranges.high);
+                    }
+                }
+
+                const Flan::sfSample& sample = tables.sample_headers[final_gens["sampleID"].u_amount];
+                if (final_gens["overridingRootKey"].s_amount == -1)
+                    final_gens["overridingRootKey"].s_amount = sample.original_key;
+                zones.push_back(zone_from_generators(final_gens, sample, tables.instruments[instrument_id]));
+            }
+        }
+        return zones;
+    }
+
+    // Prints the first few differences, and counts all of them
+    struct Mismatches {
+        u64 count = 0;
+        void check(const char* what, const u16 preset_id, const size_t zone, const double expected, const double actual) {
+            if (expected == actual)
+                return;
+            if (count < 10)
+                printf("  preset %u zone %zu: %s is %g, expected %g\n", preset_id, zone, what, actual, expected);
+            count++;
+        }
+    };
+
+    void compare_envelope(Mismatches& mismatches, const char* what, const u16 preset_id, const size_t zone, const Flan::EnvParams& expected, const Flan::EnvParams& actual) {
+        const std::string name = what;
+        mismatches.check((name + " delay").c_str(), preset_id, zone, expected.delay, actual.delay);
+        mismatches.check((name + " attack").c_str(), preset_id, zone, expected.attack, actual.attack);
+        mismatches.check((name + " hold").c_str(), preset_id, zone, expected.hold, actual.hold);
+        mismatches.check((name + " decay").c_str(), preset_id, zone, expected.decay, actual.decay);
+        mismatches.check((name + " sustain").c_str(), preset_id, zone, expected.sustain, actual.sustain);
+        mismatches.check((name + " release").c_str(), preset_id, zone, expected.release, actual.release);
+    }
+
+    void compare_zone(Mismatches& mismatches, const u16 preset_id, const size_t index, const Flan::Zone& expected, const Flan::Zone& actual) {
+        mismatches.check("key range low", preset_id, index, expected.key_range_low, actual.key_range_low);
+        mismatches.check("key range high", preset_id, index, expected.key_range_high, actual.key_range_high);
+        mismatches.check("velocity range low", preset_id, index, expected.vel_range_low, actual.vel_range_low);
+        mismatches.check("velocity range high", preset_id, index, expected.vel_range_high, actual.vel_range_high);
+        mismatches.check("sample index", preset_id, index, expected.sample_index, actual.sample_index);
+        mismatches.check("sample start offset", preset_id, index, expected.sample_start_offset, actual.sample_start_offset);
+        mismatches.check("sample end offset", preset_id, index, expected.sample_end_offset, actual.sample_end_offset);
+        mismatches.check("loop start offset", preset_id, index, expected.sample_loop_start_offset, actual.sample_loop_start_offset);
+        mismatches.check("loop end offset", preset_id, index, expected.sample_loop_end_offset, actual.sample_loop_end_offset);
+        mismatches.check("root key offset", preset_id, index, expected.root_key_offset, actual.root_key_offset);
+        mismatches.check("loop enable", preset_id, index, expected.loop_enable, actual.loop_enable);
+        mismatches.check("key override", preset_id, index, expected.key_override, actual.key_override);
+        mismatches.check("velocity override", preset_id, index, expected.vel_override, actual.vel_override);
+        mismatches.check("pan", preset_id, index, expected.pan, actual.pan);
+        compare_envelope(mismatches, "volume envelope", preset_id, index, expected.vol_env, actual.vol_env);
+        compare_envelope(mismatches, "modulation envelope", preset_id, index, expected.mod_env, actual.mod_env);
+        mismatches.check("vibrato LFO frequency", preset_id, index, expected.vib_lfo.freq, actual.vib_lfo.freq);
+        mismatches.check("vibrato LFO delay", preset_id, index, expected.vib_lfo.delay, actual.vib_lfo.delay);
+        mismatches.check("modulation LFO frequency", preset_id, index, expected.mod_lfo.freq, actual.mod_lfo.freq);
+        mismatches.check("modulation LFO delay", preset_id, index, expected.mod_lfo.delay, actual.mod_lfo.delay);
+        mismatches.check("filter cutoff", preset_id, index, expected.filter.cutoff, actual.filter.cutoff);
+        mismatches.check("filter resonance", preset_id, index, expected.filter.resonance, actual.filter.resonance);
+        mismatches.check("mod env to pitch", preset_id, index, expected.mod_env_to_pitch, actual.mod_env_to_pitch);
+        mismatches.check("mod env to filter", preset_id, index, expected.mod_env_to_filter, actual.mod_env_to_filter);
+        mismatches.check("mod LFO to pitch", preset_id, index, expected.mod_lfo_to_pitch, actual.mod_lfo_to_pitch);
+        mismatches.check("mod LFO to filter", preset_id, index, expected.mod_lfo_to_filter, actual.mod_lfo_to_filter);
+        mismatches.check("mod LFO to volume", preset_id, index, expected.mod_lfo_to_volume, actual.mod_lfo_to_volume);
+        mismatches.check("vibrato LFO to pitch", preset_id, index, expected.vib_lfo_to_pitch, actual.vib_lfo_to_pitch);
+        mismatches.check("key to vol env hold", preset_id, index, expected.key_to_vol_env_hold, actual.key_to_vol_env_hold);
+        mismatches.check("key to vol env decay", preset_id, index, expected.key_to_vol_env_decay, actual.key_to_vol_env_decay);
+        mismatches.check("key to mod env hold", preset_id, index, expected.key_to_mod_env_hold, actual.key_to_mod_env_hold);
+        mismatches.check("key to mod env decay", preset_id, index, expected.key_to_mod_env_decay, actual.key_to_mod_env_decay);
+        mismatches.check("scale tuning", preset_id, index, expected.scale_tuning, actual.scale_tuning);
+        mismatches.check("tuning", preset_id, index, expected.tuning, actual.tuning);
+        mismatches.check("initial attenuation", preset_id, index, expected.init_attenuation, actual.init_attenuation);
+        if (strcmp(expected.name, actual.name) != 0) {
+            if (mismatches.count < 10)
+                printf("  preset %u zone %zu: name is '%s', expected '%s'\n", preset_id, index, actual.name, expected.name);
+            mismatches.count++;
+        }
+    }
+
+    bool check_zones(const std::string& path) {
+        Sf2Tables tables;
+        if (!read_tables(path, tables)) {
+            printf("[ERROR] Could not read the pdta tables of '%s'\n", path.c_str());
+            return false;
+        }
+
+        // Later presets with the same bank and program replace earlier ones, like in the loader
+        std::map<u16, std::vector<Flan::Zone>> expected;
+        u64 n_zones = 0;
+        for (size_t i = 0; i + 1 < tables.preset_headers.size(); i++) {
+            const u16 preset_id = static_cast<u16>(tables.preset_headers[i].bank << 8 | tables.preset_headers[i].program);
+            expected[preset_id] = reference_zones(tables, i);
+        }
+        for (const auto& [preset_id, zones] : expected)
+            n_zones += zones.size();
+
+        struct Mode {
+            const char* name;
+            Flan::LoadSettings settings;
+        };
+        Mode modes[3] = { { "default", {} }, { "memory mapped", {} }, { "lazy presets", {} } };
+        modes[1].settings.memory_map = true;
+        modes[2].settings.lazy_presets = true;
+
+        bool ok = true;
+        for (const Mode& mode : modes) {
+            Flan::Soundfont soundfont;
+            Mismatches mismatches;
+            if (!soundfont.from_sf2(path, mode.settings)) {
+                printf("[ERROR] Could not load '%s' (%s)\n", path.c_str(), mode.name);
+                ok = false;
+                continue;
+            }
+            if (soundfont.preset_ids().size() != expected.size()) {
+                printf("  %zu presets, expected %zu\n", soundfont.preset_ids().size(), expected.size());
+                mismatches.count++;
+            }
+            for (const auto& [preset_id, zones] : expected) {
+                const Flan::Preset* preset = soundfont.get_preset(preset_id);
+                if (!preset || preset->zones.size() != zones.size()) {
+                    printf("  preset %u: %zu zones, expected %zu\n", preset_id, preset ? preset->zones.size() : 0, zones.size());
+                    mismatches.count++;
+                    continue;
+                }
+                for (size_t i = 0; i < zones.size(); i++)
+                    compare_zone(mismatches, preset_id, i, zones[i], preset->zones[i]);
+            }
+            printf("%s (%s): %zu presets, %llu zones, %llu mismatches\n", path.c_str(), mode.name, expected.size(),
+                static_cast<unsigned long long>(n_zones), static_cast<unsigned long long>(mismatches.count));
+            ok &= mismatches.count == 0;
+        }
+        return ok;
+    }
+
+    // Small deterministic random number generator, so every run checks the same signals
+    struct Random {
+        u32 state = 1;
+        u32 next() {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            return state;
+        }
+        f32 range(const f32 low, const f32 high) { return low + (high - low) * static_cast<f32>(next() >> 8) / static_cast<f32>(1 << 24); }
+    };
+
+    bool check_filter_lanes() {
+        constexpr f64 dt = 1.0 / 44100.0;
+        constexpr u32 n_frames = 512;
+        Random random;
+        u64 n_mismatches = 0;
+
+        // Lane counts that are and aren't multiples of the SSE and AVX widths
+        for (const u32 n_lanes : { 1u, 3u, 4u, 7u, 8u, 13u, 16u }) {
+            std::vector<Flan::LowPassFilter> filters(n_lanes);
+            std::vector<f32> a(n_lanes), feedback(n_lanes), state1(n_lanes), state2(n_lanes);
+            std::vector<f32> samples(static_cast<size_t>(n_frames) * n_lanes);
+            for (u32 lane = 0; lane < n_lanes; lane++) {
+                // Loud inputs and high resonance now and then, so the states get clamped
+                filters[lane].cutoff = random.range(20.0f, 20000.0f);
+                filters[lane].resonance = random.range(0.0f, 2.5f);
+                filters[lane].get_coefficients(dt, a[lane], feedback[lane]);
+                for (u32 frame = 0; frame < n_frames; frame++)
+                    samples[frame * n_lanes + lane] = random.range(-1.0f, 1.0f) * (random.next() % 16 == 0 ? 100.0f : 1.0f);
+            }
+            std::vector<f32> expected = samples;
+            for (u32 lane = 0; lane < n_lanes; lane++) {
+                for (u32 frame = 0; frame < n_frames; frame++) {
+                    f32 right = 0.0f;
+                    filters[lane].update(dt, expected[frame * n_lanes + lane], right);
+                }
+            }
+
+            Flan::lowpass_filter_lanes(samples.data(), n_frames, n_lanes, a.data(), feedback.data(), state1.data(), state2.data());
+            for (size_t i = 0; i < samples.size(); i++)
+                n_mismatches += memcmp(&samples[i], &expected[i], sizeof(f32)) != 0;
+            for (u32 lane = 0; lane < n_lanes; lane++) {
+                n_mismatches += memcmp(&state1[lane], &filters[lane].state1[0], sizeof(f32)) != 0;
+                n_mismatches += memcmp(&state2[lane], &filters[lane].state2[0], sizeof(f32)) != 0;
+            }
+        }
+        printf("lowpass_filter_lanes: %llu mismatches\n", static_cast<unsigned long long>(n_mismatches));
+        return n_mismatches == 0;
+    }
+}
+
+int main(const int argc, char** argv) {
+    bool ok = check_filter_lanes();
+    for (int i = 1; i < argc; i++)
+        ok &= check_zones(argv[i]);
+    if (argc < 2)
+        printf("Usage: reference_check <file.sf2>..., to also compare the zones of .sf2 files\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,601 @@
+// Writes a synthetic .sf2 or .dls file with a configurable shape, to test and benchmark the loaders on soundfonts of any size.
+// The output only depends on the options, so the same command always writes the same file.
+// Usage: soundfont_generator <output.sf2|output.dls> [options], run without arguments to list the options
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "structs.h"
+
+namespace {
+    struct GeneratorSettings {
+        u32 n_presets = 128;
+        u32 n_instruments = 128;
+        u32 n_preset_zones = 1;       // Zones per preset, each one points to an instrument
+        u32 n_zones = 8;              // Zones per instrument, spread over the keyboard
+        u32 n_generators = 8;         // Generators (SF2) or connection blocks (DLS) per instrument zone, on top of the key range and sample
+        u32 n_modulators = 0;         // Modulators per instrument zone, SF2 only
+        u32 n_preset_generators = 0;  // Generators per preset zone, on top of a key range and the instrument. If not 0, every preset and instrument
+                                      // also gets a global zone with this many generators. SF2 only
+        u32 n_samples = 64;
+        u32 sample_frames = 32768;    // Length of each sample
+        u32 wave_bits = 16;           // Bits per sample of the waves, DLS only: 8 (unsigned), 16 or 24
+        u32 wave_channels = 1;        // Channels of the waves, DLS only: 1, or 2 for the same wave in both channels
+        u32 seed = 1;
+    };
+
+    // Small deterministic random number generator, so every platform writes the same file
+    struct Random {
+        u32 state;
+        u32 next() {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            return state;
+        }
+        i32 range(const i32 low, const i32 high) { return low + static_cast<i32>(next() % static_cast<u32>(high - low + 1)); }
+    };
+
+    // Writes RIFF chunks, and fills in the sizes of lists once they're closed
+    class RiffWriter {
+    public:
+        explicit RiffWriter(FILE* file) : _file(file) {}
+
+        void begin_list(const char* type, const char* name) {
+            fwrite(type, 1, 4, _file);
+            _list_starts.push_back(Flan::file_tell(_file));
+            const u32 size = 0;
+            fwrite(&size, sizeof(size), 1, _file);
+            fwrite(name, 1, 4, _file);
+        }
+
+        void end_list() {
+            const u64 end = Flan::file_tell(_file);
+            const u64 start = _list_starts.back();
+            _list_starts.pop_back();
+            const u32 size = static_cast<u32>(end - start - 4);
+            Flan::file_seek(_file, start);
+            fwrite(&size, sizeof(size), 1, _file);
+            Flan::file_seek(_file, end);
+        }
+
+        void chunk_header(const char* id, const u32 size) {
+            fwrite(id, 1, 4, _file);
+            fwrite(&size, sizeof(size), 1, _file);
+        }
+
+        void chunk(const char* id, const void* data, const u32 size) {
+            chunk_header(id, size);
+            fwrite(data, 1, size, _file);
+            pad(size);
+        }
+
+        template <typename T>
+        void chunk(const char* id, const std::vector<T>& data) { chunk(id, data.data(), static_cast<u32>(data.size() * sizeof(T))); }
+
+        // Chunks have to start at even offsets
+        void pad(const u64 size) {
+            if (size % 2 == 1)
+                fputc(0, _file);
+        }
+
+    private:
+        FILE* _file;
+        std::vector<u64> _list_starts;
+    };
+
+    // Sample data: a few harmonics with a bit of noise, which loops cleanly over its last half
+    void generate_sample(std::vector<i16>& data, const u32 sample_index, const u32 n_frames, const u32 seed) {
+        Random random{ seed * 2654435761u + sample_index + 1 };
+        const u32 period = 32 + sample_index % 256;
+        data.resize(n_frames);
+        for (u32 i = 0; i < n_frames; i++) {
+            const f64 phase = 2.0 * 3.14159265358979 * static_cast<f64>(i % period) / period;
+            const f64 value = 0.5 * sin(phase) + 0.2 * sin(phase * 2) + 0.1 * sin(phase * 3) + static_cast<f64>(random.range(-256, 256)) / 32768.0;
+            data[i] = static_cast<i16>(std::clamp(value * 32767.0, -32768.0, 32767.0));
+        }
+    }
+
+    // Store a sample as PCM with a different sample size or number of channels, for DLS waves. 24-bit samples get some made up
+    // lower bits, so they're different from the 16-bit ones
+    void encode_wave(const std::vector<i16>& data, const u32 bits, const u32 n_channels, std::vector<u8>& wave) {
+        const u32 bytes_per_sample = bits / 8;
+        wave.resize(data.size() * bytes_per_sample * n_channels);
+        u8* write = wave.data();
+        for (size_t i = 0; i < data.size(); i++) {
+            for (u32 channel = 0; channel < n_channels; channel++) {
+                if (bits == 8) {
+                    *write++ = static_cast<u8>((data[i] >> 8) + 128);
+                }
+                else if (bits == 16) {
+                    memcpy(write, &data[i], sizeof(i16));
+                    write += sizeof(i16);
+                }
+                else {
+                    *write++ = static_cast<u8>(i * 37);
+                    memcpy(write, &data[i], sizeof(i16));
+                    write += sizeof(i16);
+                }
+            }
+        }
+    }
+
+    // Loops are whole periods at the end of the sample
+    void sample_loop(const u32 sample_index, const u32 n_frames, u32& loop_start, u32& loop_end) {
+        const u32 period = 32 + sample_index % 256;
+        loop_end = n_frames - n_frames % period;
+        loop_start = loop_end >= period * 2 ? loop_end - (loop_end / 2 / period) * period : 0;
+        if (loop_end <= loop_start) {
+            loop_start = 0;
+            loop_end = n_frames;
+        }
+    }
+
+    void preset_number(const u32 preset, u16& bank, u16& program) {
+        bank = static_cast<u16>(preset / 128);
+        program = static_cast<u16>(preset % 128);
+    }
+
+    void zone_key_range(const u32 zone, const u32 n_zones, u8& low, u8& high) {
+        // With more than 128 zones, several zones share a key and play on top of each other
+        low = static_cast<u8>(zone * 128 / n_zones);
+        high = static_cast<u8>(std::max<u32>(low, (zone + 1) * 128 / n_zones - 1));
+    }
+
+    // For the terminal records, the loader looks for these names exactly
+    template <typename T, size_t N>
+    void set_name(T (&name)[N], const char* text) {
+        memset(name, 0, N);
+        memcpy(name, text, std::min(strlen(text), N - 1));
+    }
+
+    // The index is formatted into a buffer that fits any u32, main() limits the counts so that every name fits in the record
+    template <typename T, size_t N>
+    void set_name(T (&name)[N], const char* prefix, const u32 index) {
+        char text[32];
+        snprintf(text, sizeof(text), "%s %u", prefix, index);
+        set_name(name, text);
+    }
+
+    // Generators that are safe to set to random values, with their valid ranges
+    struct GeneratorRange {
+        Flan::SFGenerator oper;
+        i16 low;
+        i16 high;
+    };
+    constexpr GeneratorRange sf2_generators[] = {
+        { Flan::initialFilterFc, 1500, 13500 }, { Flan::initialFilterQ, 0, 960 },     { Flan::pan, -500, 500 },
+        { Flan::attackVolEnv, -12000, 2000 },   { Flan::holdVolEnv, -12000, 2000 },   { Flan::decayVolEnv, -12000, 4000 },
+        { Flan::sustainVolEnv, 0, 1440 },       { Flan::releaseVolEnv, -12000, 4000 }, { Flan::attackModEnv, -12000, 2000 },
+        { Flan::decayModEnv, -12000, 4000 },    { Flan::sustainModEnv, 0, 1000 },     { Flan::modEnvToPitch, -1200, 1200 },
+        { Flan::delayModLFO, -12000, 0 },       { Flan::freqModLFO, -4000, 1000 },    { Flan::modLfoToPitch, -100, 100 },
+        { Flan::modLfoToVolume, -100, 100 },    { Flan::delayVibLFO, -12000, 0 },     { Flan::freqVibLFO, -4000, 1000 },
+        { Flan::vibLfoToPitch, -50, 50 },       { Flan::initialAttenuation, 0, 200 }, { Flan::fineTune, -50, 50 },
+        { Flan::coarseTune, -2, 2 },            { Flan::chorusEffectsSend, 0, 500 },  { Flan::reverbEffectsSend, 0, 500 },
+    };
+
+    Flan::sfGenList generator(const Flan::SFGenerator oper, const i16 amount) {
+        Flan::sfGenList gen{};
+        gen.oper = oper;
+        gen.amount.s_amount = amount;
+        return gen;
+    }
+
+    bool write_sf2(FILE* file, const GeneratorSettings& settings) {
+        RiffWriter riff(file);
+        Random random{ settings.seed };
+        auto random_generators = [&](std::vector<Flan::sfGenList>& gens, const u32 n_generators) {
+            for (u32 g = 0; g < n_generators; g++) {
+                const GeneratorRange& range = sf2_generators[random.next() % std::size(sf2_generators)];
+                gens.push_back(generator(range.oper, static_cast<i16>(random.range(range.low, range.high))));
+            }
+        };
+
+        // Preset and instrument tables, each with the terminal record at the end
+        std::vector<Flan::SfPresetHeader> preset_headers;
+        std::vector<Flan::SfBag> preset_bags;
+        std::vector<Flan::sfGenList> preset_gens;
+        std::vector<Flan::sfModList> preset_mods;
+        for (u32 p = 0; p < settings.n_presets; p++) {
+            Flan::SfPresetHeader header{};
+            set_name(header.preset_name, "Preset", p);
+            preset_number(p, header.bank, header.program);
+            header.pbag_index = static_cast<u16>(preset_bags.size());
+            preset_headers.push_back(header);
+            if (settings.n_preset_generators > 0) {
+                preset_bags.push_back({ static_cast<u16>(preset_gens.size()), static_cast<u16>(preset_mods.size()) });
+                random_generators(preset_gens, settings.n_preset_generators);
+            }
+            for (u32 z = 0; z < settings.n_preset_zones; z++) {
+                preset_bags.push_back({ static_cast<u16>(preset_gens.size()), static_cast<u16>(preset_mods.size()) });
+
+                // The key range has to come first and the instrument last. The key range narrows the instrument zones' key ranges
+                if (settings.n_preset_generators > 0) {
+                    Flan::sfGenList key_range{};
+                    key_range.oper = Flan::keyRange;
+                    key_range.amount.ranges.low = static_cast<u8>(random.range(0, 63));
+                    key_range.amount.ranges.high = static_cast<u8>(random.range(64, 127));
+                    preset_gens.push_back(key_range);
+                    random_generators(preset_gens, settings.n_preset_generators);
+                }
+                preset_gens.push_back(generator(Flan::instrument, static_cast<i16>((p + z) % settings.n_instruments)));
+            }
+        }
+        Flan::SfPresetHeader end_of_presets{};
+        set_name(end_of_presets.preset_name, "EOP");
+        end_of_presets.pbag_index = static_cast<u16>(preset_bags.size());
+        preset_headers.push_back(end_of_presets);
+        preset_bags.push_back({ static_cast<u16>(preset_gens.size()), static_cast<u16>(preset_mods.size()) });
+        preset_gens.push_back({});
+        preset_mods.push_back({});
+
+        std::vector<Flan::sfInst> instruments;
+        std::vector<Flan::SfBag> instr_bags;
+        std::vector<Flan::sfGenList> instr_gens;
+        std::vector<Flan::sfModList> instr_mods;
+        for (u32 i = 0; i < settings.n_instruments; i++) {
+            Flan::sfInst instrument{};
+            set_name(instrument.name, "Instrument", i);
+            instrument.bag_index = static_cast<u16>(instr_bags.size());
+            instruments.push_back(instrument);
+            if (settings.n_preset_generators > 0) {
+                instr_bags.push_back({ static_cast<u16>(instr_gens.size()), static_cast<u16>(instr_mods.size()) });
+                random_generators(instr_gens, settings.n_preset_generators);
+            }
+            for (u32 z = 0; z < settings.n_zones; z++) {
+                instr_bags.push_back({ static_cast<u16>(instr_gens.size()), static_cast<u16>(instr_mods.size()) });
+
+                // The key range has to come first and the sample last
+                Flan::sfGenList key_range{};
+                key_range.oper = Flan::keyRange;
+                zone_key_range(z, settings.n_zones, key_range.amount.ranges.low, key_range.amount.ranges.high);
+                instr_gens.push_back(key_range);
+                random_generators(instr_gens, settings.n_generators);
+                instr_gens.push_back(generator(Flan::sampleModes, 1));
+                instr_gens.push_back(generator(Flan::sampleID, static_cast<i16>((static_cast<u64>(i) * settings.n_zones + z) % settings.n_samples)));
+
+                // Modulators from a random MIDI CC to a random generator
+                for (u32 m = 0; m < settings.n_modulators; m++) {
+                    Flan::sfModList mod{};
+                    mod.src_oper.index = static_cast<u16>(random.range(1, 31));
+                    mod.src_oper.cc_flag = 1;
+                    mod.dest_oper = sf2_generators[random.next() % std::size(sf2_generators)].oper;
+                    mod.amount = static_cast<i16>(random.range(-1000, 1000));
+                    mod.trans_oper = Flan::linear;
+                    instr_mods.push_back(mod);
+                }
+            }
+        }
+        Flan::sfInst end_of_instruments{};
+        set_name(end_of_instruments.name, "EOI");
+        end_of_instruments.bag_index = static_cast<u16>(instr_bags.size());
+        instruments.push_back(end_of_instruments);
+        instr_bags.push_back({ static_cast<u16>(instr_gens.size()), static_cast<u16>(instr_mods.size()) });
+        instr_gens.push_back({});
+        instr_mods.push_back({});
+
+        // Every sample is followed by 46 frames of silence, like the spec asks for
+        constexpr u32 guard_frames = 46;
+        std::vector<Flan::sfSample> sample_headers;
+        u64 n_sample_frames = 0;
+        for (u32 s = 0; s < settings.n_samples; s++) {
+            Flan::sfSample header{};
+            set_name(header.name, "Sample", s);
+            header.start_index = static_cast<u32>(n_sample_frames);
+            header.end_index = static_cast<u32>(n_sample_frames + settings.sample_frames);
+            u32 loop_start, loop_end;
+            sample_loop(s, settings.sample_frames, loop_start, loop_end);
+            header.loop_start_index = header.start_index + loop_start;
+            header.loop_end_index = header.start_index + loop_end;
+            header.sample_rate = 44100;
+            header.original_key = static_cast<u8>(48 + s % 24);
+            header.type = Flan::monoSample;
+            sample_headers.push_back(header);
+            n_sample_frames += settings.sample_frames + guard_frames;
+        }
+        Flan::sfSample end_of_samples{};
+        set_name(end_of_samples.name, "EOS");
+        sample_headers.push_back(end_of_samples);
+
+        // The bag tables point into the generator and modulator tables with 16-bit indices
+        if (preset_bags.size() > 65536 || preset_gens.size() > 65536 || preset_mods.size() > 65536 || instruments.size() > 65536 ||
+            instr_bags.size() > 65536 || instr_gens.size() > 65536 || instr_mods.size() > 65536 || sample_headers.size() > 65536) {
+            printf("[ERROR] Too many zones, generators or modulators for the 16-bit indices in an .sf2 file!\n");
+            return false;
+        }
+        const u64 table_bytes = preset_headers.size() * sizeof(Flan::SfPresetHeader) + (preset_bags.size() + instr_bags.size()) * sizeof(Flan::SfBag) +
+            (preset_gens.size() + instr_gens.size()) * sizeof(Flan::sfGenList) + (preset_mods.size() + instr_mods.size()) * sizeof(Flan::sfModList) +
+            instruments.size() * sizeof(Flan::sfInst) + sample_headers.size() * sizeof(Flan::sfSample);
+        if (n_sample_frames * 2 + table_bytes + 1024 > 0xFFFFFFFFull) {
+            printf("[ERROR] The sample data doesn't fit in a RIFF file!\n");
+            return false;
+        }
+
+        riff.begin_list("RIFF", "sfbk");
+        riff.begin_list("LIST", "INFO");
+        const Flan::SfVersionTag version{ 2, 1 };
+        riff.chunk("ifil", &version, sizeof(version));
+        riff.chunk("isng", "EMU8000", 8);
+        riff.chunk("INAM", "Synthetic soundfont", 20);
+        riff.end_list();
+
+        // Write the samples one by one, they can be too big to keep in memory all at once
+        riff.begin_list("LIST", "sdta");
+        riff.chunk_header("smpl", static_cast<u32>(n_sample_frames * 2));
+        std::vector<i16> data;
+        const std::vector<i16> guard(guard_frames, 0);
+        for (u32 s = 0; s < settings.n_samples; s++) {
+            generate_sample(data, s, settings.sample_frames, settings.seed);
+            fwrite(data.data(), sizeof(i16), data.size(), file);
+            fwrite(guard.data(), sizeof(i16), guard.size(), file);
+        }
+        riff.end_list();
+
+        riff.begin_list("LIST", "pdta");
+        riff.chunk("phdr", preset_headers);
+        riff.chunk("pbag", preset_bags);
+        riff.chunk("pmod", preset_mods);
+        riff.chunk("pgen", preset_gens);
+        riff.chunk("inst", instruments);
+        riff.chunk("ibag", instr_bags);
+        riff.chunk("imod", instr_mods);
+        riff.chunk("igen", instr_gens);
+        riff.chunk("shdr", sample_headers);
+        riff.end_list();
+        riff.end_list();
+        return true;
+    }
+
+    // Connection blocks that are safe to set to random values, with their valid ranges
+    struct ConnectionRange {
+        Flan::dlsArtSrc source;
+        Flan::dlsArtDst destination;
+        i32 low;
+        i32 high;
+    };
+    constexpr ConnectionRange dls_connections[] = {
+        { Flan::CONN_SRC_NONE, Flan::CONN_DST_LFO_FREQUENCY, -55791973, 0 },
+        { Flan::CONN_SRC_NONE, Flan::CONN_DST_LFO_STARTDELAY, -783819269, 0 },
+        { Flan::CONN_SRC_LFO, Flan::CONN_DST_GAIN, -6553600, 6553600 },
+        { Flan::CONN_SRC_LFO, Flan::CONN_DST_PITCH, -6553600, 6553600 },
+        { Flan::CONN_SRC_NONE, Flan::CONN_DST_EG1_ATTACKTIME, -783819269, 131072000 },
+        { Flan::CONN_SRC_NONE, Flan::CONN_DST_EG1_DECAYTIME, -783819269, 262144000 },
+        { Flan::CONN_SRC_NONE, Flan::CONN_DST_EG1_SUSTAINLEVEL, 0, 65536000 },
+        { Flan::CONN_SRC_NONE, Flan::CONN_DST_EG1_RELEASETIME, -783819269, 262144000 },
+        { Flan::CONN_SRC_NONE, Flan::CONN_DST_EG2_ATTACKTIME, -783819269, 131072000 },
+        { Flan::CONN_SRC_NONE, Flan::CONN_DST_EG2_DECAYTIME, -783819269, 262144000 },
+        { Flan::CONN_SRC_NONE, Flan::CONN_DST_EG2_SUSTAINLEVEL, 0, 65536000 },
+        { Flan::CONN_SRC_NONE, Flan::CONN_DST_EG2_RELEASETIME, -783819269, 262144000 },
+        { Flan::CONN_SRC_EG2, Flan::CONN_DST_PITCH, -78643200, 78643200 },
+        { Flan::CONN_SRC_NONE, Flan::CONN_DST_PAN, -32768000, 32768000 },
+    };
+
+    struct ConnectionBlock {
+        Flan::dlsArtSrc source;
+        Flan::dlsArtSrc control;
+        Flan::dlsArtDst destination;
+        Flan::dlsArtTrn transform;
+        i32 scale;
+    };
+
+    bool write_dls(FILE* file, const GeneratorSettings& settings) {
+        RiffWriter riff(file);
+        Random random{ settings.seed };
+
+        // Wave data (PCM) and the loop header in wsmp are the biggest parts, so check those before writing anything
+        const u32 frame_size = settings.wave_bits / 8 * settings.wave_channels;
+        const u64 wave_bytes = (static_cast<u64>(settings.sample_frames) * frame_size + 128) * settings.n_samples;
+        const u64 instrument_bytes = static_cast<u64>(settings.n_instruments) * settings.n_zones * (128 + settings.n_generators * sizeof(ConnectionBlock));
+        if (wave_bytes + instrument_bytes > 0xFFFFFFFFull) {
+            printf("[ERROR] The sample data doesn't fit in a RIFF file!\n");
+            return false;
+        }
+
+        riff.begin_list("RIFF", "DLS ");
+        const u32 n_instruments = settings.n_presets;
+        riff.chunk("colh", &n_instruments, sizeof(n_instruments));
+
+        // DLS has no separate preset layer, every instrument has its own bank and program
+        riff.begin_list("LIST", "lins");
+        for (u32 i = 0; i < n_instruments; i++) {
+            riff.begin_list("LIST", "ins ");
+            u16 bank, program;
+            preset_number(i, bank, program);
+            const Flan::DlsInsh insh{ settings.n_zones, static_cast<u32>(bank) << 8, program };
+            riff.chunk("insh", &insh, sizeof(insh));
+
+            riff.begin_list("LIST", "lrgn");
+            for (u32 z = 0; z < settings.n_zones; z++) {
+                riff.begin_list("LIST", "rgn ");
+                const u32 sample_index = static_cast<u32>((static_cast<u64>(i) * settings.n_zones + z) % settings.n_samples);
+                u8 key_low, key_high;
+                zone_key_range(z, settings.n_zones, key_low, key_high);
+                const Flan::dlsRgnh rgnh{ key_low, key_high, 0, 127, 0, 0, 0 };
+                riff.chunk("rgnh", &rgnh, sizeof(rgnh));
+
+                u32 loop_start, loop_end;
+                sample_loop(sample_index, settings.sample_frames, loop_start, loop_end);
+                Flan::dlsWsmp wsmp{};
+                wsmp.struct_size = 20;
+                wsmp.root_key = static_cast<u16>(48 + sample_index % 24);
+                wsmp.loop_mode = 1;
+                wsmp.wsloop_size = 16;
+                wsmp.loop_start = loop_start;
+                wsmp.loop_length = loop_end - loop_start;
+                riff.chunk("wsmp", &wsmp, sizeof(wsmp));
+
+                const Flan::dlsWlnk wlnk{ 0, 0, 1, sample_index };
+                riff.chunk("wlnk", &wlnk, sizeof(wlnk));
+
+                if (settings.n_generators > 0) {
+                    std::vector<u32> art1 = { 8, settings.n_generators };
+                    for (u32 g = 0; g < settings.n_generators; g++) {
+                        const ConnectionRange& range = dls_connections[random.next() % std::size(dls_connections)];
+                        const ConnectionBlock block{ range.source, Flan::CONN_SRC_NONE, range.destination, Flan::CONN_TRN_NONE, random.range(range.low, range.high) };
+                        const size_t offset = art1.size();
+                        art1.resize(offset + sizeof(block) / sizeof(u32));
+                        memcpy(&art1[offset], &block, sizeof(block));
+                    }
+                    riff.begin_list("LIST", "lart");
+                    riff.chunk("art1", art1);
+                    riff.end_list();
+                }
+                riff.end_list();
+            }
+            riff.end_list();
+
+            char name[20];
+            set_name(name, "Instrument", i);
+            riff.begin_list("LIST", "INFO");
+            riff.chunk("INAM", name, static_cast<u32>(strlen(name) + 1));
+            riff.end_list();
+            riff.end_list();
+        }
+        riff.end_list();
+
+        // The pool table has the offset of every wave, from the start of the wave pool's data
+        std::vector<u32> ptbl = { 8, settings.n_samples };
+        const u32 data_size = settings.sample_frames * frame_size;
+        const u32 wave_size = 12 + (8 + 16) + (8 + sizeof(Flan::dlsWsmp)) + 8 + data_size + data_size % 2;
+        for (u32 s = 0; s < settings.n_samples; s++)
+            ptbl.push_back(s * wave_size);
+        riff.chunk("ptbl", ptbl);
+
+        riff.begin_list("LIST", "wvpl");
+        std::vector<i16> data;
+        std::vector<u8> wave;
+        for (u32 s = 0; s < settings.n_samples; s++) {
+            riff.begin_list("LIST", "wave");
+            struct {
+                u16 format_tag = 1;
+                u16 n_channels = 1;
+                u32 sample_rate = 44100;
+                u32 byte_rate = 44100 * 2;
+                u16 block_align = 2;
+                u16 bits_per_sample = 16;
+            } fmt;
+            fmt.n_channels = static_cast<u16>(settings.wave_channels);
+            fmt.byte_rate = fmt.sample_rate * frame_size;
+            fmt.block_align = static_cast<u16>(frame_size);
+            fmt.bits_per_sample = static_cast<u16>(settings.wave_bits);
+            riff.chunk("fmt ", &fmt, sizeof(fmt));
+
+            u32 loop_start, loop_end;
+            sample_loop(s, settings.sample_frames, loop_start, loop_end);
+            Flan::dlsWsmp wsmp{};
+            wsmp.struct_size = 20;
+            wsmp.root_key = static_cast<u16>(48 + s % 24);
+            wsmp.loop_mode = 1;
+            wsmp.wsloop_size = 16;
+            wsmp.loop_start = loop_start;
+            wsmp.loop_length = loop_end - loop_start;
+            riff.chunk("wsmp", &wsmp, sizeof(wsmp));
+
+            generate_sample(data, s, settings.sample_frames, settings.seed);
+            if (settings.wave_bits == 16 && settings.wave_channels == 1) {
+                riff.chunk("data", data);
+            }
+            else {
+                encode_wave(data, settings.wave_bits, settings.wave_channels, wave);
+                riff.chunk("data", wave);
+            }
+            riff.end_list();
+        }
+        riff.end_list();
+
+        riff.begin_list("LIST", "INFO");
+        riff.chunk("INAM", "Synthetic soundfont", 20);
+        riff.end_list();
+        riff.end_list();
+        return true;
+    }
+
+    void print_usage() {
+        const GeneratorSettings defaults;
+        printf("Usage: soundfont_generator <output.sf2|output.dls> [options]\n");
+        printf("  --presets n       Number of presets (%u). In .dls files, every preset is an instrument\n", defaults.n_presets);
+        printf("  --instruments n   Number of instruments (%u), up to 65536\n", defaults.n_instruments);
+        printf("  --preset-zones n  Zones per preset, SF2 only (%u)\n", defaults.n_preset_zones);
+        printf("  --zones n         Zones per instrument (%u)\n", defaults.n_zones);
+        printf("  --generators n    Generators (SF2) or connection blocks (DLS) per instrument zone (%u)\n", defaults.n_generators);
+        printf("  --modulators n    Modulators per instrument zone, SF2 only (%u)\n", defaults.n_modulators);
+        printf("  --preset-generators n  Generators per preset zone, plus global preset and instrument zones with as many, SF2 only (%u)\n", defaults.n_preset_generators);
+        printf("  --samples n       Number of samples (%u), up to 65536\n", defaults.n_samples);
+        printf("  --sample-frames n Length of each sample (%u)\n", defaults.sample_frames);
+        printf("  --bits n          Bits per sample of the waves, DLS only: 8, 16 or 24 (%u)\n", defaults.wave_bits);
+        printf("  --channels n      Channels of the waves, DLS only: 1 or 2 (%u)\n", defaults.wave_channels);
+        printf("  --seed n          Seed for the random generators and samples (%u)\n", defaults.seed);
+    }
+}
+
+int main(const int argc, char** argv) {
+    if (argc < 2) {
+        print_usage();
+        return 1;
+    }
+    const std::string path = argv[1];
+    GeneratorSettings settings;
+    for (int i = 2; i < argc; i++) {
+        const std::string option = argv[i];
+        if (i + 1 >= argc) {
+            printf("[ERROR] Missing a value for '%s'\n", option.c_str());
+            return 1;
+        }
+        const u32 value = static_cast<u32>(strtoul(argv[++i], nullptr, 10));
+        if (option == "--presets") settings.n_presets = value;
+        else if (option == "--instruments") settings.n_instruments = value;
+        else if (option == "--preset-zones") settings.n_preset_zones = value;
+        else if (option == "--zones") settings.n_zones = value;
+        else if (option == "--generators") settings.n_generators = value;
+        else if (option == "--modulators") settings.n_modulators = value;
+        else if (option == "--preset-generators") settings.n_preset_generators = value;
+        else if (option == "--samples") settings.n_samples = value;
+        else if (option == "--sample-frames") settings.sample_frames = value;
+        else if (option == "--bits") settings.wave_bits = value;
+        else if (option == "--channels") settings.wave_channels = value;
+        else if (option == "--seed") settings.seed = value;
+        else {
+            printf("[ERROR] Unknown option '%s'\n", option.c_str());
+            print_usage();
+            return 1;
+        }
+    }
+    if (settings.n_presets == 0 || settings.n_instruments == 0 || settings.n_zones == 0 || settings.n_samples == 0 || settings.sample_frames == 0) {
+        printf("[ERROR] There has to be at least one preset, instrument, zone, sample and sample frame\n");
+        return 1;
+    }
+    if (settings.n_presets > 128 * 128) {
+        printf("[ERROR] There are only %u melodic bank and program numbers\n", 128 * 128);
+        return 1;
+    }
+    if (settings.n_instruments > 65536 || settings.n_samples > 65536) {
+        printf("[ERROR] Instruments and samples are numbered with 16 bits in .sf2 files, so there can be at most 65536 of each\n");
+        return 1;
+    }
+    if ((settings.wave_bits != 8 && settings.wave_bits != 16 && settings.wave_bits != 24) || (settings.wave_channels != 1 && settings.wave_channels != 2)) {
+        printf("[ERROR] Waves can only have 8, 16 or 24 bits, and 1 or 2 channels\n");
+        return 1;
+    }
+    if (settings.seed == 0)
+        settings.seed = 1;
+
+    const bool dls = path.size() >= 4 && (path.compare(path.size() - 4, 4, ".dls") == 0 || path.compare(path.size() - 4, 4, ".DLS") == 0);
+    FILE* file = nullptr;
+    if (fopen_s(&file, path.c_str(), "wb") != 0 || !file) {
+        printf("[ERROR] Could not open '%s' for writing!\n", path.c_str());
+        return 1;
+    }
+    const bool ok = dls ? write_dls(file, settings) : write_sf2(file, settings);
+    const u64 size = Flan::file_tell(file);
+    fclose(file);
+    if (!ok) {
+        remove(path.c_str());
+        return 1;
+    }
+    printf("Wrote '%s' (%.2f MB)\n", path.c_str(), static_cast<f64>(size) / (1 << 20));
+    return 0;
+}